@@ -0,0 +1,50 @@
+#!/bin/sh
+# Compare dispatch strategies, loop traces and the JIT on the workloads in
+# this directory.
+#
+# Each strategy gets its own release build without the JIT and runs with
+# loop traces off, TRACES runs the switch build with loop traces on, and
+# JIT runs the default build with the JIT enabled; a separate counting build
+# supplies the number of executed instructions so results can be reported
+# as instructions per second.
+#
+# Usage: bench/run.sh [build-root]
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BUILD=${1:-"$ROOT/_bench_build"}
+STRATEGIES="SWITCH COMPUTED_GOTO THREADED"
+
+build() {
+    cmake -S "$ROOT" -B "$BUILD/$1" $2 >/dev/null
+    cmake --build "$BUILD/$1" >/dev/null
+}
+
+for strategy in $STRATEGIES; do
+    build "$strategy" "-DKAVYA_DISPATCH=$strategy -DKAVYA_JIT=OFF"
+done
+build JIT "-DKAVYA_JIT=ON"
+build count "-DKAVYA_COUNT_INSTRUCTIONS=ON"
+
+now() {
+    date +%s.%N
+}
+
+printf "%-14s %-14s %12s %10s %14s\n" workload strategy instructions seconds "instr/sec"
+for script in "$ROOT"/bench/*.kav; do
+    name=$(basename "$script" .kav)
+    count=$("$BUILD/count/kavya" "$script" 2>&1 >/dev/null | sed -n 's/^instructions: //p')
+    for strategy in $STRATEGIES TRACES JIT; do
+        case $strategy in
+        TRACES) command="$BUILD/SWITCH/kavya" ;;
+        JIT) command="$BUILD/JIT/kavya" ;;
+        *) command="$BUILD/$strategy/kavya --no-loop-traces" ;;
+        esac
+        start=$(now)
+        $command "$script" >/dev/null
+        end=$(now)
+        awk -v n="$name" -v s="$strategy" -v c="$count" -v a="$start" -v b="$end" \
+            'BEGIN { t = b - a; printf "%-14s %-14s %12d %10.3f %14.0f\n", n, s, c, t, c / t }'
+    done
+done
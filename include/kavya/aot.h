@@ -0,0 +1,212 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "object.h"
+#include "vm.h"
+
+// `kavya --emit-c` lowers a compiled chunk to a C function in a file that
+// is built against this runtime. Every bytecode instruction becomes one of
+// the statement macros below, each doing what its case in run() does, on
+// the generated function's locals: `sp` for the stack top, plus `slots`,
+// `globals` and `constants`. Jumps become gotos between labels named after
+// bytecode offsets.
+
+typedef InterpretResult (*AotScript)(void);
+
+void emitC(Chunk *chunk, const char *path, FILE *out);
+int aotMain(const char *const *globalNames, int maxStackDepth, AotScript script);
+void aotError(const char *format, ...);
+
+static inline Value aotDouble(uint64_t bits)
+{
+    double number;
+    memcpy(&number, &bits, sizeof(number));
+    return NUMBER_VAL(number);
+}
+
+#define AOT_PEEK(distance) (sp[-1 - (distance)])
+#define AOT_TOP AOT_PEEK(0)
+#define AOT_ERROR(...)                       \
+    do                                       \
+    {                                        \
+        aotError(__VA_ARGS__);               \
+        return INTERPRET_RUNTIME_ERROR;      \
+    } while (false)
+#define AOT_BINARY(op)                                      \
+    do                                                      \
+    {                                                       \
+        if (!IS_NUMBER(AOT_PEEK(0)) || !IS_NUMBER(AOT_PEEK(1))) \
+            AOT_ERROR("Operands must be numbers.");         \
+        Value b = *--sp;                                    \
+        AOT_TOP = op(AOT_TOP, b);                           \
+    } while (false)
+#define AOT_NUMBER_BINARY(op)     \
+    do                            \
+    {                             \
+        Value b = *--sp;          \
+        AOT_TOP = op(AOT_TOP, b); \
+    } while (false)
+#define AOT_UNDEFINED_CHECK(slot)                                   \
+    do                                                              \
+    {                                                               \
+        if (IS_UNDEFINED(globals[slot]))                            \
+            AOT_ERROR("Undefined variable '%s'.",                   \
+                      globalName(slot));                            \
+    } while (false)
+
+#define AOT_CONSTANT(index) (*sp++ = constants[index])
+#define AOT_NULL() (*sp++ = NULL_VAL)
+#define AOT_TRUE() (*sp++ = BOOL_VAL(true))
+#define AOT_FALSE() (*sp++ = BOOL_VAL(false))
+#define AOT_POP() (sp--)
+#define AOT_GET_LOCAL(slot) (*sp++ = slots[slot])
+#define AOT_SET_LOCAL(slot) (slots[slot] = AOT_TOP)
+#define AOT_GET_GLOBAL(slot)         \
+    do                               \
+    {                                \
+        AOT_UNDEFINED_CHECK(slot);   \
+        *sp++ = globals[slot];       \
+    } while (false)
+#define AOT_DEFINE_GLOBAL(slot) (globals[slot] = *--sp)
+#define AOT_SET_GLOBAL(slot)         \
+    do                               \
+    {                                \
+        AOT_UNDEFINED_CHECK(slot);   \
+        globals[slot] = AOT_TOP;     \
+    } while (false)
+#define AOT_EQUAL()                                  \
+    do                                               \
+    {                                                \
+        Value b = *--sp;                             \
+        AOT_TOP = BOOL_VAL(valuesEqual(AOT_TOP, b)); \
+    } while (false)
+#define AOT_GREATER() AOT_BINARY(numberGreater)
+#define AOT_LESS() AOT_BINARY(numberLess)
+#define AOT_GREATER_EQUAL() AOT_BINARY(numberGreaterEqual)
+#define AOT_LESS_EQUAL() AOT_BINARY(numberLessEqual)
+#define AOT_NOT_EQUAL()                               \
+    do                                                \
+    {                                                 \
+        Value b = *--sp;                              \
+        AOT_TOP = BOOL_VAL(!valuesEqual(AOT_TOP, b)); \
+    } while (false)
+#define AOT_ADD()                                                        \
+    do                                                                   \
+    {                                                                    \
+        if (IS_STRING(AOT_PEEK(0)) && IS_STRING(AOT_PEEK(1)))            \
+        {                                                                \
+            Value b = *--sp;                                             \
+            AOT_TOP = concatenate(AS_STRING(AOT_TOP), AS_STRING(b));     \
+        }                                                                \
+        else if (IS_NUMBER(AOT_PEEK(0)) && IS_NUMBER(AOT_PEEK(1)))       \
+        {                                                                \
+            Value b = *--sp;                                             \
+            AOT_TOP = numberAdd(AOT_TOP, b);                             \
+        }                                                                \
+        else                                                             \
+        {                                                                \
+            AOT_ERROR("Operands must be two numbers or two strings.");   \
+        }                                                                \
+    } while (false)
+#define AOT_SUBTRACT() AOT_BINARY(numberSubtract)
+#define AOT_MULTIPLY() AOT_BINARY(numberMultiply)
+#define AOT_DIVIDE() AOT_BINARY(numberDivide)
+#define AOT_ADD_NN() AOT_NUMBER_BINARY(numberAdd)
+#define AOT_SUBTRACT_NN() AOT_NUMBER_BINARY(numberSubtract)
+#define AOT_MULTIPLY_NN() AOT_NUMBER_BINARY(numberMultiply)
+#define AOT_DIVIDE_NN() AOT_NUMBER_BINARY(numberDivide)
+#define AOT_GREATER_NN() AOT_NUMBER_BINARY(numberGreater)
+#define AOT_LESS_NN() AOT_NUMBER_BINARY(numberLess)
+#define AOT_GREATER_EQUAL_NN() AOT_NUMBER_BINARY(numberGreaterEqual)
+#define AOT_LESS_EQUAL_NN() AOT_NUMBER_BINARY(numberLessEqual)
+#define AOT_NOT() (AOT_TOP = BOOL_VAL(isFalsey(AOT_TOP)))
+#define AOT_NEGATE()                                \
+    do                                              \
+    {                                               \
+        if (!IS_NUMBER(AOT_TOP))                    \
+            AOT_ERROR("Operand must be a number."); \
+        AOT_TOP = numberNegate(AOT_TOP);            \
+    } while (false)
+#define AOT_WRITE()           \
+    do                        \
+    {                         \
+        printValue(*--sp);    \
+        printf("\n");         \
+    } while (false)
+#define AOT_ASK()                                        \
+    do                                                   \
+    {                                                    \
+        if (!readInput(AS_STRING(AOT_TOP), &AOT_TOP))    \
+            return INTERPRET_RUNTIME_ERROR;              \
+    } while (false)
+#define AOT_CONCAT_N(count)                                            \
+    do                                                                 \
+    {                                                                  \
+        Value *parts = sp - (count);                                   \
+        if (!concatenateValues(parts, (count), &parts[0]))             \
+            AOT_ERROR("Operands must be two numbers or two strings."); \
+        sp = parts + 1;                                                \
+    } while (false)
+#define AOT_TO_STRING() (AOT_TOP = stringify(AOT_TOP))
+#define AOT_JUMP(label) goto label
+#define AOT_JUMP_IF_FALSE(label)   \
+    do                             \
+    {                              \
+        if (isFalsey(AOT_TOP))     \
+            goto label;            \
+    } while (false)
+#define AOT_RETURN() return INTERPRET_OK
+#define AOT_ADD_LOCAL_CONSTANT(slot, index)                                   \
+    do                                                                        \
+    {                                                                         \
+        Value constant = constants[index];                                    \
+        if (IS_NUMBER(slots[slot]) && IS_NUMBER(constant))                    \
+            slots[slot] = numberAdd(slots[slot], constant);                   \
+        else if (IS_STRING(slots[slot]) && IS_STRING(constant))               \
+            slots[slot] = concatenate(AS_STRING(slots[slot]),                 \
+                                      AS_STRING(constant));                   \
+        else                                                                  \
+            AOT_ERROR("Operands must be two numbers or two strings.");        \
+    } while (false)
+#define AOT_SET_LOCAL_POP(slot) (slots[slot] = *--sp)
+#define AOT_GET_LOCAL_2(first, second) \
+    do                                 \
+    {                                  \
+        *sp++ = slots[first];          \
+        *sp++ = slots[second];         \
+    } while (false)
+#define AOT_JUMP_IF_NOT(compare, label)                         \
+    do                                                          \
+    {                                                           \
+        if (!IS_NUMBER(AOT_PEEK(0)) || !IS_NUMBER(AOT_PEEK(1))) \
+            AOT_ERROR("Operands must be numbers.");             \
+        sp -= 2;                                                \
+        if (!compare(sp[0], sp[1]))                             \
+            goto label;                                         \
+    } while (false)
+#define AOT_JUMP_IF_NOT_LESS(label) AOT_JUMP_IF_NOT(numbersLess, label)
+#define AOT_JUMP_IF_NOT_GREATER(label) AOT_JUMP_IF_NOT(numbersGreater, label)
+#define AOT_FOR_RANGE(slot, step, limit, label)                        \
+    do                                                                 \
+    {                                                                  \
+        if (!IS_NUMBER(slots[slot]))                                   \
+            AOT_ERROR("Operands must be two numbers or two strings."); \
+        slots[slot] = numberAdd(slots[slot], constants[step]);         \
+        if (numbersLess(slots[slot], constants[limit]))                \
+            goto label;                                                \
+    } while (false)
+#define AOT_NUMBER_JUMP_IF_NOT(compare, label) \
+    do                                         \
+    {                                          \
+        sp -= 2;                               \
+        if (!compare(sp[0], sp[1]))            \
+            goto label;                        \
+    } while (false)
+#define AOT_JUMP_IF_NOT_LESS_NN(label) AOT_NUMBER_JUMP_IF_NOT(numbersLess, label)
+#define AOT_JUMP_IF_NOT_GREATER_NN(label) AOT_NUMBER_JUMP_IF_NOT(numbersGreater, label)
+// A match instruction opens a switch on the jump table entry the subject
+// takes; the emitter supplies its cases.
+#define AOT_MATCH_TABLE(lowest, count) switch (matchRange(*--sp, constants[lowest], count))
+#define AOT_MATCH_HASH(keys, capacity) switch (matchHash(*--sp, &constants[keys], capacity))
\ No newline at end of file
@@ -12,9 +12,9 @@ typedef enum
     OP_POP,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
-    OP_GET_GLOBAL,
-    OP_DEFINE_GLOBAL,
-    OP_SET_GLOBAL,
+    OP_GET_GLOBAL_SLOT,
+    OP_DEFINE_GLOBAL_SLOT,
+    OP_SET_GLOBAL_SLOT,
     OP_EQUAL,
     OP_IS,
     OP_GREATER,
@@ -31,8 +31,65 @@ typedef enum
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_RETURN,
+    // Superinstructions fused by the compiler.
+    OP_ADD_LOCAL_CONSTANT,
+    OP_SET_LOCAL_POP,
+    OP_GET_LOCAL_2,
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_GREATER,
+    // Closes a counted loop: adds a constant to a local and jumps back while
+    // it is below another constant. The 16-bit offset comes first, then the
+    // slot and the two constant indices.
+    OP_FOR_RANGE,
+    // Negated comparisons the peephole pass fuses from a comparison and the
+    // OP_NOT after it.
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
+    OP_NOT_EQUAL,
+    // Specialized forms the VM quickens instructions into at run time.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_EQUAL_NUM,
+    // Unchecked forms the type inference pass emits where it has proven
+    // both operands are numbers.
+    OP_ADD_NN,
+    OP_SUBTRACT_NN,
+    OP_MULTIPLY_NN,
+    OP_DIVIDE_NN,
+    OP_GREATER_NN,
+    OP_LESS_NN,
+    OP_GREATER_EQUAL_NN,
+    OP_LESS_EQUAL_NN,
+    OP_JUMP_IF_NOT_LESS_NN,
+    OP_JUMP_IF_NOT_GREATER_NN,
+    // Multi-way branches compiled from match statements. Each pops the
+    // subject and takes one entry of the jump table that follows it: a run
+    // of OP_JUMPs, or of OP_JUMP_LONGs, whose last entry is for subjects no
+    // case matches. OP_MATCH_TABLE has the 24-bit constant index of the
+    // lowest integer case and a 16-bit entry count without the default;
+    // entry i is for that integer plus i. OP_MATCH_HASH has the 24-bit
+    // index of a run of constants forming an open-addressing hash table of
+    // the cases and its 16-bit capacity; entry i is for the case in slot i.
+    OP_MATCH_TABLE,
+    OP_MATCH_HASH,
+    // Joins the top N values, N being its operand, the way a chain of
+    // OP_ADDs would, allocating and interning strings only once.
+    OP_CONCAT_N,
+    // Replaces the top value with the string printValue() would write.
+    OP_TO_STRING,
+    // Wide forms used once an operand outgrows the short encoding: 24-bit
+    // constant and global indices and 32-bit jump offsets.
+    OP_CONSTANT_LONG,
+    OP_GET_GLOBAL_SLOT_LONG,
+    OP_DEFINE_GLOBAL_SLOT_LONG,
+    OP_SET_GLOBAL_SLOT_LONG,
+    OP_JUMP_LONG,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_LOOP_LONG,
 } OpCode;
 
+#define UINT24_MAX 0xffffff
+
 typedef struct
 {
     int count;
@@ -40,9 +97,43 @@ typedef struct
     uint8_t *code;
     int *lines;
     ValueArray constants;
+    // Handler addresses for direct-threaded dispatch, built lazily by run().
+    void **threaded;
+    // Set once the code has been lowered to register instructions.
+    bool registerCode;
+    // Deepest the stack can get while running this chunk.
+    int maxStackDepth;
+    // Native code compiled by the JIT once the chunk's loops get hot.
+    struct JitCode *jitCode;
+    int backEdges;
+    // Recorded loop traces, for hot loops the JIT does not run.
+    struct LoopTraces *loopTraces;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chuck, uint8_t byte, int line);
-int addConstant(Chunk *chunk, Value value);
\ No newline at end of file
+int addConstant(Chunk *chunk, Value value);
+int instructionLength(Chunk *chunk, int offset);
+bool isJumpInstruction(uint8_t instruction);
+bool isBackwardJump(uint8_t instruction);
+int jumpTarget(Chunk *chunk, int offset);
+int stackEffect(uint8_t instruction);
+int instructionStackEffect(Chunk *chunk, int offset);
+bool isMatchInstruction(uint8_t instruction);
+int matchEntryCount(Chunk *chunk, int offset);
+uint32_t matchKeyHash(Value key);
+int matchRange(Value subject, Value lowest, int count);
+int matchHash(Value subject, const Value *keys, int capacity);
+
+// Where entry `index` of the jump table starting at `entries` leads.
+static inline uint8_t *matchEntryTarget(uint8_t *entries, int index)
+{
+    if (entries[0] == OP_JUMP_LONG)
+    {
+        uint8_t *entry = entries + index * 5;
+        return entry + 5 + (((uint32_t)entry[1] << 24) | (entry[2] << 16) | (entry[3] << 8) | entry[4]);
+    }
+    uint8_t *entry = entries + index * 3;
+    return entry + 3 + ((entry[1] << 8) | entry[2]);
+}
\ No newline at end of file
@@ -1,6 +1,42 @@
 #pragma once
 
+#include "ir.h"
+#include "types.h"
 #include "vm.h"
 #include "object.h"
 
-bool compile(const char *source, Chunk *chunk);
\ No newline at end of file
+typedef enum
+{
+    TARGET_STACK,
+    TARGET_REGISTER
+} CompileTarget;
+
+typedef struct
+{
+    int constantGlobals;
+    int inlinedGlobalReads;
+    int foldedOperations;
+    int peepholeRewrites;
+    IrStats ir;
+    TypeStats types;
+    // Time spent in compile(), in nanoseconds.
+    int64_t compileNanos;
+} CompileStats;
+
+extern CompileTarget compileTarget;
+// Set by --dump-bytecode to disassemble each chunk once it is compiled.
+extern bool dumpBytecode;
+// Set by -O: 0 compiles the source as written, 1 adds constant folding, the
+// peephole pass and type inference, and 2 also runs the chunk through the
+// IR.
+extern int optimizationLevel;
+extern CompileStats compileStats;
+
+bool compile(const char *source, Chunk *chunk);
+// Compile a source a batch of top-level declarations at a time, each into
+// its own chunk that can run before the next is compiled. compileBatch()
+// sets `last` once the source is used up and returns false if any batch so
+// far had a compile error.
+void beginBatches(const char *source);
+bool compileBatch(Chunk *chunk, bool *last);
+void endBatches();
\ No newline at end of file
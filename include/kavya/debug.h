@@ -2,5 +2,7 @@
 
 #include "chunk.h"
 
+// The OP_ name of a stack opcode, or NULL if it is not one.
+const char *opcodeName(uint8_t opcode);
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
\ No newline at end of file
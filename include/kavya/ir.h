@@ -0,0 +1,64 @@
+#pragma once
+
+#include "chunk.h"
+
+// The middle end behind -O2. A finished stack chunk is lifted into basic
+// blocks linked into a control-flow graph, optimized there and lowered
+// back to a chunk. Instructions keep their bytecode opcodes, always in the
+// short form; unconditional jumps become block successors instead, and an
+// OP_FOR_RANGE is split into the instructions it fuses.
+
+typedef struct
+{
+    uint8_t op;
+    // Constant index, local slot or global slot, and the constant index of
+    // an OP_ADD_LOCAL_CONSTANT.
+    int operand;
+    int operand2;
+    // Block a conditional jump goes to.
+    int target;
+    int line;
+    // Set on the OP_SET_LOCAL_POP that moves a value down over a hoisted
+    // temporary at a loop exit, which is not a store to a variable.
+    bool moves;
+} IrInstruction;
+
+typedef struct
+{
+    IrInstruction *code;
+    int count;
+    int capacity;
+    // Block control reaches after the last instruction, by falling through
+    // or jumping, or -1 after OP_RETURN.
+    int next;
+    bool removed;
+} BasicBlock;
+
+typedef struct
+{
+    Chunk *chunk;
+    BasicBlock *blocks;
+    int count;
+    int capacity;
+    // Blocks in the order they are laid out in code, starting with the
+    // entry.
+    int *layout;
+    int layoutCount;
+    int layoutCapacity;
+} ControlFlowGraph;
+
+typedef struct
+{
+    int branchesFolded;
+    int blocksRemoved;
+    int deadInstructions;
+    int invariantsHoisted;
+} IrStats;
+
+// Runs the chunk through the graph. Returns false, leaving the chunk as it
+// was, if it is too large for the lowering's short jumps.
+bool optimizeChunk(Chunk *chunk, IrStats *stats);
+void buildGraph(ControlFlowGraph *graph, Chunk *chunk);
+void optimizeGraph(ControlFlowGraph *graph, IrStats *stats);
+bool lowerGraph(ControlFlowGraph *graph, Chunk *chunk);
+void freeGraph(ControlFlowGraph *graph);
\ No newline at end of file
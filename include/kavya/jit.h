@@ -0,0 +1,26 @@
+#pragma once
+
+#include "chunk.h"
+
+// The baseline JIT emits x86-64 code that works on NaN-boxed values in
+// place. Native code does not count instructions, so counting builds
+// always interpret.
+#if defined(KAVYA_JIT) &&                                            \
+    (!defined(__x86_64__) || !defined(__unix__) || !defined(NAN_BOXING) || \
+     defined(KAVYA_COUNT_INSTRUCTIONS))
+#undef KAVYA_JIT
+#endif
+
+// Loop iterations a chunk runs in the interpreter before it is compiled.
+#define JIT_THRESHOLD 100
+
+typedef struct JitCode JitCode;
+
+// Cleared by --no-jit; hot loops then run as loop traces, if enabled.
+extern bool jitEnabled;
+
+#ifdef KAVYA_JIT
+bool jitCompile(Chunk *chunk);
+int jitRun(Chunk *chunk, int offset);
+void jitFree(Chunk *chunk);
+#endif
\ No newline at end of file
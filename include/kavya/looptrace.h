@@ -0,0 +1,27 @@
+#pragma once
+
+#include "chunk.h"
+
+// Loop traces are plain C and run on any host, but like the JIT they skip
+// the per-instruction hook of counting builds.
+#ifndef KAVYA_COUNT_INSTRUCTIONS
+#define KAVYA_LOOP_TRACES
+#endif
+
+// Times a back edge reaches a loop header before one iteration of the loop
+// is recorded.
+#define LOOP_TRACE_THRESHOLD 100
+
+typedef struct LoopTraces LoopTraces;
+
+// Cleared by --no-loop-traces to interpret loops the JIT does not run.
+extern bool loopTracesEnabled;
+
+// Returned by loopTraceBackEdge() when a limit stopped the script; the
+// error has already been reported.
+#define LOOP_TRACE_STOPPED -1
+
+#ifdef KAVYA_LOOP_TRACES
+int loopTraceBackEdge(Chunk *chunk, int header);
+void freeLoopTraces(Chunk *chunk);
+#endif
\ No newline at end of file
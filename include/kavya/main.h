@@ -3,7 +3,4 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
-
 #define UINT8_COUNT (UINT8_MAX + 1)
\ No newline at end of file
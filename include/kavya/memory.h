@@ -3,7 +3,7 @@
 #include "object.h"
 
 #define ALLOCATE(type, count) \
-    (type *)reallocate(NULL, 0, sizeof(type) * count)
+    (type *)reallocate(NULL, 0, sizeof(type) * (count))
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "chunk.h"
+
+// Rewrites a finished stack chunk in place: fuses a comparison and the
+// OP_NOT after it into one negated comparison, threads jumps that land on
+// unconditional jumps, and drops jumps to the next instruction and values
+// pushed only to be popped. Jump offsets and lines are remapped to the
+// compacted code. Returns the number of rewrites made.
+int optimizePeepholes(Chunk *chunk);
\ No newline at end of file
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "chunk.h"
+
+// The flight recorder keeps the last instructions run() executed, without
+// doing any I/O, so that a runtime error can show how the script got there.
+#define FLIGHT_RECORDER_SIZE 256
+
+// Only the jumps the interpreter takes are stored, in a ring buffer; the
+// instructions in between ran one after another, and the dump reads them
+// back from the chunk being run. Every jump but a hand-off from the JIT or
+// a loop trace ends at least one instruction, so twice as many jumps as
+// instructions are kept.
+#define FLIGHT_RECORDER_JUMPS (2 * FLIGHT_RECORDER_SIZE)
+typedef struct
+{
+    Chunk *chunk;
+    // Where each jump left the straight run of instructions before it, and
+    // where the next run starts.
+    uint8_t *from[FLIGHT_RECORDER_JUMPS];
+    uint8_t *to[FLIGHT_RECORDER_JUMPS];
+    // Jumps recorded so far; the ring index is this modulo the size.
+    unsigned int count;
+} FlightRecorder;
+
+// Set by --flight-recorder.
+extern bool flightRecorderEnabled;
+extern FlightRecorder flightRecorder;
+
+void startFlightRecorder();
+// `ip` is where the interpreter stopped, or NULL if it is still running.
+void dumpFlightRecorder(uint8_t *ip);
+
+static inline void recordJump(uint8_t *from, uint8_t *to)
+{
+    unsigned int index = flightRecorder.count++ % FLIGHT_RECORDER_JUMPS;
+    flightRecorder.from[index] = from;
+    flightRecorder.to[index] = to;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "chunk.h"
+
+// Register instructions address the VM stack directly: register N is
+// vm.stack[N], so locals keep the slots they have in stack code. An RK
+// operand is either a register or, with RK_CONSTANT set, a constant index.
+#define RK_CONSTANT 0x80
+#define REGISTER_MAX RK_CONSTANT
+
+typedef enum
+{
+    REG_MOVE,                // A B       R(A) = R(B)
+    REG_LOADK,               // A K       R(A) = K(K)
+    REG_NULL,                // A         R(A) = null
+    REG_TRUE,                // A         R(A) = true
+    REG_FALSE,               // A         R(A) = false
+    REG_GET_GLOBAL,          // A G       R(A) = globals[G]
+    REG_DEFINE_GLOBAL,       // G B       globals[G] = RK(B)
+    REG_SET_GLOBAL,          // G B       globals[G] = RK(B)
+    REG_EQUAL,               // A B C     R(A) = RK(B) == RK(C)
+    REG_GREATER,             // A B C     R(A) = RK(B) > RK(C)
+    REG_LESS,                // A B C     R(A) = RK(B) < RK(C)
+    REG_ADD,                 // A B C     R(A) = RK(B) + RK(C)
+    REG_SUBTRACT,            // A B C     R(A) = RK(B) - RK(C)
+    REG_MULTIPLY,            // A B C     R(A) = RK(B) * RK(C)
+    REG_DIVIDE,              // A B C     R(A) = RK(B) / RK(C)
+    REG_NOT,                 // A B       R(A) = !RK(B)
+    REG_NEGATE,              // A B       R(A) = -RK(B)
+    REG_WRITE,               // B         write RK(B)
+    REG_ASK,                 // A B       R(A) = ask RK(B)
+    REG_CONCAT,              // A N       R(A) = R(A) + ... + R(A+N-1)
+    REG_TO_STRING,           // A B       R(A) = RK(B) as a string
+    REG_JUMP,                // J         ip += J
+    REG_JUMP_IF_FALSE,       // B J       if !RK(B) then ip += J
+    REG_JUMP_IF_NOT_LESS,    // B C J     if !(RK(B) < RK(C)) then ip += J
+    REG_JUMP_IF_NOT_GREATER, // B C J     if !(RK(B) > RK(C)) then ip += J
+    REG_LOOP,                // J         ip -= J
+    REG_FOR_RANGE,           // A K L J   R(A) += K(K); if R(A) < K(L) then ip -= J
+    REG_RETURN,
+} RegOpCode;
+
+bool lowerToRegisters(Chunk *chunk);
\ No newline at end of file
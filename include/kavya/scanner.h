@@ -30,6 +30,9 @@ typedef enum
     // Literals.
     TOKEN_IDENTIFIER,
     TOKEN_STRING,
+    // The part of a string before a `${`, or between a `}` and the next
+    // `${`; the string's last part is a TOKEN_STRING starting at a `}`.
+    TOKEN_INTERPOLATION,
     TOKEN_NUMBER,
     // Keywords.
     TOKEN_AND,
@@ -39,6 +42,7 @@ typedef enum
     TOKEN_FOR,
     TOKEN_PURPOSE,
     TOKEN_IF,
+    TOKEN_MATCH,
     TOKEN_NULL,
     TOKEN_OR,
     TOKEN_WRITE,
@@ -61,5 +65,22 @@ typedef struct
     int line;
 } Token;
 
+// Interpolations nested inside each other's expressions, deepest last.
+#define MAX_INTERPOLATION_DEPTH 8
+
+// Public so a compiler can save its position and scan a stretch again.
+typedef struct
+{
+    const char *start;
+    const char *current;
+    int line;
+    // Braces opened and not yet closed inside each interpolation's
+    // expression; the `}` that finds none left resumes the string.
+    int braces[MAX_INTERPOLATION_DEPTH];
+    int interpolationDepth;
+} Scanner;
+
+extern Scanner scanner;
+
 void initScanner(const char *source);
 Token scanToken();
\ No newline at end of file
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "vm.h"
+
+// Runs a script the way interpret() does, except that its top-level
+// declarations are compiled in batches on a second thread and each batch
+// runs as soon as it is ready, so a large script starts running before it
+// has been compiled in full. Batches compiled before a compile error still
+// run.
+InterpretResult interpretStreamed(const char *source, ExecutionLimits limits);
\ No newline at end of file
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "chunk.h"
+
+typedef struct
+{
+    // Checked arithmetic and comparison instructions in reachable code, and
+    // how many of them were proven to only ever see numbers.
+    int sites;
+    int proven;
+} TypeStats;
+
+// Infers which stack slots, locals and globals hold numbers at each point
+// of a finished stack chunk, following every path through it, and replaces
+// operators whose operands are proven numbers with their unchecked _NN
+// forms. Needs chunk->maxStackDepth.
+void inferTypes(Chunk *chunk, TypeStats *stats);
\ No newline at end of file
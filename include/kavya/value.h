@@ -1,16 +1,83 @@
 #pragma once
 
+#include <string.h>
+
 #include "main.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+// Doubles are stored as-is. Every other value hides in the payload of a
+// quiet NaN: singletons use small tags, integers set INT_BIT and keep a
+// 48-bit two's complement payload, and objects set the sign bit and keep
+// their pointer in the low 48 bits.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+#define INT_BIT ((uint64_t)0x0002000000000000)
+#define INT_PAYLOAD ((uint64_t)0x0000ffffffffffff)
+
+#define INT_VALUE_MIN (-((int64_t)1 << 47))
+#define INT_VALUE_MAX (((int64_t)1 << 47) - 1)
+
+#define TAG_NULL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEFINED 4
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NULL(value) ((value) == NULL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_DOUBLE(value) (((value) & QNAN) != QNAN)
+#define IS_INT(value) \
+    (((value) & (SIGN_BIT | QNAN | INT_BIT)) == (QNAN | INT_BIT))
+#define IS_OBJ(value) \
+    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_OBJ(value) \
+    ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_DOUBLE(value) valueToNum(value)
+#define AS_INT(value) ((int64_t)((value) << 16) >> 16)
+
+#define BOOL_VAL(value) ((value) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NULL_VAL ((Value)(uint64_t)(QNAN | TAG_NULL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(value) numToValue(value)
+#define INT_VAL(value) \
+    ((Value)(QNAN | INT_BIT | ((uint64_t)(int64_t)(value) & INT_PAYLOAD)))
+#define OBJ_VAL(object) \
+    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
+
+static inline double valueToNum(Value value)
+{
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num)
+{
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum
 {
     VAL_BOOL,
     VAL_NULL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_INT,
+    VAL_OBJ,
+    VAL_UNDEFINED
 } ValueType;
 
 typedef struct
@@ -20,24 +87,152 @@ typedef struct
     {
         bool boolean;
         double number;
+        int64_t integer;
         Obj *obj;
     } as;
 } Value;
 
+#define INT_VALUE_MIN INT64_MIN
+#define INT_VALUE_MAX INT64_MAX
+
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NULL(value) ((value).type == VAL_NULL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+#define IS_DOUBLE(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value) ((value).type == VAL_INT)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 #define AS_OBJ(value) ((value).as.obj)
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_DOUBLE(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NULL_VAL ((Value){VAL_NULL, {.number = 0}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
+#endif
+
+// UNDEFINED_VAL fills global slots that have been resolved but not yet
+// defined. Scripts never see it.
+
+// Numbers are either doubles or integers. Integer arithmetic stays exact
+// and falls back to doubles on overflow or when mixed with a double.
+#define IS_NUMBER(value) isNumber(value)
+#define AS_NUMBER(value) asNumber(value)
+
+static inline bool isNumber(Value value)
+{
+    return IS_DOUBLE(value) || IS_INT(value);
+}
+
+static inline double asNumber(Value value)
+{
+    return IS_INT(value) ? (double)AS_INT(value) : AS_DOUBLE(value);
+}
+
+static inline bool fitsInt(int64_t value)
+{
+    return value >= INT_VALUE_MIN && value <= INT_VALUE_MAX;
+}
+
+static inline Value numberAdd(Value a, Value b)
+{
+    int64_t result;
+    if (IS_INT(a) && IS_INT(b) &&
+        !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result) && fitsInt(result))
+        return INT_VAL(result);
+    return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value numberSubtract(Value a, Value b)
+{
+    int64_t result;
+    if (IS_INT(a) && IS_INT(b) &&
+        !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &result) && fitsInt(result))
+        return INT_VAL(result);
+    return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+// Also refuses a zero product with a negative factor, which only a double
+// can hold as -0.
+static inline bool intMultiplyOverflow(int64_t a, int64_t b, int64_t *result)
+{
+    return __builtin_mul_overflow(a, b, result) || (*result == 0 && (a < 0 || b < 0));
+}
+
+static inline Value numberMultiply(Value a, Value b)
+{
+    int64_t result;
+    if (IS_INT(a) && IS_INT(b) &&
+        !intMultiplyOverflow(AS_INT(a), AS_INT(b), &result) && fitsInt(result))
+        return INT_VAL(result);
+    return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+static inline Value numberDivide(Value a, Value b)
+{
+    return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+static inline Value numberNegate(Value a)
+{
+    // Negating 0 gives -0, which needs a double.
+    if (IS_INT(a) && AS_INT(a) != 0 && AS_INT(a) != INT_VALUE_MIN)
+        return INT_VAL(-AS_INT(a));
+    return NUMBER_VAL(-AS_NUMBER(a));
+}
+
+static inline bool isFalsey(Value value)
+{
+    return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value)) || (IS_NUMBER(value) && AS_NUMBER(value) == 0);
+}
+
+static inline bool numbersLess(Value a, Value b)
+{
+    if (IS_INT(a) && IS_INT(b))
+        return AS_INT(a) < AS_INT(b);
+    return AS_NUMBER(a) < AS_NUMBER(b);
+}
+
+static inline bool numbersGreater(Value a, Value b)
+{
+    if (IS_INT(a) && IS_INT(b))
+        return AS_INT(a) > AS_INT(b);
+    return AS_NUMBER(a) > AS_NUMBER(b);
+}
+
+static inline bool numbersEqual(Value a, Value b)
+{
+    if (IS_INT(a) && IS_INT(b))
+        return AS_INT(a) == AS_INT(b);
+    return AS_NUMBER(a) == AS_NUMBER(b);
+}
+
+static inline Value numberLess(Value a, Value b)
+{
+    return BOOL_VAL(numbersLess(a, b));
+}
+
+static inline Value numberGreater(Value a, Value b)
+{
+    return BOOL_VAL(numbersGreater(a, b));
+}
+
+// `a >= b` is `!(a < b)`, so a NaN operand makes it true.
+static inline Value numberGreaterEqual(Value a, Value b)
+{
+    return BOOL_VAL(!numbersLess(a, b));
+}
+
+static inline Value numberLessEqual(Value a, Value b)
+{
+    return BOOL_VAL(!numbersGreater(a, b));
+}
+
 typedef struct
 {
     int capacity;
@@ -46,6 +241,8 @@ typedef struct
 } ValueArray;
 
 bool valuesEqual(Value a, Value b);
+bool valuesIdentical(Value a, Value b);
+uint32_t hashValue(Value value);
 void initValueArray(ValueArray *array);
 void writeValueArray(ValueArray *array, Value value);
 void freeValueArray(ValueArray *array);
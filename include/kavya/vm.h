@@ -9,24 +9,67 @@ typedef struct
 {
     Chunk *chunk;
     uint8_t *ip;
-    Value stack[STACK_MAX];
+    Value *stack;
+    int stackCapacity;
     Value *stackTop;
-    Table globals;
+    // The compiler resolves global names to dense slots; globalSlots maps
+    // each name to its slot and globalNames maps slots back for errors.
+    Table globalSlots;
+    ValueArray globalValues;
+    ValueArray globalNames;
     Table strings;
     Obj *objects;
+    // Set while a script streams, with the compiler on another thread.
+    bool streaming;
+    // Fuel back edges may still charge before checkLimits() runs.
+    int64_t fuelCheck;
+    // Fuel left beyond fuelCheck, with INT64_MAX standing for no limit, and
+    // the monotonic time in nanoseconds to stop at, or 0 for no deadline.
+    int64_t fuel;
+    int64_t deadline;
+#ifdef KAVYA_COUNT_INSTRUCTIONS
+    unsigned long long instructionCount;
+#endif
 } VM;
 
 typedef enum
 {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    INTERPRET_LIMIT_EXCEEDED
 } InterpretResult;
 
+// Bounds on a single interpret() call; zero fields impose no limit. Fuel is
+// measured in bytecode bytes: each back edge charges the size of its loop
+// body, so the same script uses different amounts at different -O levels
+// and as register code, but the same whichever way its loops run.
+typedef struct
+{
+    int64_t fuel;
+    int64_t timeoutMs;
+} ExecutionLimits;
+
 extern VM vm;
+// Set by --trace to print the stack and each instruction as it runs.
+extern bool traceExecution;
 
 void initVM();
 void freeVM();
-InterpretResult interpret(const char *source);
+InterpretResult interpret(const char *source, ExecutionLimits limits);
+InterpretResult runChunk(Chunk *chunk);
+void setLimits(ExecutionLimits limits);
+bool checkLimits();
+int64_t monotonicNanos();
+void lockShared();
+void unlockShared();
+int resolveGlobalSlot(ObjString *name);
+void ensureGlobals();
+const char *globalName(int slot);
+void ensureStack(int depth);
+Value concatenate(ObjString *a, ObjString *b);
+bool concatenateValues(Value *parts, int count, Value *result);
+Value stringify(Value value);
+bool readInput(ObjString *message, Value *input);
 void push(Value value);
 Value pop();
\ No newline at end of file
@@ -0,0 +1,347 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "kavya/aot.h"
+#include "kavya/memory.h"
+
+static int readLong(uint8_t *operands)
+{
+    return (operands[0] << 16) | (operands[1] << 8) | operands[2];
+}
+
+// Writes `chars` as a C string literal. '?' is escaped so no trigraph can
+// form.
+static void emitString(FILE *out, const char *chars, int length)
+{
+    fputc('"', out);
+    for (int i = 0; i < length; i++)
+    {
+        unsigned char c = (unsigned char)chars[i];
+        if (c == '"' || c == '\\' || c == '?')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7f)
+            fprintf(out, "\\%03o", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+// Writes an expression that rebuilds `value` at run time. Doubles go by
+// their bits so that every one, including infinities and NaNs, survives
+// exactly.
+static void emitValue(FILE *out, Value value)
+{
+    if (IS_INT(value))
+    {
+        int64_t integer = AS_INT(value);
+        if (integer == INT64_MIN)
+            fprintf(out, "INT_VAL(INT64_MIN)");
+        else
+            fprintf(out, "INT_VAL(INT64_C(%lld))", (long long)integer);
+    }
+    else if (IS_DOUBLE(value))
+    {
+        double number = AS_DOUBLE(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        fprintf(out, "aotDouble(UINT64_C(0x%016llx))", (unsigned long long)bits);
+    }
+    else if (IS_STRING(value))
+    {
+        ObjString *string = AS_STRING(value);
+        fprintf(out, "OBJ_VAL(copyString(");
+        emitString(out, string->chars, string->length);
+        fprintf(out, ", %d))", string->length);
+    }
+    else if (IS_BOOL(value))
+    {
+        fprintf(out, "BOOL_VAL(%s)", AS_BOOL(value) ? "true" : "false");
+    }
+    else
+    {
+        fprintf(out, "NULL_VAL");
+    }
+}
+
+// A match instruction becomes a switch on the entry it takes that jumps
+// straight to where the entry leads. The entries are still emitted after
+// it, but nothing reaches them.
+static void emitMatch(FILE *out, Chunk *chunk, int offset)
+{
+    uint8_t *code = &chunk->code[offset];
+    int count = matchEntryCount(chunk, offset);
+    int entry = offset + instructionLength(chunk, offset);
+    int stride = instructionLength(chunk, entry);
+    fprintf(out, "%s(%d, %d) {", code[0] == OP_MATCH_TABLE ? "AOT_MATCH_TABLE" : "AOT_MATCH_HASH",
+            readLong(code + 1), count - 1);
+    for (int i = 0; i < count - 1; i++)
+        fprintf(out, " case %d: goto L%d;", i, jumpTarget(chunk, entry + i * stride));
+    fprintf(out, " default: goto L%d; }", jumpTarget(chunk, entry + (count - 1) * stride));
+}
+
+static void emitInstruction(FILE *out, Chunk *chunk, int offset)
+{
+    uint8_t *code = &chunk->code[offset];
+    switch (code[0])
+    {
+    case OP_CONSTANT:
+        fprintf(out, "AOT_CONSTANT(%d);", code[1]);
+        break;
+    case OP_CONSTANT_LONG:
+        fprintf(out, "AOT_CONSTANT(%d);", readLong(code + 1));
+        break;
+    case OP_NULL:
+        fprintf(out, "AOT_NULL();");
+        break;
+    case OP_TRUE:
+        fprintf(out, "AOT_TRUE();");
+        break;
+    case OP_FALSE:
+        fprintf(out, "AOT_FALSE();");
+        break;
+    case OP_POP:
+        fprintf(out, "AOT_POP();");
+        break;
+    case OP_GET_LOCAL:
+        fprintf(out, "AOT_GET_LOCAL(%d);", code[1]);
+        break;
+    case OP_SET_LOCAL:
+        fprintf(out, "AOT_SET_LOCAL(%d);", code[1]);
+        break;
+    case OP_GET_GLOBAL_SLOT:
+        fprintf(out, "AOT_GET_GLOBAL(%d);", code[1]);
+        break;
+    case OP_GET_GLOBAL_SLOT_LONG:
+        fprintf(out, "AOT_GET_GLOBAL(%d);", readLong(code + 1));
+        break;
+    case OP_DEFINE_GLOBAL_SLOT:
+        fprintf(out, "AOT_DEFINE_GLOBAL(%d);", code[1]);
+        break;
+    case OP_DEFINE_GLOBAL_SLOT_LONG:
+        fprintf(out, "AOT_DEFINE_GLOBAL(%d);", readLong(code + 1));
+        break;
+    case OP_SET_GLOBAL_SLOT:
+        fprintf(out, "AOT_SET_GLOBAL(%d);", code[1]);
+        break;
+    case OP_SET_GLOBAL_SLOT_LONG:
+        fprintf(out, "AOT_SET_GLOBAL(%d);", readLong(code + 1));
+        break;
+    case OP_EQUAL:
+    case OP_EQUAL_NUM:
+    case OP_IS:
+        fprintf(out, "AOT_EQUAL();");
+        break;
+    case OP_GREATER:
+        fprintf(out, "AOT_GREATER();");
+        break;
+    case OP_LESS:
+        fprintf(out, "AOT_LESS();");
+        break;
+    case OP_GREATER_EQUAL:
+        fprintf(out, "AOT_GREATER_EQUAL();");
+        break;
+    case OP_LESS_EQUAL:
+        fprintf(out, "AOT_LESS_EQUAL();");
+        break;
+    case OP_NOT_EQUAL:
+        fprintf(out, "AOT_NOT_EQUAL();");
+        break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+        fprintf(out, "AOT_ADD();");
+        break;
+    case OP_SUBTRACT:
+        fprintf(out, "AOT_SUBTRACT();");
+        break;
+    case OP_MULTIPLY:
+        fprintf(out, "AOT_MULTIPLY();");
+        break;
+    case OP_DIVIDE:
+        fprintf(out, "AOT_DIVIDE();");
+        break;
+    case OP_ADD_NN:
+        fprintf(out, "AOT_ADD_NN();");
+        break;
+    case OP_SUBTRACT_NN:
+        fprintf(out, "AOT_SUBTRACT_NN();");
+        break;
+    case OP_MULTIPLY_NN:
+        fprintf(out, "AOT_MULTIPLY_NN();");
+        break;
+    case OP_DIVIDE_NN:
+        fprintf(out, "AOT_DIVIDE_NN();");
+        break;
+    case OP_GREATER_NN:
+        fprintf(out, "AOT_GREATER_NN();");
+        break;
+    case OP_LESS_NN:
+        fprintf(out, "AOT_LESS_NN();");
+        break;
+    case OP_GREATER_EQUAL_NN:
+        fprintf(out, "AOT_GREATER_EQUAL_NN();");
+        break;
+    case OP_LESS_EQUAL_NN:
+        fprintf(out, "AOT_LESS_EQUAL_NN();");
+        break;
+    case OP_NOT:
+        fprintf(out, "AOT_NOT();");
+        break;
+    case OP_NEGATE:
+        fprintf(out, "AOT_NEGATE();");
+        break;
+    case OP_WRITE:
+        fprintf(out, "AOT_WRITE();");
+        break;
+    case OP_ASK:
+        fprintf(out, "AOT_ASK();");
+        break;
+    case OP_CONCAT_N:
+        fprintf(out, "AOT_CONCAT_N(%d);", code[1]);
+        break;
+    case OP_TO_STRING:
+        fprintf(out, "AOT_TO_STRING();");
+        break;
+    case OP_JUMP:
+    case OP_JUMP_LONG:
+    case OP_LOOP:
+    case OP_LOOP_LONG:
+        fprintf(out, "AOT_JUMP(L%d);", jumpTarget(chunk, offset));
+        break;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+        fprintf(out, "AOT_JUMP_IF_FALSE(L%d);", jumpTarget(chunk, offset));
+        break;
+    case OP_RETURN:
+        fprintf(out, "AOT_RETURN();");
+        break;
+    case OP_ADD_LOCAL_CONSTANT:
+        fprintf(out, "AOT_ADD_LOCAL_CONSTANT(%d, %d);", code[1], code[2]);
+        break;
+    case OP_SET_LOCAL_POP:
+        fprintf(out, "AOT_SET_LOCAL_POP(%d);", code[1]);
+        break;
+    case OP_GET_LOCAL_2:
+        fprintf(out, "AOT_GET_LOCAL_2(%d, %d);", code[1], code[2]);
+        break;
+    case OP_JUMP_IF_NOT_LESS:
+        fprintf(out, "AOT_JUMP_IF_NOT_LESS(L%d);", jumpTarget(chunk, offset));
+        break;
+    case OP_JUMP_IF_NOT_GREATER:
+        fprintf(out, "AOT_JUMP_IF_NOT_GREATER(L%d);", jumpTarget(chunk, offset));
+        break;
+    case OP_FOR_RANGE:
+        fprintf(out, "AOT_FOR_RANGE(%d, %d, %d, L%d);", code[3], code[4], code[5],
+                jumpTarget(chunk, offset));
+        break;
+    case OP_JUMP_IF_NOT_LESS_NN:
+        fprintf(out, "AOT_JUMP_IF_NOT_LESS_NN(L%d);", jumpTarget(chunk, offset));
+        break;
+    case OP_JUMP_IF_NOT_GREATER_NN:
+        fprintf(out, "AOT_JUMP_IF_NOT_GREATER_NN(L%d);", jumpTarget(chunk, offset));
+        break;
+    case OP_MATCH_TABLE:
+    case OP_MATCH_HASH:
+        emitMatch(out, chunk, offset);
+        break;
+    default:
+        fprintf(out, "AOT_ERROR(\"Unknown opcode %d.\");", code[0]);
+        break;
+    }
+}
+
+// Writes a C program that runs `chunk` the way interpret() would. The
+// chunk must be stack code, and the global slots it uses must be the ones
+// the VM has resolved so far.
+void emitC(Chunk *chunk, const char *path, FILE *out)
+{
+    // Only offsets that are jumped to get a label.
+    bool *targets = ALLOCATE(bool, chunk->count);
+    memset(targets, 0, chunk->count * sizeof(bool));
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        if (isJumpInstruction(chunk->code[offset]))
+            targets[jumpTarget(chunk, offset)] = true;
+    }
+
+    fprintf(out, "// Generated by kavya --emit-c from %s.\n", path);
+#ifdef NAN_BOXING
+    fprintf(out, "#define NAN_BOXING\n");
+#endif
+    fprintf(out, "#include \"kavya/aot.h\"\n\n");
+
+    fprintf(out, "static const char *const globalNames[] = {\n");
+    for (int i = 0; i < vm.globalNames.count; i++)
+    {
+        ObjString *name = AS_STRING(vm.globalNames.values[i]);
+        fprintf(out, "    ");
+        emitString(out, name->chars, name->length);
+        fprintf(out, ",\n");
+    }
+    fprintf(out, "    NULL,\n};\n\n");
+
+    int constantCount = chunk->constants.count;
+    fprintf(out, "static InterpretResult script(void)\n{\n");
+    fprintf(out, "    static Value constants[%d];\n",
+            constantCount > 0 ? constantCount : 1);
+    fprintf(out, "    Value *slots = vm.stack;\n");
+    fprintf(out, "    Value *globals = vm.globalValues.values;\n");
+    fprintf(out, "    Value *sp = vm.stackTop;\n");
+    fprintf(out, "    (void)slots;\n    (void)globals;\n\n");
+    for (int i = 0; i < constantCount; i++)
+    {
+        fprintf(out, "    constants[%d] = ", i);
+        emitValue(out, chunk->constants.values[i]);
+        fprintf(out, ";\n");
+    }
+    fprintf(out, "\n");
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        if (targets[offset])
+            fprintf(out, "L%d:\n", offset);
+        fprintf(out, "    ");
+        emitInstruction(out, chunk, offset);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "int main(void)\n{\n");
+    fprintf(out, "    return aotMain(globalNames, %d, script);\n}\n",
+            chunk->maxStackDepth);
+
+    FREE_ARRAY(bool, targets, chunk->count);
+}
+
+// Entry point of a generated program: sets up the VM like interpret()
+// and returns the exit status a file run by the interpreter would have.
+int aotMain(const char *const *globalNames, int maxStackDepth, AotScript script)
+{
+    initVM();
+    for (int i = 0; globalNames[i] != NULL; i++)
+    {
+        resolveGlobalSlot(copyString(globalNames[i], (int)strlen(globalNames[i])));
+    }
+    ensureGlobals();
+    ensureStack(maxStackDepth);
+
+    InterpretResult result = script();
+    freeVM();
+    return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
+
+// Reports a runtime error from generated code the way run() does.
+void aotError(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputs("\n", stderr);
+
+    vm.stackTop = vm.stack;
+}
\ No newline at end of file
@@ -1,7 +1,10 @@
 #include <stdlib.h>
 
 #include "kavya/chunk.h"
+#include "kavya/jit.h"
+#include "kavya/looptrace.h"
 #include "kavya/memory.h"
+#include "kavya/object.h"
 
 void initChunk(Chunk *chunk)
 {
@@ -9,6 +12,12 @@ void initChunk(Chunk *chunk)
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->threaded = NULL;
+    chunk->registerCode = false;
+    chunk->maxStackDepth = 0;
+    chunk->jitCode = NULL;
+    chunk->backEdges = 0;
+    chunk->loopTraces = NULL;
     initValueArray(&chunk->constants);
 }
 
@@ -17,6 +26,13 @@ void freeChunk(Chunk *chunk)
 
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(void *, chunk->threaded, chunk->count);
+#ifdef KAVYA_JIT
+    jitFree(chunk);
+#endif
+#ifdef KAVYA_LOOP_TRACES
+    freeLoopTraces(chunk);
+#endif
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -41,4 +57,227 @@ int addConstant(Chunk *chunk, Value value)
 {
     writeValueArray(&chunk->constants, value);
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+int instructionLength(Chunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL_SLOT:
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_LOCAL_POP:
+    case OP_CONCAT_N:
+        return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_GET_LOCAL_2:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_LESS_NN:
+    case OP_JUMP_IF_NOT_GREATER_NN:
+        return 3;
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_SLOT_LONG:
+    case OP_DEFINE_GLOBAL_SLOT_LONG:
+    case OP_SET_GLOBAL_SLOT_LONG:
+        return 4;
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_LOOP_LONG:
+        return 5;
+    case OP_FOR_RANGE:
+    case OP_MATCH_TABLE:
+    case OP_MATCH_HASH:
+        return 6;
+    default:
+        return 1;
+    }
+}
+
+bool isJumpInstruction(uint8_t instruction)
+{
+    switch (instruction)
+    {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_LESS_NN:
+    case OP_JUMP_IF_NOT_GREATER_NN:
+    case OP_FOR_RANGE:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_LOOP_LONG:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool isBackwardJump(uint8_t instruction)
+{
+    return instruction == OP_LOOP || instruction == OP_LOOP_LONG ||
+           instruction == OP_FOR_RANGE;
+}
+
+// Offset the jump instruction at `offset` transfers control to. Jump
+// operands are big-endian and relative to the next instruction.
+int jumpTarget(Chunk *chunk, int offset)
+{
+    uint8_t *code = &chunk->code[offset];
+    int next = offset + instructionLength(chunk, offset);
+    uint32_t jump;
+    if (next - offset == 5)
+        jump = ((uint32_t)code[1] << 24) | (code[2] << 16) | (code[3] << 8) | code[4];
+    else
+        jump = (code[1] << 8) | code[2];
+
+    if (isBackwardJump(code[0]))
+        return next - (int)jump;
+    return next + (int)jump;
+}
+
+// Net number of values an instruction pushes (positive) or pops (negative).
+// OP_CONCAT_N's depends on its operand; see instructionStackEffect().
+int stackEffect(uint8_t instruction)
+{
+    switch (instruction)
+    {
+    case OP_CONSTANT:
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL_SLOT:
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_SLOT_LONG:
+        return 1;
+    case OP_GET_LOCAL_2:
+        return 2;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_DEFINE_GLOBAL_SLOT_LONG:
+    case OP_EQUAL:
+    case OP_IS:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_WRITE:
+    case OP_SET_LOCAL_POP:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_EQUAL_NUM:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_ADD_NN:
+    case OP_SUBTRACT_NN:
+    case OP_MULTIPLY_NN:
+    case OP_DIVIDE_NN:
+    case OP_GREATER_NN:
+    case OP_LESS_NN:
+    case OP_GREATER_EQUAL_NN:
+    case OP_LESS_EQUAL_NN:
+    case OP_MATCH_TABLE:
+    case OP_MATCH_HASH:
+        return -1;
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_LESS_NN:
+    case OP_JUMP_IF_NOT_GREATER_NN:
+        return -2;
+    default:
+        return 0;
+    }
+}
+
+// Net stack effect of the instruction at `offset`, including those that
+// depend on an operand.
+int instructionStackEffect(Chunk *chunk, int offset)
+{
+    if (chunk->code[offset] == OP_CONCAT_N)
+        return 1 - chunk->code[offset + 1];
+    return stackEffect(chunk->code[offset]);
+}
+
+bool isMatchInstruction(uint8_t instruction)
+{
+    return instruction == OP_MATCH_TABLE || instruction == OP_MATCH_HASH;
+}
+
+// Number of jump table entries after the match instruction at `offset`,
+// including the default entry.
+int matchEntryCount(Chunk *chunk, int offset)
+{
+    uint8_t *code = &chunk->code[offset];
+    return ((code[4] << 8) | code[5]) + 1;
+}
+
+// Hash an OP_MATCH_HASH table files a case under. Strings use the hash of
+// their characters rather than their address, so a table laid out by the
+// compiler also holds for the strings of a program built by --emit-c.
+uint32_t matchKeyHash(Value key)
+{
+    if (IS_STRING(key))
+        return AS_STRING(key)->hash;
+    uint64_t bits = (uint64_t)AS_INT(key) * UINT64_C(0x9e3779b97f4a7c15);
+    return (uint32_t)(bits >> 32);
+}
+
+// Cases are integers and strings. A double subject equal to an integer
+// matches that integer's case, as it would compare equal to it.
+static bool matchKey(Value subject, Value *key)
+{
+    if (IS_INT(subject) || IS_STRING(subject))
+    {
+        *key = subject;
+        return true;
+    }
+    if (!IS_DOUBLE(subject))
+        return false;
+
+    double number = AS_DOUBLE(subject);
+    if (!(number >= (double)INT_VALUE_MIN && number < -(double)INT_VALUE_MIN) ||
+        number != (double)(int64_t)number)
+        return false;
+    *key = INT_VAL((int64_t)number);
+    return true;
+}
+
+// Entry an OP_MATCH_TABLE with `count` cases from `lowest` takes.
+int matchRange(Value subject, Value lowest, int count)
+{
+    Value key;
+    if (!matchKey(subject, &key) || !IS_INT(key) || AS_INT(key) < AS_INT(lowest) ||
+        (uint64_t)AS_INT(key) - (uint64_t)AS_INT(lowest) >= (uint64_t)count)
+        return count;
+    return (int)(AS_INT(key) - AS_INT(lowest));
+}
+
+// Entry an OP_MATCH_HASH over `keys` takes. Empty slots hold null, and
+// the table is never more than half full.
+int matchHash(Value subject, const Value *keys, int capacity)
+{
+    Value key;
+    if (!matchKey(subject, &key))
+        return capacity;
+
+    uint32_t mask = (uint32_t)capacity - 1;
+    for (uint32_t slot = matchKeyHash(key) & mask;; slot = (slot + 1) & mask)
+    {
+        if (IS_NULL(keys[slot]))
+            return capacity;
+        if (valuesIdentical(keys[slot], key))
+            return (int)slot;
+    }
+}
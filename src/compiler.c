@@ -1,14 +1,18 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "kavya/main.h"
 #include "kavya/compiler.h"
-#include "kavya/scanner.h"
-
-#ifdef DEBUG_PRINT_CODE
 #include "kavya/debug.h"
-#endif
+#include "kavya/ir.h"
+#include "kavya/memory.h"
+#include "kavya/peephole.h"
+#include "kavya/register.h"
+#include "kavya/scanner.h"
+#include "kavya/types.h"
+#include "kavya/vm.h"
 
 typedef struct
 {
@@ -53,14 +57,51 @@ typedef struct
     Local locals[UINT8_COUNT];
     int localCount;
     int scopeDepth;
+    // Number of loop and branch bodies enclosing the current code.
+    int bodyDepth;
 } Compiler;
 
 Parser parser;
 
+CompileTarget compileTarget = TARGET_STACK;
+bool dumpBytecode = false;
+int optimizationLevel = 1;
+
+CompileStats compileStats;
+
 Compiler *current = NULL;
 
 Chunk *compilingChunk;
 
+// Start of the straight-line code currently being emitted. It is always an
+// instruction boundary and no jump lands after it, so the instructions from
+// here on can be fused into superinstructions.
+int blockStart;
+
+// How many times each name is declared or assigned anywhere in the source.
+Table globalWrites;
+
+// Globals known to hold a constant, mapped to that constant. Values rather
+// than constant-table indices, so they carry over between the chunks of a
+// streamed compilation.
+Table constantGlobals;
+
+// Open-addressing hash set of constant-table indices, so literals and names
+// that repeat share one slot instead of growing the pool.
+typedef struct
+{
+    int count;
+    int capacity;
+    int *indices;
+} ConstantSet;
+
+ConstantSet constantSet;
+
+// Forward jumps are emitted before their distance is known. They start out
+// short; if one overflows, the source is compiled again with wide jumps.
+bool wideJumps;
+bool jumpOverflow;
+
 static Chunk *currentChunk()
 {
     return compilingChunk;
@@ -149,19 +190,54 @@ static void emitBytes(uint8_t byte1, uint8_t byte2)
     emitByte(byte2);
 }
 
+// Emits an instruction with a constant or global index operand, using the
+// 24-bit form when the index does not fit in a byte.
+static void emitIndexed(uint8_t instruction, uint8_t longInstruction, int index)
+{
+    if (index <= UINT8_MAX)
+    {
+        emitBytes(instruction, (uint8_t)index);
+        return;
+    }
+    emitByte(longInstruction);
+    emitByte((index >> 16) & 0xff);
+    emitByte((index >> 8) & 0xff);
+    emitByte(index & 0xff);
+}
+
 static void emitLoop(int loopStart)
 {
-    emitByte(OP_LOOP);
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset <= UINT16_MAX)
+    {
+        emitByte(OP_LOOP);
+        emitByte((offset >> 8) & 0xff);
+        emitByte(offset & 0xff);
+        return;
+    }
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX)
-        error("Loop body too large.");
+    offset += 2;
+    emitByte(OP_LOOP_LONG);
+    emitByte((offset >> 24) & 0xff);
+    emitByte((offset >> 16) & 0xff);
     emitByte((offset >> 8) & 0xff);
     emitByte(offset & 0xff);
 }
 
+static uint8_t wideJump(uint8_t instruction)
+{
+    return instruction == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG;
+}
+
 static int emitJump(uint8_t instruction)
 {
+    if (wideJumps)
+    {
+        emitByte(wideJump(instruction));
+        emitBytes(0xff, 0xff);
+        emitBytes(0xff, 0xff);
+        return currentChunk()->count - 4;
+    }
     emitByte(instruction);
     emitByte(0xff);
     emitByte(0xff);
@@ -173,52 +249,448 @@ static void emitReturn()
     emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value)
+static void addConstantIndex(ConstantSet *set, int index);
+
+static void growConstantSet(ConstantSet *set)
+{
+    int *oldIndices = set->indices;
+    int oldCapacity = set->capacity;
+
+    set->capacity = GROW_CAPACITY(oldCapacity);
+    set->indices = ALLOCATE(int, set->capacity);
+    set->count = 0;
+    for (int i = 0; i < set->capacity; i++)
+        set->indices[i] = -1;
+    for (int i = 0; i < oldCapacity; i++)
+    {
+        if (oldIndices[i] != -1)
+            addConstantIndex(set, oldIndices[i]);
+    }
+    FREE_ARRAY(int, oldIndices, oldCapacity);
+}
+
+static void addConstantIndex(ConstantSet *set, int index)
+{
+    if (set->count + 1 > set->capacity * 3 / 4)
+        growConstantSet(set);
+
+    Value value = currentChunk()->constants.values[index];
+    uint32_t bucket = hashValue(value) % set->capacity;
+    while (set->indices[bucket] != -1)
+        bucket = (bucket + 1) % set->capacity;
+    set->indices[bucket] = index;
+    set->count++;
+}
+
+static int findConstant(ConstantSet *set, Value value)
 {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX)
+    if (set->count == 0)
+        return -1;
+
+    Value *constants = currentChunk()->constants.values;
+    uint32_t bucket = hashValue(value) % set->capacity;
+    while (set->indices[bucket] != -1)
     {
-        error("Too many constant in one chunk");
+        if (valuesIdentical(constants[set->indices[bucket]], value))
+            return set->indices[bucket];
+        bucket = (bucket + 1) % set->capacity;
+    }
+    return -1;
+}
+
+static int makeConstant(Value value)
+{
+    int constant = findConstant(&constantSet, value);
+    if (constant != -1)
+        return constant;
+
+    constant = addConstant(currentChunk(), value);
+    if (constant > UINT24_MAX)
+    {
+        error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    addConstantIndex(&constantSet, constant);
+    return constant;
 }
 
 static void emitConstant(Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitIndexed(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
 }
 
 static void patchJump(int offset)
 {
-    int jump = currentChunk()->count - offset - 2;
+    uint8_t *code = currentChunk()->code;
+    if (code[offset - 1] == OP_JUMP_LONG || code[offset - 1] == OP_JUMP_IF_FALSE_LONG)
+    {
+        int jump = currentChunk()->count - offset - 4;
+        code[offset] = (jump >> 24) & 0xff;
+        code[offset + 1] = (jump >> 16) & 0xff;
+        code[offset + 2] = (jump >> 8) & 0xff;
+        code[offset + 3] = jump & 0xff;
+    }
+    else
+    {
+        int jump = currentChunk()->count - offset - 2;
+        if (jump > UINT16_MAX)
+            jumpOverflow = true;
+        code[offset] = (jump >> 8) & 0xff;
+        code[offset + 1] = jump & 0xff;
+    }
+    blockStart = currentChunk()->count;
+}
 
-    if (jump > UINT16_MAX)
+static int markJumpTarget()
+{
+    blockStart = currentChunk()->count;
+    return blockStart;
+}
+
+// Collects the offsets of the last `max` instructions emitted since
+// blockStart, oldest first.
+static int recentInstructions(int *starts, int max)
+{
+    Chunk *chunk = currentChunk();
+    int count = 0;
+    for (int offset = blockStart; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        if (count == max)
+        {
+            memmove(starts, starts + 1, sizeof(int) * (max - 1));
+            count--;
+        }
+        starts[count++] = offset;
+    }
+    return count;
+}
+
+static bool endsWith(const uint8_t *ops, int length, int *starts)
+{
+    int count = recentInstructions(starts, length);
+    if (count < length)
+        return false;
+    for (int i = 0; i < length; i++)
     {
-        error("Too much code to jump over.");
+        if (currentChunk()->code[starts[i]] != ops[i])
+            return false;
     }
+    return true;
+}
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+static void rewriteTail(int start, uint8_t op, int operandCount, uint8_t a, uint8_t b)
+{
+    Chunk *chunk = currentChunk();
+    chunk->code[start] = op;
+    if (operandCount > 0)
+        chunk->code[start + 1] = a;
+    if (operandCount > 1)
+        chunk->code[start + 2] = b;
+    chunk->count = start + 1 + operandCount;
+}
+
+// Replaces the sequence just emitted with a single superinstruction when it
+// matches one of the common patterns.
+static void fuseInstructions()
+{
+    static const uint8_t addLocalConstant[] = {
+        OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP};
+    static const uint8_t setLocalPop[] = {OP_SET_LOCAL, OP_POP};
+    static const uint8_t getLocalPair[] = {OP_GET_LOCAL, OP_GET_LOCAL};
+
+    uint8_t *code = currentChunk()->code;
+    int starts[5];
+
+    if (endsWith(addLocalConstant, 5, starts) &&
+        code[starts[0] + 1] == code[starts[3] + 1])
+    {
+        rewriteTail(starts[0], OP_ADD_LOCAL_CONSTANT, 2,
+                    code[starts[0] + 1], code[starts[1] + 1]);
+    }
+    else if (endsWith(setLocalPop, 2, starts))
+    {
+        rewriteTail(starts[0], OP_SET_LOCAL_POP, 1, code[starts[0] + 1], 0);
+    }
+    else if (endsWith(getLocalPair, 2, starts))
+    {
+        rewriteTail(starts[0], OP_GET_LOCAL_2, 2,
+                    code[starts[0] + 1], code[starts[1] + 1]);
+    }
+}
+
+// Emits the jump taken when a condition is false. A comparison right before
+// it is fused into a compare-and-branch that also consumes the condition;
+// otherwise the condition is popped on the fall-through path as usual.
+static int emitConditionJump()
+{
+    static const uint8_t less[] = {OP_LESS};
+    static const uint8_t greater[] = {OP_GREATER};
+    int starts[1];
+
+    // The fused compare-and-branch forms only have 16-bit offsets.
+    if (wideJumps)
+    {
+        int jump = emitJump(OP_JUMP_IF_FALSE);
+        emitByte(OP_POP);
+        return jump;
+    }
+
+    if (endsWith(less, 1, starts))
+    {
+        currentChunk()->count = starts[0];
+        return emitJump(OP_JUMP_IF_NOT_LESS);
+    }
+    if (endsWith(greater, 1, starts))
+    {
+        currentChunk()->count = starts[0];
+        return emitJump(OP_JUMP_IF_NOT_GREATER);
+    }
+
+    int jump = emitJump(OP_JUMP_IF_FALSE);
+    emitByte(OP_POP);
+    return jump;
+}
+
+// Patches a jump from emitConditionJump() and pops the condition on the
+// path it lands on, if it is still there.
+static void patchConditionJump(int offset)
+{
+    uint8_t instruction = currentChunk()->code[offset - 1];
+    bool popCondition = instruction == OP_JUMP_IF_FALSE ||
+                        instruction == OP_JUMP_IF_FALSE_LONG;
+    patchJump(offset);
+    if (popCondition)
+        emitByte(OP_POP);
+}
+
+// Reads the value pushed by the instruction at `offset` if it is a literal.
+static bool literalOperand(int offset, Value *value)
+{
+    Chunk *chunk = currentChunk();
+    uint8_t *operand = &chunk->code[offset + 1];
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+        *value = chunk->constants.values[operand[0]];
+        return true;
+    case OP_CONSTANT_LONG:
+        *value = chunk->constants.values[(operand[0] << 16) | (operand[1] << 8) | operand[2]];
+        return true;
+    case OP_NULL:
+        *value = NULL_VAL;
+        return true;
+    case OP_TRUE:
+        *value = BOOL_VAL(true);
+        return true;
+    case OP_FALSE:
+        *value = BOOL_VAL(false);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Computes what the VM would for `instruction` on literal operands. Returns
+// false, so that the error is still raised at run time, when it would fail.
+static bool evaluate(uint8_t instruction, Value a, Value b, Value *result)
+{
+    bool numbers = IS_NUMBER(a) && IS_NUMBER(b);
+    switch (instruction)
+    {
+    case OP_NOT:
+        *result = BOOL_VAL(isFalsey(a));
+        return true;
+    case OP_TO_STRING:
+        *result = stringify(a);
+        return true;
+    case OP_NEGATE:
+        if (!IS_NUMBER(a))
+            return false;
+        *result = numberNegate(a);
+        return true;
+    case OP_EQUAL:
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    case OP_ADD:
+        if (IS_STRING(a) && IS_STRING(b))
+            *result = concatenate(AS_STRING(a), AS_STRING(b));
+        else if (numbers)
+            *result = numberAdd(a, b);
+        else
+            return false;
+        return true;
+    case OP_SUBTRACT:
+        *result = numberSubtract(a, b);
+        return numbers;
+    case OP_MULTIPLY:
+        *result = numberMultiply(a, b);
+        return numbers;
+    case OP_DIVIDE:
+        *result = numberDivide(a, b);
+        return numbers;
+    case OP_GREATER:
+        *result = numberGreater(a, b);
+        return numbers;
+    case OP_LESS:
+        *result = numberLess(a, b);
+        return numbers;
+    default:
+        return false;
+    }
+}
+
+// Folds an operator and the literals it applies to into a single constant
+// when its result is known at compile time.
+static bool foldOperator(uint8_t instruction)
+{
+    int operandCount =
+        instruction == OP_NOT || instruction == OP_NEGATE || instruction == OP_TO_STRING ? 1 : 2;
+    int starts[2];
+    Value operands[2] = {NULL_VAL, NULL_VAL};
+    Value result;
+    if (optimizationLevel < 1 ||
+        recentInstructions(starts, operandCount) < operandCount ||
+        !literalOperand(starts[0], &operands[0]) ||
+        (operandCount == 2 && !literalOperand(starts[1], &operands[1])) ||
+        !evaluate(instruction, operands[0], operands[1], &result))
+        return false;
+
+    currentChunk()->count = starts[0];
+    if (IS_NULL(result))
+        emitByte(OP_NULL);
+    else if (IS_BOOL(result))
+        emitByte(AS_BOOL(result) ? OP_TRUE : OP_FALSE);
+    else
+        emitConstant(result);
+    compileStats.foldedOperations++;
+    return true;
+}
+
+// Emits an operator, folded when it can be.
+static void emitOperator(uint8_t instruction)
+{
+    if (!foldOperator(instruction))
+        emitByte(instruction);
+}
+
+// Counts one more value towards an OP_CONCAT_N, joining the ones so far
+// first when its operand would overflow.
+static void addPart(int *parts)
+{
+    if (++*parts == UINT8_MAX)
+    {
+        emitBytes(OP_CONCAT_N, UINT8_MAX);
+        *parts = 1;
+    }
+}
+
+// Joins the last `parts` values pushed. Two only need an OP_ADD.
+static void emitConcat(int parts)
+{
+    if (parts == 2)
+        emitOperator(OP_ADD);
+    else if (parts > 2)
+        emitBytes(OP_CONCAT_N, (uint8_t)parts);
 }
 
 static void initCompiler(Compiler *compiler)
 {
+    blockStart = 0;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->bodyDepth = 0;
     current = compiler;
 }
 
+// Walks every path through the chunk to find the deepest the stack gets.
+// Structured control flow reaches each offset at a single depth, so each
+// offset is only walked once.
+static int computeMaxStackDepth(Chunk *chunk)
+{
+    int *depths = ALLOCATE(int, chunk->count);
+    int *pending = ALLOCATE(int, chunk->count);
+    int pendingCount = 0;
+    int maxDepth = 0;
+
+    for (int offset = 0; offset < chunk->count; offset++)
+        depths[offset] = -1;
+    depths[0] = 0;
+    pending[pendingCount++] = 0;
+
+    while (pendingCount > 0)
+    {
+        int offset = pending[--pendingCount];
+        int depth = depths[offset];
+        for (;;)
+        {
+            uint8_t instruction = chunk->code[offset];
+            int next = offset + instructionLength(chunk, offset);
+            depth += instructionStackEffect(chunk, offset);
+            if (depth > maxDepth)
+                maxDepth = depth;
+
+            if (isJumpInstruction(instruction))
+            {
+                int target = jumpTarget(chunk, offset);
+                if (depths[target] == -1)
+                {
+                    depths[target] = depth;
+                    pending[pendingCount++] = target;
+                }
+            }
+
+            // The first jump table entry follows on; queue the others.
+            if (isMatchInstruction(instruction))
+            {
+                int stride = instructionLength(chunk, next);
+                for (int entry = 1; entry < matchEntryCount(chunk, offset); entry++)
+                {
+                    int target = next + entry * stride;
+                    depths[target] = depth;
+                    pending[pendingCount++] = target;
+                }
+            }
+
+            if (instruction == OP_JUMP || instruction == OP_LOOP ||
+                instruction == OP_JUMP_LONG || instruction == OP_LOOP_LONG ||
+                instruction == OP_RETURN || next >= chunk->count ||
+                depths[next] != -1)
+                break;
+            offset = next;
+            depths[offset] = depth;
+        }
+    }
+
+    FREE_ARRAY(int, depths, chunk->count);
+    FREE_ARRAY(int, pending, chunk->count);
+    return maxDepth;
+}
+
 static void endCompiler()
 {
     emitReturn();
-#ifdef DEBUG_PRINT_CODE
     if (!parser.hadError)
+    {
+        if (optimizationLevel >= 2)
+            optimizeChunk(currentChunk(), &compileStats.ir);
+        if (optimizationLevel >= 1)
+            compileStats.peepholeRewrites += optimizePeepholes(currentChunk());
+        currentChunk()->maxStackDepth = computeMaxStackDepth(currentChunk());
+        if (optimizationLevel >= 1)
+            inferTypes(currentChunk(), &compileStats.types);
+    }
+    if (dumpBytecode && !parser.hadError)
     {
         disassembleChunk(currentChunk(), "code");
     }
-#endif
+
+    if (!parser.hadError && compileTarget == TARGET_REGISTER &&
+        lowerToRegisters(currentChunk()) && dumpBytecode)
+    {
+        disassembleChunk(currentChunk(), "registers");
+    }
 }
 
 static void beginScope()
@@ -244,45 +716,187 @@ static void declaration();
 static ParseRule *getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
+// Whether the value just pushed is known to be a string: a string literal
+// or an interpolation.
+static bool pushedString()
+{
+    int start;
+    Value value;
+    if (recentInstructions(&start, 1) < 1)
+        return false;
+    uint8_t instruction = currentChunk()->code[start];
+    return instruction == OP_TO_STRING || instruction == OP_CONCAT_N ||
+           (literalOperand(start, &value) && IS_STRING(value));
+}
+
+// Instructions a part can be made of and still be evaluated before the
+// parts to its left are checked: they only push a value, and can at worst
+// fail on an undefined global or the way the chain itself would.
+static bool pureInstruction(uint8_t instruction)
+{
+    switch (instruction)
+    {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_2:
+    case OP_GET_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT_LONG:
+    case OP_TO_STRING:
+    case OP_CONCAT_N:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Whether the code from `start` on is pure. Code with a jump target in it
+// holds a branch, so it is not.
+static bool pureSince(int start)
+{
+    Chunk *chunk = currentChunk();
+    if (blockStart > start)
+        return false;
+    for (int offset = start; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        if (!pureInstruction(chunk->code[offset]))
+            return false;
+    }
+    return true;
+}
+
+// Joins the `parts` values pushed before the part whose code starts at
+// `start`, moving that code after the join, so the parts are checked
+// before it runs, as they would be by a chain of OP_ADDs. `blockBefore`
+// is blockStart from before the part was compiled. If the part's first
+// instruction was fused into the OP_GET_LOCAL_2 at `fused`, the two reads
+// are split again.
+static void joinBefore(int start, int parts, int blockBefore, int fused)
+{
+    Chunk *chunk = currentChunk();
+    int length = chunk->count - start;
+    int capacity = length + 1;
+    uint8_t *code = ALLOCATE(uint8_t, capacity);
+    int *lines = ALLOCATE(int, capacity);
+    memcpy(code, &chunk->code[start], length);
+    memcpy(lines, &chunk->lines[start], length * sizeof(int));
+    bool branches = blockStart > start;
+    if (fused != -1)
+    {
+        // The fused instruction's last byte, at `start`, is the part's slot.
+        chunk->code[fused] = OP_GET_LOCAL;
+        memmove(code + 1, code, length);
+        memmove(lines + 1, lines, length * sizeof(int));
+        code[0] = OP_GET_LOCAL;
+        lines[0] = lines[1];
+        length++;
+    }
+
+    chunk->count = start;
+    blockStart = blockBefore;
+    emitConcat(parts);
+    for (int i = 0; i < length; i++)
+        writeChunk(chunk, code[i], lines[i]);
+    if (branches)
+        markJumpTarget();
+
+    FREE_ARRAY(uint8_t, code, capacity);
+    FREE_ARRAY(int, lines, capacity);
+}
+
+// Compiles a chain of `+` after its first operand. A string only adds to
+// strings, so from the first part known to be one on the rest are joined
+// at the end, building the result in one go instead of once per `+`. Parts
+// before it are added as they come, as are two literals in a row. A part
+// that could have side effects, like asking for input, first joins the
+// parts before it, so a chain that fails still fails before running it.
+static void sum()
+{
+    bool strings = pushedString();
+    int parts = 1;
+    do
+    {
+        int start = currentChunk()->count;
+        int blockBefore = blockStart;
+        int previous = -1;
+        recentInstructions(&previous, 1);
+
+        parsePrecedence((Precedence)(PREC_TERM + 1));
+        strings = strings || pushedString();
+        if (!strings)
+        {
+            emitOperator(OP_ADD);
+            continue;
+        }
+
+        // Reading a local right after another fuses the two reads.
+        int fused = previous != -1 && previous + 2 == start &&
+                            currentChunk()->code[previous] == OP_GET_LOCAL_2
+                        ? previous
+                        : -1;
+        if (parts > 1 && !pureSince(fused != -1 ? fused : start))
+        {
+            joinBefore(start, parts, blockBefore, fused);
+            parts = 1;
+        }
+        addPart(&parts);
+        if (parts == 2 && foldOperator(OP_ADD))
+            parts = 1;
+    } while (match(TOKEN_PLUS));
+    emitConcat(parts);
+}
+
 static void binary(bool canAssign __attribute__((unused)))
 {
     TokenType operatorType = parser.previous.type;
 
     ParseRule *rule = getRule(operatorType);
 
+    if (operatorType == TOKEN_PLUS && optimizationLevel >= 1)
+    {
+        sum();
+        return;
+    }
+
     parsePrecedence((Precedence)(rule->precedence + 1));
 
     switch (operatorType)
     {
     case TOKEN_BANG_EQUAL:
-        emitBytes(OP_EQUAL, OP_NOT);
+        emitOperator(OP_EQUAL);
+        emitOperator(OP_NOT);
         break;
     case TOKEN_EQUAL_EQUAL:
-        emitByte(OP_EQUAL);
+        emitOperator(OP_EQUAL);
         break;
     case TOKEN_GREATER:
-        emitByte(OP_GREATER);
+        emitOperator(OP_GREATER);
         break;
     case TOKEN_GREATER_EQUAL:
-        emitBytes(OP_LESS, OP_NOT);
+        emitOperator(OP_LESS);
+        emitOperator(OP_NOT);
         break;
     case TOKEN_LESS:
-        emitByte(OP_LESS);
+        emitOperator(OP_LESS);
         break;
     case TOKEN_LESS_EQUAL:
-        emitBytes(OP_GREATER, OP_NOT);
+        emitOperator(OP_GREATER);
+        emitOperator(OP_NOT);
         break;
     case TOKEN_PLUS:
-        emitByte(OP_ADD);
+        emitOperator(OP_ADD);
         break;
     case TOKEN_MINUS:
-        emitByte(OP_SUBTRACT);
+        emitOperator(OP_SUBTRACT);
         break;
     case TOKEN_STAR:
-        emitByte(OP_MULTIPLY);
+        emitOperator(OP_MULTIPLY);
         break;
     case TOKEN_SLASH:
-        emitByte(OP_DIVIDE);
+        emitOperator(OP_DIVIDE);
         break;
     default:
         return; // Unhandled token types
@@ -315,6 +929,18 @@ static void grouping(bool canAssign __attribute__((unused)))
 
 static void number(bool canAssign __attribute__((unused)))
 {
+    // Literals without a fraction are integers when they fit the range.
+    if (memchr(parser.previous.start, '.', parser.previous.length) == NULL)
+    {
+        errno = 0;
+        long long value = strtoll(parser.previous.start, NULL, 10);
+        if (errno == 0 && value <= INT_VALUE_MAX)
+        {
+            emitConstant(INT_VAL(value));
+            return;
+        }
+    }
+
     double value = strtod(parser.previous.start, NULL);
     emitConstant(NUMBER_VAL(value));
 }
@@ -343,6 +969,35 @@ static void string(bool canAssign __attribute__((unused)))
                                     parser.previous.length - 2)));
 }
 
+// Compiles a string with `${expression}` parts, starting at the text before
+// the first one, into the pieces of text and the expressions' values as
+// strings, joined at the end.
+static void interpolation(bool canAssign __attribute__((unused)))
+{
+    int parts = 0;
+    do
+    {
+        // The text runs from after the `"` or `}` to the `${`.
+        if (parser.previous.length > 3)
+        {
+            emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
+                                            parser.previous.length - 3)));
+            addPart(&parts);
+        }
+        expression();
+        emitOperator(OP_TO_STRING);
+        addPart(&parts);
+    } while (match(TOKEN_INTERPOLATION));
+
+    consume(TOKEN_STRING, "Expect '}' after interpolated expression");
+    if (parser.previous.length > 2)
+    {
+        string(false);
+        addPart(&parts);
+    }
+    emitConcat(parts);
+}
+
 static void askExpression(bool canAssign __attribute__((unused)))
 {
     consume(TOKEN_STRING, "Expect string after 'ask'.");
@@ -350,9 +1005,16 @@ static void askExpression(bool canAssign __attribute__((unused)))
     emitByte(OP_ASK);
 }
 
-static uint8_t identifierConstant(Token *name)
+static int globalSlot(Token *name)
 {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    int slot = resolveGlobalSlot(copyString(name->start, name->length));
+    if (slot > UINT24_MAX)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return slot;
 }
 
 static bool identifiersEqual(Token *a, Token *b)
@@ -413,30 +1075,54 @@ static void declareVariable()
     addLocal(*name);
 }
 
+// Emits the constant a global is known to hold instead of reading its slot.
+static bool inlineConstantGlobal(Token *name)
+{
+    Value value;
+    if (!tableGet(&constantGlobals, copyString(name->start, name->length), &value))
+        return false;
+
+    if (IS_NULL(value))
+        emitByte(OP_NULL);
+    else if (IS_BOOL(value))
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else
+        emitConstant(value);
+    compileStats.inlinedGlobalReads++;
+    return true;
+}
+
 static void namedVariable(Token name, bool canAssign)
 {
-    uint8_t getOp, setOp;
+    uint8_t getOp, setOp, getLongOp, setLongOp;
     int arg = resolveLocal(current, &name);
     if (arg != -1)
     {
-        getOp = OP_GET_LOCAL;
-        setOp = OP_SET_LOCAL;
+        getOp = getLongOp = OP_GET_LOCAL;
+        setOp = setLongOp = OP_SET_LOCAL;
     }
     else
     {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        arg = globalSlot(&name);
+        getOp = OP_GET_GLOBAL_SLOT;
+        setOp = OP_SET_GLOBAL_SLOT;
+        getLongOp = OP_GET_GLOBAL_SLOT_LONG;
+        setLongOp = OP_SET_GLOBAL_SLOT_LONG;
     }
 
     if (canAssign && (match(TOKEN_EQUAL) || match(TOKEN_IS)))
     {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        emitIndexed(setOp, setLongOp, arg);
+    }
+    else if (getOp == OP_GET_GLOBAL_SLOT && inlineConstantGlobal(&name))
+    {
+        return;
     }
     else
     {
-        emitBytes(getOp, (uint8_t)arg);
+        emitIndexed(getOp, getLongOp, arg);
+        fuseInstructions();
     }
 }
 
@@ -454,10 +1140,10 @@ static void unary(bool canAssign __attribute__((unused)))
     switch (operatorType)
     {
     case TOKEN_BANG:
-        emitByte(OP_NOT);
+        emitOperator(OP_NOT);
         break;
     case TOKEN_MINUS:
-        emitByte(OP_NEGATE);
+        emitOperator(OP_NEGATE);
         break;
     default:
         return; // Unreachable.
@@ -487,6 +1173,7 @@ ParseRule rules[] = {
     [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
+    [TOKEN_INTERPOLATION] = {interpolation, NULL, PREC_NONE},
     [TOKEN_NUMBER] = {number, NULL, PREC_PRIMARY},
     [TOKEN_AND] = {NULL, and_, PREC_AND},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
@@ -495,6 +1182,7 @@ ParseRule rules[] = {
     [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
     [TOKEN_PURPOSE] = {NULL, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
+    [TOKEN_MATCH] = {NULL, NULL, PREC_NONE},
     [TOKEN_NULL] = {literal, NULL, PREC_PRIMARY},
     [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_WRITE] = {NULL, NULL, PREC_NONE},
@@ -539,14 +1227,14 @@ static void parsePrecedence(Precedence precedence)
     }
 }
 
-static uint8_t parseVariable(const char *errorMessage)
+static int parseVariable(const char *errorMessage)
 {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     if (current->scopeDepth > 0)
         return 0;
-    return identifierConstant(&parser.previous);
+    return globalSlot(&parser.previous);
 }
 
 static void markInitialized()
@@ -554,14 +1242,14 @@ static void markInitialized()
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(int global)
 {
     if (current->scopeDepth > 0)
     {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitIndexed(OP_DEFINE_GLOBAL_SLOT, OP_DEFINE_GLOBAL_SLOT_LONG, global);
 }
 
 static ParseRule *getRule(TokenType type)
@@ -584,9 +1272,66 @@ static void block()
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
+// Bodies of loops and branches nested inside a scope get a scope of their
+// own, so locals they declare are popped on every pass instead of piling up
+// on the stack. At the top level they keep declaring globals.
+static void bodyBlock()
+{
+    current->bodyDepth++;
+    if (current->scopeDepth == 0)
+    {
+        block();
+    }
+    else
+    {
+        beginScope();
+        block();
+        endScope();
+    }
+    current->bodyDepth--;
+}
+
+// A global written only by an unconditional top-level definition with a
+// literal initializer holds that literal in all code compiled after it.
+// Only this compilation's source is considered, so later REPL lines that
+// reassign the global still read its slot.
+static void recordConstantGlobal(Token *name, int initializerStart)
+{
+    if (current->scopeDepth > 0 || current->bodyDepth > 0)
+        return;
+
+    ObjString *string = copyString(name->start, name->length);
+    Value writes;
+    if (!tableGet(&globalWrites, string, &writes) || AS_INT(writes) != 1)
+        return;
+
+    Chunk *chunk = currentChunk();
+    int length = chunk->count - initializerStart;
+    uint8_t instruction = chunk->code[initializerStart];
+    Value value;
+    uint8_t *operand = &chunk->code[initializerStart + 1];
+    if (length == 2 && instruction == OP_CONSTANT)
+        value = chunk->constants.values[operand[0]];
+    else if (length == 4 && instruction == OP_CONSTANT_LONG)
+        value = chunk->constants.values[(operand[0] << 16) | (operand[1] << 8) | operand[2]];
+    else if (length == 1 && instruction == OP_NULL)
+        value = NULL_VAL;
+    else if (length == 1 && instruction == OP_TRUE)
+        value = BOOL_VAL(true);
+    else if (length == 1 && instruction == OP_FALSE)
+        value = BOOL_VAL(false);
+    else
+        return;
+
+    tableSet(&constantGlobals, string, value);
+    compileStats.constantGlobals++;
+}
+
 static void theDeclaration()
 {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
+    Token name = parser.previous;
+    int initializerStart = currentChunk()->count;
     if (match(TOKEN_EQUAL) || match(TOKEN_IS))
     {
         expression();
@@ -595,6 +1340,7 @@ static void theDeclaration()
     {
         emitByte(OP_NULL);
     }
+    recordConstantGlobal(&name, initializerStart);
     defineVariable(global);
 }
 
@@ -602,6 +1348,7 @@ static void expressionStatement()
 {
     expression();
     emitByte(OP_POP);
+    fuseInstructions();
 }
 
 static void writeStatement()
@@ -610,123 +1357,122 @@ static void writeStatement()
     emitByte(OP_WRITE);
 }
 
+// A counted loop compares a local with a number constant and adds a number
+// constant to the same local, as in `for the i is 0, i < n, i = i + 1`.
+// Its clauses have then compiled to OP_GET_LOCAL, OP_CONSTANT and
+// OP_JUMP_IF_NOT_LESS, the jump to the body, and OP_ADD_LOCAL_CONSTANT.
+static bool isCountedLoop(int conditionStart, int incrementStart)
+{
+    Chunk *chunk = currentChunk();
+    uint8_t *condition = &chunk->code[conditionStart];
+    uint8_t *increment = &chunk->code[incrementStart];
+    Value *constants = chunk->constants.values;
+    return optimizationLevel >= 1 && incrementStart == conditionStart + 10 &&
+           chunk->count == incrementStart + 3 && condition[0] == OP_GET_LOCAL &&
+           condition[2] == OP_CONSTANT && condition[4] == OP_JUMP_IF_NOT_LESS &&
+           increment[0] == OP_ADD_LOCAL_CONSTANT && increment[1] == condition[1] &&
+           IS_NUMBER(constants[condition[3]]) && IS_NUMBER(constants[increment[2]]);
+}
+
+// Ends a counted loop with one OP_FOR_RANGE back to the body, keeping the
+// condition before the body as the test on entry. A body too long for its
+// 16-bit offset increments and loops back to that test instead.
+static void emitForRange(int conditionStart, int bodyStart, uint8_t *operands, int line)
+{
+    Chunk *chunk = currentChunk();
+    int jump = chunk->count - bodyStart + 6;
+    if (jump > UINT16_MAX)
+    {
+        writeChunk(chunk, OP_ADD_LOCAL_CONSTANT, line);
+        writeChunk(chunk, operands[0], line);
+        writeChunk(chunk, operands[1], line);
+        emitLoop(conditionStart);
+        return;
+    }
+    uint8_t bytes[] = {OP_FOR_RANGE, (jump >> 8) & 0xff, jump & 0xff,
+                       operands[0], operands[1], operands[2]};
+    for (int i = 0; i < 6; i++)
+        writeChunk(chunk, bytes[i], line);
+}
+
 static void forStatement()
 {
     beginScope();
 
     bool hasParentheses = match(TOKEN_LEFT_PAREN);
-    if (hasParentheses) {
-
-        if (match(TOKEN_THE))
+    if (match(TOKEN_THE))
+    {
+        int global = parseVariable("Expect variable name.");
+        if (match(TOKEN_EQUAL) || match(TOKEN_IS))
         {
-            uint8_t global = parseVariable("Expect variable name.");
-            if (match(TOKEN_EQUAL) || match(TOKEN_IS))
-            {
-                expression();
-            }
-            else
-            {
-                emitByte(OP_NULL);
-            }
-            consume(TOKEN_COMMA, "Expect ',' after variable declaration.");
-            defineVariable(global);
+            expression();
         }
-        else if (!match(TOKEN_COMMA))
+        else
         {
-            expression();
-            consume(TOKEN_COMMA, "Expect ',' after initializer.");
+            emitByte(OP_NULL);
         }
+        consume(TOKEN_COMMA, "Expect ',' after variable declaration.");
+        defineVariable(global);
+    }
+    else if (!match(TOKEN_COMMA))
+    {
+        expression();
+        consume(TOKEN_COMMA, "Expect ',' after initializer.");
+    }
 
-        int loopStart = currentChunk()->count;
+    int loopStart = markJumpTarget();
 
-        int exitJump = -1;
-        if (!match(TOKEN_COMMA))
-        {
-            expression();
-            consume(TOKEN_COMMA, "Expect ',' after loop condition.");
+    int exitJump = -1;
+    if (!match(TOKEN_COMMA))
+    {
+        expression();
+        consume(TOKEN_COMMA, "Expect ',' after loop condition.");
 
-            exitJump = emitJump(OP_JUMP_IF_FALSE);
-            emitByte(OP_POP); 
-        }
+        exitJump = emitConditionJump();
+    }
 
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        if (!match(TOKEN_COMMA))
-        {
-            expression();
-            emitByte(OP_POP);
-        }
+    int bodyJump = emitJump(OP_JUMP);
+    int incrementStart = markJumpTarget();
+    if (!match(TOKEN_COMMA))
+    {
+        expression();
+        emitByte(OP_POP);
+        fuseInstructions();
+    }
 
+    if (hasParentheses)
+    {
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    }
 
-        emitLoop(loopStart);
-        patchJump(bodyJump);
+    if (isCountedLoop(loopStart, incrementStart))
+    {
+        // The slot, step and limit operands of the OP_FOR_RANGE.
+        Chunk *chunk = currentChunk();
+        uint8_t operands[] = {chunk->code[incrementStart + 1], chunk->code[incrementStart + 2],
+                              chunk->code[loopStart + 3]};
+        int line = chunk->lines[incrementStart];
+        chunk->count = bodyJump - 1;
 
         consume(TOKEN_LEFT_BRACE, "Expect '{' before loop body.");
-        block();
-
-        emitLoop(incrementStart);
-
-        if (exitJump != -1)
-        {
-            patchJump(exitJump);
-            emitByte(OP_POP);
-        }
-    } else {
-
-        if (match(TOKEN_THE))
-        {
-            uint8_t global = parseVariable("Expect variable name.");
-            if (match(TOKEN_EQUAL) || match(TOKEN_IS))
-            {
-                expression();
-            }
-            else
-            {
-                emitByte(OP_NULL);
-            }
-            consume(TOKEN_COMMA, "Expect ',' after variable declaration.");
-            defineVariable(global);
-        }
-        else if (!match(TOKEN_COMMA))
-        {
-            expression();
-            consume(TOKEN_COMMA, "Expect ',' after initializer.");
-        }
-
-        int loopStart = currentChunk()->count;
-
-        int exitJump = -1;
-        if (!match(TOKEN_COMMA))
-        {
-            expression();
-            consume(TOKEN_COMMA, "Expect ',' after loop condition.");
-
-            exitJump = emitJump(OP_JUMP_IF_FALSE);
-            emitByte(OP_POP); 
-        }
-
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        if (!match(TOKEN_COMMA))
-        {
-            expression();
-            emitByte(OP_POP);
-        }
-
+        int bodyStart = markJumpTarget();
+        bodyBlock();
+        emitForRange(loopStart, bodyStart, operands, line);
+    }
+    else
+    {
         emitLoop(loopStart);
         patchJump(bodyJump);
 
         consume(TOKEN_LEFT_BRACE, "Expect '{' before loop body.");
-        block();
+        bodyBlock();
 
         emitLoop(incrementStart);
+    }
 
-        if (exitJump != -1)
-        {
-            patchJump(exitJump);
-            emitByte(OP_POP);
-        }
+    if (exitJump != -1)
+    {
+        patchConditionJump(exitJump);
     }
 
     endScope();
@@ -736,21 +1482,19 @@ static void ifStatement()
 {
     expression();
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    int thenJump = emitConditionJump();
     
     consume(TOKEN_LEFT_BRACE, "Expect '{' before if body.");
-    block();
+    bodyBlock();
 
     int elseJump = emitJump(OP_JUMP);
 
-    patchJump(thenJump);
-    emitByte(OP_POP);
+    patchConditionJump(thenJump);
     
     if (match(TOKEN_ELSE))
     {
         consume(TOKEN_LEFT_BRACE, "Expect '{' before else body.");
-        block();
+        bodyBlock();
     }
     
     patchJump(elseJump);
@@ -758,20 +1502,220 @@ static void ifStatement()
 
 static void whileStatement()
 {
-    int loopStart = currentChunk()->count;
+    int loopStart = markJumpTarget();
     
     expression();
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    int exitJump = emitConditionJump();
     
     consume(TOKEN_LEFT_BRACE, "Expect '{' before while body.");
-    block();
+    bodyBlock();
     
     emitLoop(loopStart);
     
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    patchConditionJump(exitJump);
+}
+
+// A case of a match statement and the body it runs, counting bodies in
+// source order.
+typedef struct
+{
+    Value key;
+    int body;
+} MatchCase;
+
+// Match cases are integer and string literals.
+static Value matchCaseKey()
+{
+    if (match(TOKEN_STRING))
+        return OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2));
+
+    bool negative = match(TOKEN_MINUS);
+    consume(TOKEN_NUMBER, "Expect integer or string literal as match case.");
+    errno = 0;
+    long long value = strtoll(parser.previous.start, NULL, 10);
+    if (memchr(parser.previous.start, '.', parser.previous.length) != NULL || errno != 0 ||
+        value > INT_VALUE_MAX)
+    {
+        error("Match cases must be integers or strings.");
+        return INT_VAL(0);
+    }
+    return INT_VAL(negative ? -value : value);
+}
+
+// Builds the match instruction and its jump table for `cases`. Entries are
+// written as offsets into `bodies`; the caller turns them into jumps.
+static int buildMatchTable(MatchCase *cases, int caseCount, int defaultBody, uint8_t *operands,
+                           int *entries)
+{
+    // A hash table at most half full, or a direct table indexed from the
+    // lowest integer when that is no bigger.
+    int capacity = 4;
+    while (capacity < caseCount * 2)
+        capacity *= 2;
+
+    bool integers = true;
+    int64_t lowest = caseCount > 0 ? AS_INT(cases[0].key) : 0;
+    int64_t highest = lowest;
+    for (int i = 0; i < caseCount && integers; i++)
+    {
+        integers = IS_INT(cases[i].key);
+        if (integers && AS_INT(cases[i].key) < lowest)
+            lowest = AS_INT(cases[i].key);
+        if (integers && AS_INT(cases[i].key) > highest)
+            highest = AS_INT(cases[i].key);
+    }
+
+    int count;
+    int constant;
+    if (integers && (uint64_t)highest - (uint64_t)lowest < (uint64_t)capacity)
+    {
+        count = caseCount > 0 ? (int)(highest - lowest) + 1 : 0;
+        for (int i = 0; i < count; i++)
+            entries[i] = defaultBody;
+        for (int i = 0; i < caseCount; i++)
+            entries[AS_INT(cases[i].key) - lowest] = cases[i].body;
+        operands[0] = OP_MATCH_TABLE;
+        constant = makeConstant(INT_VAL(lowest));
+    }
+    else
+    {
+        // The slots are added as a run of their own, outside the set of
+        // shared constants.
+        count = capacity;
+        constant = currentChunk()->constants.count;
+        for (int i = 0; i < capacity; i++)
+        {
+            entries[i] = defaultBody;
+            addConstant(currentChunk(), NULL_VAL);
+        }
+        Value *slots = &currentChunk()->constants.values[constant];
+        for (int i = 0; i < caseCount; i++)
+        {
+            uint32_t slot = matchKeyHash(cases[i].key) & (capacity - 1);
+            while (!IS_NULL(slots[slot]))
+                slot = (slot + 1) & (capacity - 1);
+            slots[slot] = cases[i].key;
+            entries[slot] = cases[i].body;
+        }
+        operands[0] = OP_MATCH_HASH;
+        if (currentChunk()->constants.count - 1 > UINT24_MAX)
+            error("Too many constants in one chunk.");
+    }
+    entries[count] = defaultBody;
+
+    operands[1] = (constant >> 16) & 0xff;
+    operands[2] = (constant >> 8) & 0xff;
+    operands[3] = constant & 0xff;
+    operands[4] = (count >> 8) & 0xff;
+    operands[5] = count & 0xff;
+    return count + 1;
+}
+
+// The bodies are compiled first, each but the last ending in a jump past
+// the others. The match instruction and its jump table, which depend on
+// every case, are then inserted in front of them, so that a match is a
+// single dispatch to the body that runs.
+static void matchStatement()
+{
+    int line = parser.previous.line;
+    expression();
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before match cases.");
+
+    Chunk *chunk = currentChunk();
+    int start = chunk->count;
+    MatchCase cases[UINT8_COUNT];
+    int caseCount = 0;
+    int bodies[UINT8_COUNT + 2];
+    int bodyCount = 0;
+    int exits[UINT8_COUNT + 1];
+    int defaultBody = -1;
+
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    {
+        if (bodyCount > UINT8_COUNT)
+        {
+            error("Too many cases in match statement.");
+            return;
+        }
+        if (bodyCount > 0)
+            exits[bodyCount - 1] = emitJump(OP_JUMP);
+
+        if (match(TOKEN_ELSE))
+        {
+            if (defaultBody != -1)
+                error("Match statement can only have one 'else'.");
+            defaultBody = bodyCount;
+        }
+        else
+        {
+            do
+            {
+                Value key = matchCaseKey();
+                for (int i = 0; i < caseCount; i++)
+                {
+                    if (valuesIdentical(cases[i].key, key))
+                        error("Duplicate match case.");
+                }
+                if (caseCount == UINT8_COUNT)
+                {
+                    error("Too many cases in match statement.");
+                    return;
+                }
+                cases[caseCount++] = (MatchCase){key, bodyCount};
+            } while (match(TOKEN_COMMA));
+        }
+
+        consume(TOKEN_LEFT_BRACE, "Expect '{' before match case body.");
+        bodies[bodyCount++] = markJumpTarget();
+        bodyBlock();
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after match cases.");
+
+    // Subjects no case matches go to the else body or past the last one.
+    bodies[bodyCount] = chunk->count;
+    uint8_t operands[6];
+    int entries[2 * UINT8_COUNT + 1];
+    int entryCount = buildMatchTable(cases, caseCount, defaultBody != -1 ? defaultBody : bodyCount,
+                                     operands, entries);
+
+    // Entries are short jumps unless the last one, which jumps furthest,
+    // does not fit.
+    int stride = 3;
+    if (sizeof(operands) + entryCount * 3 + chunk->count - start > UINT16_MAX)
+        stride = 5;
+    int size = (int)sizeof(operands) + entryCount * stride;
+    for (int i = 0; i < size; i++)
+        writeChunk(chunk, 0, line);
+    memmove(&chunk->code[start + size], &chunk->code[start], chunk->count - size - start);
+    memmove(&chunk->lines[start + size], &chunk->lines[start],
+            (chunk->count - size - start) * sizeof(int));
+    for (int i = 0; i < size; i++)
+        chunk->lines[start + i] = line;
+
+    memcpy(&chunk->code[start], operands, sizeof(operands));
+    for (int i = 0; i < entryCount; i++)
+    {
+        uint8_t *entry = &chunk->code[start + (int)sizeof(operands) + i * stride];
+        int jump = bodies[entries[i]] + size - (start + (int)sizeof(operands) + (i + 1) * stride);
+        entry[0] = stride == 5 ? OP_JUMP_LONG : OP_JUMP;
+        if (stride == 5)
+        {
+            entry[1] = (jump >> 24) & 0xff;
+            entry[2] = (jump >> 16) & 0xff;
+            entry[3] = (jump >> 8) & 0xff;
+            entry[4] = jump & 0xff;
+        }
+        else
+        {
+            entry[1] = (jump >> 8) & 0xff;
+            entry[2] = jump & 0xff;
+        }
+    }
+
+    for (int i = 0; i < bodyCount - 1; i++)
+        patchJump(exits[i] + size);
+    markJumpTarget();
 }
 
 static void synchronize()
@@ -788,6 +1732,7 @@ static void synchronize()
         case TOKEN_THE:
         case TOKEN_FOR:
         case TOKEN_IF:
+        case TOKEN_MATCH:
         case TOKEN_WHILE:
         case TOKEN_WRITE:
         case TOKEN_RETURN:
@@ -802,6 +1747,8 @@ static void synchronize()
 
 static void declaration()
 {
+    blockStart = currentChunk()->count;
+
     if (match(TOKEN_THE))
     {
         theDeclaration();
@@ -833,6 +1780,10 @@ static void statement()
     {
         whileStatement();
     }
+    else if (match(TOKEN_MATCH))
+    {
+        matchStatement();
+    }
     else if (match(TOKEN_LEFT_BRACE))
     {
         beginScope();
@@ -845,19 +1796,148 @@ static void statement()
     }
 }
 
-bool compile(const char *source, Chunk *chunk){
-
+// Counts every declaration of and assignment to each name in the source.
+// Locals are counted too, which only makes the result more conservative.
+static void countGlobalWrites(const char *source)
+{
     initScanner(source);
-    Compiler compiler;
-    initCompiler(&compiler);
+    Token beforePrevious = {TOKEN_EOF, NULL, 0, 0};
+    Token previous = beforePrevious;
+    for (;;)
+    {
+        Token token = scanToken();
+        if (token.type == TOKEN_EOF)
+            break;
+
+        Token *written = NULL;
+        if (token.type == TOKEN_IDENTIFIER && previous.type == TOKEN_THE)
+            written = &token;
+        else if ((token.type == TOKEN_EQUAL || token.type == TOKEN_IS) &&
+                 previous.type == TOKEN_IDENTIFIER && beforePrevious.type != TOKEN_THE)
+            written = &previous;
+
+        if (written != NULL)
+        {
+            ObjString *name = copyString(written->start, written->length);
+            Value writes = INT_VAL(0);
+            tableGet(&globalWrites, name, &writes);
+            tableSet(&globalWrites, name, INT_VAL(AS_INT(writes) + 1));
+        }
+
+        beforePrevious = previous;
+        previous = token;
+    }
+}
+
+// Compiles declarations into `chunk` until the end of the source or, when
+// `batchEnd` is set, until one ends at or past it.
+static void compileDeclarations(Chunk *chunk, Compiler *compiler, const char *batchEnd)
+{
+    constantSet = (ConstantSet){0, 0, NULL};
+    jumpOverflow = false;
+
+    initCompiler(compiler);
     compilingChunk = chunk;
+    while (!check(TOKEN_EOF))
+    {
+        declaration();
+        if (batchEnd != NULL && parser.current.start >= batchEnd)
+            break;
+    }
+
+    FREE_ARRAY(int, constantSet.indices, constantSet.capacity);
+}
+
+static void beginSource(const char *source)
+{
+    initTable(&constantGlobals);
+    initScanner(source);
     parser.hadError = false;
     parser.panicMode = false;
     advance();
-    while (!match(TOKEN_EOF))
+}
+
+bool compile(const char *source, Chunk *chunk){
+
+    int64_t start = monotonicNanos();
+    initTable(&globalWrites);
+    countGlobalWrites(source);
+
+    Compiler compiler;
+    CompileStats stats = compileStats;
+    wideJumps = false;
+    beginSource(source);
+    compileDeclarations(chunk, &compiler, NULL);
+    if (jumpOverflow && !parser.hadError)
     {
-        declaration();
+        freeChunk(chunk);
+        freeTable(&constantGlobals);
+        compileStats = stats;
+        wideJumps = true;
+        beginSource(source);
+        compileDeclarations(chunk, &compiler, NULL);
+    }
+
+    endCompiler();
+    freeTable(&constantGlobals);
+    freeTable(&globalWrites);
+    compileStats.compileNanos += monotonicNanos() - start;
+    return !parser.hadError;
+}
+
+// Source each batch covers before it stops at the next top-level
+// declaration. Large enough that batches are cheap to hand over, small
+// enough that the first one starts running soon.
+#define BATCH_SOURCE_BYTES (64 * 1024)
+
+Compiler batchCompiler;
+
+void beginBatches(const char *source)
+{
+    int64_t start = monotonicNanos();
+    initTable(&globalWrites);
+    countGlobalWrites(source);
+    beginSource(source);
+    compileStats.compileNanos += monotonicNanos() - start;
+}
+
+bool compileBatch(Chunk *chunk, bool *last)
+{
+    int64_t start = monotonicNanos();
+    const char *batchEnd = parser.current.start + BATCH_SOURCE_BYTES;
+
+    // What the batch starts from, in case it has to be compiled again.
+    Scanner scanned = scanner;
+    Parser parsed = parser;
+    CompileStats stats = compileStats;
+    Table constants;
+    initTable(&constants);
+    tableAddAll(&constantGlobals, &constants);
+
+    wideJumps = false;
+    compileDeclarations(chunk, &batchCompiler, batchEnd);
+    if (jumpOverflow && !parser.hadError)
+    {
+        freeChunk(chunk);
+        scanner = scanned;
+        parser = parsed;
+        compileStats = stats;
+        freeTable(&constantGlobals);
+        constantGlobals = constants;
+        initTable(&constants);
+        wideJumps = true;
+        compileDeclarations(chunk, &batchCompiler, batchEnd);
     }
+    freeTable(&constants);
+
     endCompiler();
+    *last = check(TOKEN_EOF);
+    compileStats.compileNanos += monotonicNanos() - start;
     return !parser.hadError;
-}
\ No newline at end of file
+}
+
+void endBatches()
+{
+    freeTable(&constantGlobals);
+    freeTable(&globalWrites);
+}
@@ -1,6 +1,77 @@
 #include <stdio.h>
 #include "kavya/debug.h"
+#include "kavya/register.h"
 #include "kavya/value.h"
+#include "kavya/vm.h"
+
+static const char *const opcodeNames[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NULL] = "OP_NULL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL_SLOT] = "OP_GET_GLOBAL_SLOT",
+    [OP_DEFINE_GLOBAL_SLOT] = "OP_DEFINE_GLOBAL_SLOT",
+    [OP_SET_GLOBAL_SLOT] = "OP_SET_GLOBAL_SLOT",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_IS] = "OP_IS",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_WRITE] = "OP_WRITE",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_ASK] = "OP_ASK",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_GET_LOCAL_2] = "OP_GET_LOCAL_2",
+    [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_EQUAL_NUM] = "OP_EQUAL_NUM",
+    [OP_ADD_NN] = "OP_ADD_NN",
+    [OP_SUBTRACT_NN] = "OP_SUBTRACT_NN",
+    [OP_MULTIPLY_NN] = "OP_MULTIPLY_NN",
+    [OP_DIVIDE_NN] = "OP_DIVIDE_NN",
+    [OP_GREATER_NN] = "OP_GREATER_NN",
+    [OP_LESS_NN] = "OP_LESS_NN",
+    [OP_GREATER_EQUAL_NN] = "OP_GREATER_EQUAL_NN",
+    [OP_LESS_EQUAL_NN] = "OP_LESS_EQUAL_NN",
+    [OP_FOR_RANGE] = "OP_FOR_RANGE",
+    [OP_JUMP_IF_NOT_LESS_NN] = "OP_JUMP_IF_NOT_LESS_NN",
+    [OP_JUMP_IF_NOT_GREATER_NN] = "OP_JUMP_IF_NOT_GREATER_NN",
+    [OP_MATCH_TABLE] = "OP_MATCH_TABLE",
+    [OP_MATCH_HASH] = "OP_MATCH_HASH",
+    [OP_CONCAT_N] = "OP_CONCAT_N",
+    [OP_TO_STRING] = "OP_TO_STRING",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_GET_GLOBAL_SLOT_LONG] = "OP_GET_GLOBAL_SLOT_LONG",
+    [OP_DEFINE_GLOBAL_SLOT_LONG] = "OP_DEFINE_GLOBAL_SLOT_LONG",
+    [OP_SET_GLOBAL_SLOT_LONG] = "OP_SET_GLOBAL_SLOT_LONG",
+    [OP_JUMP_LONG] = "OP_JUMP_LONG",
+    [OP_JUMP_IF_FALSE_LONG] = "OP_JUMP_IF_FALSE_LONG",
+    [OP_LOOP_LONG] = "OP_LOOP_LONG",
+};
+
+const char *opcodeName(uint8_t opcode)
+{
+    if (opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0]))
+        return NULL;
+    return opcodeNames[opcode];
+}
 
 void disassembleChunk(Chunk *chunk, const char *name)
 {
@@ -44,6 +115,217 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset)
     return offset + 2;
 }
 
+static int jumpLongInstruction(const char *name, Chunk *chunk, int offset)
+{
+    printf("%-16s %4d -> %d\n", name, offset, jumpTarget(chunk, offset));
+    return offset + 5;
+}
+
+static int readLongOperand(Chunk *chunk, int offset)
+{
+    uint8_t *operand = &chunk->code[offset + 1];
+    return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+static int constantLongInstruction(const char *name, Chunk *chunk, int offset)
+{
+    int constant = readLongOperand(chunk, offset);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' \n");
+    return offset + 4;
+}
+
+static int globalLongInstruction(const char *name, Chunk *chunk, int offset)
+{
+    int slot = readLongOperand(chunk, offset);
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("' \n");
+    return offset + 4;
+}
+
+static void printGlobal(uint8_t slot)
+{
+    printf("g%d'", slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'");
+}
+
+static int globalInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("' \n");
+    return offset + 2;
+}
+
+static int twoByteInstruction(const char *name, Chunk *chunk, int offset)
+{
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+    return offset + 3;
+}
+
+static int localConstantInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' \n");
+    return offset + 3;
+}
+
+static int forRangeInstruction(Chunk *chunk, int offset)
+{
+    uint8_t *operand = &chunk->code[offset + 1];
+    printf("%-16s %4d '", opcodeName(OP_FOR_RANGE), operand[2]);
+    printValue(chunk->constants.values[operand[3]]);
+    printf("' '");
+    printValue(chunk->constants.values[operand[4]]);
+    printf("' -> %d\n", jumpTarget(chunk, offset));
+    return offset + 6;
+}
+
+// The jump table entries after a match instruction are listed as the
+// jumps they are.
+static int matchInstruction(const char *name, Chunk *chunk, int offset)
+{
+    int constant = readLongOperand(chunk, offset);
+    int count = matchEntryCount(chunk, offset) - 1;
+    if (chunk->code[offset] == OP_MATCH_TABLE)
+    {
+        printf("%-16s %4d '", name, constant);
+        printValue(chunk->constants.values[constant]);
+        printf("' %d cases\n", count);
+    }
+    else
+    {
+        printf("%-16s %4d %d slots\n", name, constant, count);
+    }
+    return offset + 6;
+}
+
+static void printOperand(Chunk *chunk, uint8_t operand)
+{
+    if (operand & RK_CONSTANT)
+    {
+        printf(" k%d'", operand & ~RK_CONSTANT);
+        printValue(chunk->constants.values[operand & ~RK_CONSTANT]);
+        printf("'");
+    }
+    else
+    {
+        printf(" r%d", operand);
+    }
+}
+
+// Prints a register instruction: `registers` leading operands are register
+// numbers, `constants` are constant indices and `operands` are RK operands,
+// followed by a jump offset when `sign` is non-zero.
+static int registerInstruction(const char *name, Chunk *chunk, int offset,
+                               int registers, int constants, int operands, int sign)
+{
+    int length = 1 + registers + constants + operands + (sign != 0 ? 2 : 0);
+    uint8_t *operand = &chunk->code[offset + 1];
+
+    printf("%-16s", name);
+    for (int i = 0; i < registers; i++)
+        printf(" r%d", *operand++);
+    for (int i = 0; i < constants; i++)
+    {
+        printf(" k%d'", *operand);
+        printValue(chunk->constants.values[*operand++]);
+        printf("'");
+    }
+    for (int i = 0; i < operands; i++)
+        printOperand(chunk, *operand++);
+    if (sign != 0)
+    {
+        uint16_t jump = (uint16_t)((operand[0] << 8) | operand[1]);
+        printf(" -> %d", offset + length + sign * jump);
+    }
+    printf("\n");
+    return offset + length;
+}
+
+static int disassembleRegisterInstruction(Chunk *chunk, int offset)
+{
+    uint8_t instruction = chunk->code[offset];
+    switch (instruction)
+    {
+    case REG_MOVE:
+        return registerInstruction("REG_MOVE", chunk, offset, 2, 0, 0, 0);
+    case REG_LOADK:
+        return registerInstruction("REG_LOADK", chunk, offset, 1, 1, 0, 0);
+    case REG_NULL:
+        return registerInstruction("REG_NULL", chunk, offset, 1, 0, 0, 0);
+    case REG_TRUE:
+        return registerInstruction("REG_TRUE", chunk, offset, 1, 0, 0, 0);
+    case REG_FALSE:
+        return registerInstruction("REG_FALSE", chunk, offset, 1, 0, 0, 0);
+    case REG_GET_GLOBAL:
+        printf("%-16s r%d ", "REG_GET_GLOBAL", chunk->code[offset + 1]);
+        printGlobal(chunk->code[offset + 2]);
+        printf("\n");
+        return offset + 3;
+    case REG_DEFINE_GLOBAL:
+    case REG_SET_GLOBAL:
+        printf("%-16s ", instruction == REG_DEFINE_GLOBAL ? "REG_DEFINE_GLOBAL"
+                                                         : "REG_SET_GLOBAL");
+        printGlobal(chunk->code[offset + 1]);
+        printOperand(chunk, chunk->code[offset + 2]);
+        printf("\n");
+        return offset + 3;
+    case REG_EQUAL:
+        return registerInstruction("REG_EQUAL", chunk, offset, 1, 0, 2, 0);
+    case REG_GREATER:
+        return registerInstruction("REG_GREATER", chunk, offset, 1, 0, 2, 0);
+    case REG_LESS:
+        return registerInstruction("REG_LESS", chunk, offset, 1, 0, 2, 0);
+    case REG_ADD:
+        return registerInstruction("REG_ADD", chunk, offset, 1, 0, 2, 0);
+    case REG_SUBTRACT:
+        return registerInstruction("REG_SUBTRACT", chunk, offset, 1, 0, 2, 0);
+    case REG_MULTIPLY:
+        return registerInstruction("REG_MULTIPLY", chunk, offset, 1, 0, 2, 0);
+    case REG_DIVIDE:
+        return registerInstruction("REG_DIVIDE", chunk, offset, 1, 0, 2, 0);
+    case REG_NOT:
+        return registerInstruction("REG_NOT", chunk, offset, 1, 0, 1, 0);
+    case REG_NEGATE:
+        return registerInstruction("REG_NEGATE", chunk, offset, 1, 0, 1, 0);
+    case REG_WRITE:
+        return registerInstruction("REG_WRITE", chunk, offset, 0, 0, 1, 0);
+    case REG_ASK:
+        return registerInstruction("REG_ASK", chunk, offset, 1, 0, 1, 0);
+    case REG_CONCAT:
+        printf("%-16s r%d..r%d\n", "REG_CONCAT", chunk->code[offset + 1],
+               chunk->code[offset + 1] + chunk->code[offset + 2] - 1);
+        return offset + 3;
+    case REG_TO_STRING:
+        return registerInstruction("REG_TO_STRING", chunk, offset, 1, 0, 1, 0);
+    case REG_JUMP:
+        return registerInstruction("REG_JUMP", chunk, offset, 0, 0, 0, 1);
+    case REG_JUMP_IF_FALSE:
+        return registerInstruction("REG_JUMP_IF_FALSE", chunk, offset, 0, 0, 1, 1);
+    case REG_JUMP_IF_NOT_LESS:
+        return registerInstruction("REG_JUMP_IF_NOT_LESS", chunk, offset, 0, 0, 2, 1);
+    case REG_JUMP_IF_NOT_GREATER:
+        return registerInstruction("REG_JUMP_IF_NOT_GREATER", chunk, offset, 0, 0, 2, 1);
+    case REG_LOOP:
+        return registerInstruction("REG_LOOP", chunk, offset, 0, 0, 0, -1);
+    case REG_FOR_RANGE:
+        return registerInstruction("REG_FOR_RANGE", chunk, offset, 1, 2, 0, -1);
+    case REG_RETURN:
+        return registerInstruction("REG_RETURN", chunk, offset, 0, 0, 0, 0);
+    default:
+        printf("Unknown opcode %d\n", instruction);
+        return offset + 1;
+    }
+}
+
 int disassembleInstruction(Chunk *chunk, int offset)
 {
 
@@ -58,61 +340,131 @@ int disassembleInstruction(Chunk *chunk, int offset)
         printf("%4d ", chunk->lines[offset]);
     }
 
+    if (chunk->registerCode)
+        return disassembleRegisterInstruction(chunk, offset);
+
     uint8_t instruction = chunk->code[offset];
+    const char *name = opcodeName(instruction);
     switch (instruction)
     {
     case OP_CONSTANT:
-        return constantInstruction("OP_CONSTANT", chunk, offset);
+        return constantInstruction(name, chunk, offset);
     case OP_NULL:
-        return simpleInstruction("OP_NULL", offset);
+        return simpleInstruction(name, offset);
     case OP_TRUE:
-        return simpleInstruction("OP_TRUE", offset);
+        return simpleInstruction(name, offset);
     case OP_FALSE:
-        return simpleInstruction("OP_FALSE", offset);
+        return simpleInstruction(name, offset);
     case OP_POP:
-        return simpleInstruction("OP_POP", offset);
+        return simpleInstruction(name, offset);
     case OP_GET_LOCAL:
-        return byteInstruction("OP_GET_LOCAL", chunk, offset);
+        return byteInstruction(name, chunk, offset);
     case OP_SET_LOCAL:
-        return byteInstruction("OP_SET_LOCAL", chunk, offset);
-    case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-    case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-    case OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        return byteInstruction(name, chunk, offset);
+    case OP_GET_GLOBAL_SLOT:
+        return globalInstruction(name, chunk, offset);
+    case OP_DEFINE_GLOBAL_SLOT:
+        return globalInstruction(name, chunk, offset);
+    case OP_SET_GLOBAL_SLOT:
+        return globalInstruction(name, chunk, offset);
     case OP_EQUAL:
-        return simpleInstruction("OP_EQUAL", offset);
+        return simpleInstruction(name, offset);
     case OP_IS:
-        return simpleInstruction("OP_IS", offset);
+        return simpleInstruction(name, offset);
     case OP_GREATER:
-        return simpleInstruction("OP_GREATER", offset);
+        return simpleInstruction(name, offset);
     case OP_LESS:
-        return simpleInstruction("OP_LESS", offset);
+        return simpleInstruction(name, offset);
     case OP_ADD:
-        return simpleInstruction("OP_ADD", offset);
+        return simpleInstruction(name, offset);
     case OP_SUBTRACT:
-        return simpleInstruction("OP_SUBTRACT", offset);
+        return simpleInstruction(name, offset);
     case OP_MULTIPLY:
-        return simpleInstruction("OP_MULTIPLY", offset);
+        return simpleInstruction(name, offset);
     case OP_DIVIDE:
-        return simpleInstruction("OP_DIVIDE", offset);
+        return simpleInstruction(name, offset);
     case OP_NOT:
-        return simpleInstruction("OP_NOT", offset);
+        return simpleInstruction(name, offset);
     case OP_NEGATE:
-        return simpleInstruction("OP_NEGATE", offset);
+        return simpleInstruction(name, offset);
     case OP_WRITE:
-        return simpleInstruction("OP_WRITE", offset);
+        return simpleInstruction(name, offset);
     case OP_ASK:
-        return simpleInstruction("OP_ASK", offset);
+        return simpleInstruction(name, offset);
     case OP_JUMP:
-        return jumpInstruction("OP_JUMP", 1, chunk, offset);
+        return jumpInstruction(name, 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
-        return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        return jumpInstruction(name, 1, chunk, offset);
     case OP_LOOP:
-        return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        return jumpInstruction(name, -1, chunk, offset);
     case OP_RETURN:
-        return simpleInstruction("OP_RETURN", offset);
+        return simpleInstruction(name, offset);
+    case OP_ADD_LOCAL_CONSTANT:
+        return localConstantInstruction(name, chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return byteInstruction(name, chunk, offset);
+    case OP_GET_LOCAL_2:
+        return twoByteInstruction(name, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS:
+        return jumpInstruction(name, 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER:
+        return jumpInstruction(name, 1, chunk, offset);
+    case OP_GREATER_EQUAL:
+        return simpleInstruction(name, offset);
+    case OP_LESS_EQUAL:
+        return simpleInstruction(name, offset);
+    case OP_NOT_EQUAL:
+        return simpleInstruction(name, offset);
+    case OP_ADD_NUM:
+        return simpleInstruction(name, offset);
+    case OP_ADD_STR:
+        return simpleInstruction(name, offset);
+    case OP_EQUAL_NUM:
+        return simpleInstruction(name, offset);
+    case OP_ADD_NN:
+        return simpleInstruction(name, offset);
+    case OP_SUBTRACT_NN:
+        return simpleInstruction(name, offset);
+    case OP_MULTIPLY_NN:
+        return simpleInstruction(name, offset);
+    case OP_DIVIDE_NN:
+        return simpleInstruction(name, offset);
+    case OP_GREATER_NN:
+        return simpleInstruction(name, offset);
+    case OP_LESS_NN:
+        return simpleInstruction(name, offset);
+    case OP_GREATER_EQUAL_NN:
+        return simpleInstruction(name, offset);
+    case OP_LESS_EQUAL_NN:
+        return simpleInstruction(name, offset);
+    case OP_FOR_RANGE:
+        return forRangeInstruction(chunk, offset);
+    case OP_JUMP_IF_NOT_LESS_NN:
+        return jumpInstruction(name, 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER_NN:
+        return jumpInstruction(name, 1, chunk, offset);
+    case OP_MATCH_TABLE:
+        return matchInstruction(name, chunk, offset);
+    case OP_MATCH_HASH:
+        return matchInstruction(name, chunk, offset);
+    case OP_CONCAT_N:
+        return byteInstruction(name, chunk, offset);
+    case OP_TO_STRING:
+        return simpleInstruction(name, offset);
+    case OP_CONSTANT_LONG:
+        return constantLongInstruction(name, chunk, offset);
+    case OP_GET_GLOBAL_SLOT_LONG:
+        return globalLongInstruction(name, chunk, offset);
+    case OP_DEFINE_GLOBAL_SLOT_LONG:
+        return globalLongInstruction(name, chunk, offset);
+    case OP_SET_GLOBAL_SLOT_LONG:
+        return globalLongInstruction(name, chunk, offset);
+    case OP_JUMP_LONG:
+        return jumpLongInstruction(name, chunk, offset);
+    case OP_JUMP_IF_FALSE_LONG:
+        return jumpLongInstruction(name, chunk, offset);
+    case OP_LOOP_LONG:
+        return jumpLongInstruction(name, chunk, offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
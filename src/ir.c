@@ -0,0 +1,1376 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "kavya/ir.h"
+#include "kavya/memory.h"
+
+// Hoisting restarts the passes after every expression it moves; this
+// bounds how often.
+#define MAX_HOISTS 256
+
+// Facts about the graph as it is between two rewrites: predecessors,
+// reverse postorder from the entry, immediate dominators and the stack
+// depth each block starts at. Only reachable blocks are covered.
+typedef struct
+{
+    int count;
+    int *predecessorStart;
+    int *predecessors;
+    int *order;
+    int orderCount;
+    int *orderIndex;
+    int *dominator;
+    int *depth;
+} Analysis;
+
+static Analysis analysis;
+
+typedef struct
+{
+    int header;
+    bool *blocks;
+    // Stack depth at the header: the locals live across the loop.
+    int depth;
+    bool writtenLocals[UINT8_COUNT];
+    // Indexed by global slot.
+    bool *writtenGlobals;
+    bool *definedGlobals;
+    int globalCount;
+} Loop;
+
+// A value on the stack while a block is simulated: the instructions that
+// computed it, from start to end, and what is known about them.
+typedef struct
+{
+    int start;
+    int end;
+    bool invariant;
+    bool canFail;
+    bool computed;
+} Expression;
+
+static void appendInstruction(BasicBlock *block, IrInstruction instruction)
+{
+    if (block->capacity < block->count + 1)
+    {
+        int oldCapacity = block->capacity;
+        block->capacity = GROW_CAPACITY(oldCapacity);
+        block->code = GROW_ARRAY(IrInstruction, block->code, oldCapacity, block->capacity);
+    }
+    block->code[block->count++] = instruction;
+}
+
+static IrInstruction instruction(uint8_t op, int operand, int line)
+{
+    return (IrInstruction){op, operand, 0, -1, line, false};
+}
+
+static int addBlock(ControlFlowGraph *graph)
+{
+    if (graph->capacity < graph->count + 1)
+    {
+        int oldCapacity = graph->capacity;
+        graph->capacity = GROW_CAPACITY(oldCapacity);
+        graph->blocks = GROW_ARRAY(BasicBlock, graph->blocks, oldCapacity, graph->capacity);
+    }
+    graph->blocks[graph->count] = (BasicBlock){NULL, 0, 0, -1, false};
+    return graph->count++;
+}
+
+// Puts `block` at `position` in the layout.
+static void insertLayout(ControlFlowGraph *graph, int position, int block)
+{
+    if (graph->layoutCapacity < graph->layoutCount + 1)
+    {
+        int oldCapacity = graph->layoutCapacity;
+        graph->layoutCapacity = GROW_CAPACITY(oldCapacity);
+        graph->layout = GROW_ARRAY(int, graph->layout, oldCapacity, graph->layoutCapacity);
+    }
+    memmove(&graph->layout[position + 1], &graph->layout[position],
+            (graph->layoutCount - position) * sizeof(int));
+    graph->layout[position] = block;
+    graph->layoutCount++;
+}
+
+static int layoutPosition(ControlFlowGraph *graph, int block)
+{
+    for (int position = 0; position < graph->layoutCount; position++)
+    {
+        if (graph->layout[position] == block)
+            return position;
+    }
+    return -1;
+}
+
+static void removeBlock(ControlFlowGraph *graph, int block)
+{
+    int position = layoutPosition(graph, block);
+    memmove(&graph->layout[position], &graph->layout[position + 1],
+            (graph->layoutCount - position - 1) * sizeof(int));
+    graph->layoutCount--;
+    graph->blocks[block].removed = true;
+}
+
+static int entryBlock(ControlFlowGraph *graph)
+{
+    return graph->layout[0];
+}
+
+static int branchTarget(BasicBlock *block)
+{
+    return block->count > 0 ? block->code[block->count - 1].target : -1;
+}
+
+static int successors(BasicBlock *block, int *out)
+{
+    int count = 0;
+    if (block->next != -1)
+        out[count++] = block->next;
+    int target = branchTarget(block);
+    if (target != -1 && target != block->next)
+        out[count++] = target;
+    return count;
+}
+
+// Points every edge from `block` to `from` at `to` instead.
+static void redirect(BasicBlock *block, int from, int to)
+{
+    if (block->next == from)
+        block->next = to;
+    if (block->count > 0 && block->code[block->count - 1].target == from)
+        block->code[block->count - 1].target = to;
+}
+
+static bool isLocalInstruction(uint8_t op)
+{
+    return op == OP_GET_LOCAL || op == OP_SET_LOCAL || op == OP_SET_LOCAL_POP ||
+           op == OP_ADD_LOCAL_CONSTANT;
+}
+
+// How many values an instruction pops and then pushes.
+static void stackUse(IrInstruction *instruction, int *pops, int *pushes)
+{
+    switch (instruction->op)
+    {
+    case OP_CONSTANT:
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL_SLOT:
+        *pops = 0;
+        *pushes = 1;
+        break;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_SET_LOCAL_POP:
+    case OP_WRITE:
+        *pops = 1;
+        *pushes = 0;
+        break;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL_SLOT:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_ASK:
+    case OP_TO_STRING:
+    case OP_JUMP_IF_FALSE:
+        *pops = 1;
+        *pushes = 1;
+        break;
+    case OP_CONCAT_N:
+        *pops = instruction->operand;
+        *pushes = 1;
+        break;
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+        *pops = 2;
+        *pushes = 0;
+        break;
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_RETURN:
+        *pops = 0;
+        *pushes = 0;
+        break;
+    default:
+        // Binary operators.
+        *pops = 2;
+        *pushes = 1;
+        break;
+    }
+}
+
+static int irStackEffect(IrInstruction *instruction)
+{
+    if (instruction->op == OP_CONCAT_N)
+        return 1 - instruction->operand;
+    return stackEffect(instruction->op);
+}
+
+static bool isBinaryOperator(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_EQUAL:
+    case OP_IS:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Operators that accept operands of any type.
+static bool operatorCannotFail(uint8_t op)
+{
+    return op == OP_EQUAL || op == OP_IS || op == OP_NOT_EQUAL || op == OP_NOT;
+}
+
+static int readLong(uint8_t *operands)
+{
+    return (operands[0] << 16) | (operands[1] << 8) | operands[2];
+}
+
+void buildGraph(ControlFlowGraph *graph, Chunk *chunk)
+{
+    *graph = (ControlFlowGraph){chunk, NULL, 0, 0, NULL, 0, 0};
+
+    // A block starts at the entry, at every jump target and after every
+    // jump or return.
+    bool *leaders = ALLOCATE(bool, chunk->count + 1);
+    memset(leaders, 0, (chunk->count + 1) * sizeof(bool));
+    leaders[0] = true;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        uint8_t op = chunk->code[offset];
+        if (isJumpInstruction(op))
+            leaders[jumpTarget(chunk, offset)] = true;
+        if (isJumpInstruction(op) || op == OP_RETURN)
+            leaders[offset + instructionLength(chunk, offset)] = true;
+    }
+
+    int *blockAt = ALLOCATE(int, chunk->count);
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        if (leaders[offset])
+        {
+            blockAt[offset] = addBlock(graph);
+            insertLayout(graph, graph->layoutCount, blockAt[offset]);
+        }
+    }
+
+    BasicBlock *block = NULL;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        if (leaders[offset])
+            block = &graph->blocks[blockAt[offset]];
+
+        uint8_t *code = &chunk->code[offset];
+        int next = offset + instructionLength(chunk, offset);
+        IrInstruction lifted = instruction(code[0], 0, chunk->lines[offset]);
+        switch (code[0])
+        {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_CONCAT_N:
+            lifted.operand = code[1];
+            break;
+        case OP_CONSTANT_LONG:
+            lifted = instruction(OP_CONSTANT, readLong(code + 1), lifted.line);
+            break;
+        case OP_GET_GLOBAL_SLOT_LONG:
+            lifted = instruction(OP_GET_GLOBAL_SLOT, readLong(code + 1), lifted.line);
+            break;
+        case OP_DEFINE_GLOBAL_SLOT_LONG:
+            lifted = instruction(OP_DEFINE_GLOBAL_SLOT, readLong(code + 1), lifted.line);
+            break;
+        case OP_SET_GLOBAL_SLOT_LONG:
+            lifted = instruction(OP_SET_GLOBAL_SLOT, readLong(code + 1), lifted.line);
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+            lifted.operand = code[1];
+            lifted.operand2 = code[2];
+            break;
+        case OP_GET_LOCAL_2:
+            // Split so each local read is an expression of its own; lowering
+            // fuses adjacent reads again.
+            appendInstruction(block, instruction(OP_GET_LOCAL, code[1], lifted.line));
+            lifted = instruction(OP_GET_LOCAL, code[2], lifted.line);
+            break;
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+            block->next = blockAt[jumpTarget(chunk, offset)];
+            continue;
+        case OP_FOR_RANGE:
+            // Split into the increment, comparison and back edge it stands
+            // for; lowering fuses them again.
+            lifted = instruction(OP_ADD_LOCAL_CONSTANT, code[3], lifted.line);
+            lifted.operand2 = code[4];
+            appendInstruction(block, lifted);
+            appendInstruction(block, instruction(OP_GET_LOCAL, code[3], lifted.line));
+            appendInstruction(block, instruction(OP_CONSTANT, code[5], lifted.line));
+            lifted = instruction(OP_JUMP_IF_NOT_LESS, 0, lifted.line);
+            lifted.target = blockAt[next];
+            appendInstruction(block, lifted);
+            block->next = blockAt[jumpTarget(chunk, offset)];
+            continue;
+        case OP_JUMP_IF_FALSE_LONG:
+            lifted.op = OP_JUMP_IF_FALSE;
+            lifted.target = blockAt[jumpTarget(chunk, offset)];
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+            lifted.target = blockAt[jumpTarget(chunk, offset)];
+            break;
+        default:
+            break;
+        }
+        appendInstruction(block, lifted);
+        if (code[0] != OP_RETURN && next < chunk->count && leaders[next])
+            block->next = blockAt[next];
+    }
+
+    FREE_ARRAY(bool, leaders, chunk->count + 1);
+    FREE_ARRAY(int, blockAt, chunk->count);
+}
+
+void freeGraph(ControlFlowGraph *graph)
+{
+    for (int i = 0; i < graph->count; i++)
+    {
+        FREE_ARRAY(IrInstruction, graph->blocks[i].code, graph->blocks[i].capacity);
+    }
+    FREE_ARRAY(BasicBlock, graph->blocks, graph->capacity);
+    FREE_ARRAY(int, graph->layout, graph->layoutCapacity);
+}
+
+static int intersect(int a, int b)
+{
+    while (a != b)
+    {
+        while (analysis.orderIndex[a] > analysis.orderIndex[b])
+            a = analysis.dominator[a];
+        while (analysis.orderIndex[b] > analysis.orderIndex[a])
+            b = analysis.dominator[b];
+    }
+    return a;
+}
+
+static void analyze(ControlFlowGraph *graph)
+{
+    int count = graph->count;
+    analysis.count = count;
+    analysis.order = ALLOCATE(int, count);
+    analysis.orderIndex = ALLOCATE(int, count);
+    analysis.dominator = ALLOCATE(int, count);
+    analysis.depth = ALLOCATE(int, count);
+    analysis.predecessorStart = ALLOCATE(int, count + 1);
+    for (int i = 0; i < count; i++)
+    {
+        analysis.orderIndex[i] = -1;
+        analysis.dominator[i] = -1;
+        analysis.depth[i] = -1;
+    }
+
+    // Depth-first search for the postorder, without recursion.
+    int *stack = ALLOCATE(int, count);
+    int *edges = ALLOCATE(int, count);
+    bool *visited = ALLOCATE(bool, count);
+    memset(visited, 0, count * sizeof(bool));
+    int entry = entryBlock(graph);
+    int top = 0;
+    int postorderCount = 0;
+    stack[top] = entry;
+    edges[top++] = 0;
+    visited[entry] = true;
+    while (top > 0)
+    {
+        int block = stack[top - 1];
+        int next[2];
+        int nextCount = successors(&graph->blocks[block], next);
+        if (edges[top - 1] < nextCount)
+        {
+            int successor = next[edges[top - 1]++];
+            if (!visited[successor])
+            {
+                visited[successor] = true;
+                stack[top] = successor;
+                edges[top++] = 0;
+            }
+        }
+        else
+        {
+            analysis.order[postorderCount++] = block;
+            top--;
+        }
+    }
+    analysis.orderCount = postorderCount;
+    for (int i = 0; i < postorderCount / 2; i++)
+    {
+        int swap = analysis.order[i];
+        analysis.order[i] = analysis.order[postorderCount - 1 - i];
+        analysis.order[postorderCount - 1 - i] = swap;
+    }
+    for (int i = 0; i < postorderCount; i++)
+    {
+        analysis.orderIndex[analysis.order[i]] = i;
+    }
+
+    // Predecessor lists over the edges out of reachable blocks.
+    memset(analysis.predecessorStart, 0, (count + 1) * sizeof(int));
+    int edgeCount = 0;
+    for (int i = 0; i < postorderCount; i++)
+    {
+        int next[2];
+        int nextCount = successors(&graph->blocks[analysis.order[i]], next);
+        for (int j = 0; j < nextCount; j++)
+        {
+            analysis.predecessorStart[next[j] + 1]++;
+        }
+        edgeCount += nextCount;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        analysis.predecessorStart[i + 1] += analysis.predecessorStart[i];
+    }
+    analysis.predecessors = ALLOCATE(int, edgeCount);
+    int *filled = edges;
+    memset(filled, 0, count * sizeof(int));
+    for (int i = 0; i < postorderCount; i++)
+    {
+        int block = analysis.order[i];
+        int next[2];
+        int nextCount = successors(&graph->blocks[block], next);
+        for (int j = 0; j < nextCount; j++)
+        {
+            analysis.predecessors[analysis.predecessorStart[next[j]] + filled[next[j]]++] = block;
+        }
+    }
+
+    // Immediate dominators, by Cooper, Harvey and Kennedy's iteration.
+    analysis.dominator[entry] = entry;
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (int i = 1; i < postorderCount; i++)
+        {
+            int block = analysis.order[i];
+            int dominator = -1;
+            for (int j = analysis.predecessorStart[block]; j < analysis.predecessorStart[block + 1]; j++)
+            {
+                int predecessor = analysis.predecessors[j];
+                if (analysis.dominator[predecessor] == -1)
+                    continue;
+                dominator = dominator == -1 ? predecessor : intersect(predecessor, dominator);
+            }
+            if (analysis.dominator[block] != dominator)
+            {
+                analysis.dominator[block] = dominator;
+                changed = true;
+            }
+        }
+    }
+
+    // Stack depths, which every path into a block agrees on.
+    analysis.depth[entry] = 0;
+    for (int i = 0; i < postorderCount; i++)
+    {
+        int block = analysis.order[i];
+        if (analysis.depth[block] == -1)
+            continue;
+        BasicBlock *code = &graph->blocks[block];
+        int depth = analysis.depth[block];
+        for (int j = 0; j < code->count; j++)
+        {
+            depth += irStackEffect(&code->code[j]);
+        }
+        int next[2];
+        int nextCount = successors(code, next);
+        for (int j = 0; j < nextCount; j++)
+        {
+            if (analysis.depth[next[j]] == -1)
+                analysis.depth[next[j]] = depth;
+        }
+    }
+
+    FREE_ARRAY(int, stack, count);
+    FREE_ARRAY(int, edges, count);
+    FREE_ARRAY(bool, visited, count);
+}
+
+static void freeAnalysis()
+{
+    int count = analysis.count;
+    FREE_ARRAY(int, analysis.order, count);
+    FREE_ARRAY(int, analysis.orderIndex, count);
+    FREE_ARRAY(int, analysis.dominator, count);
+    FREE_ARRAY(int, analysis.depth, count);
+    FREE_ARRAY(int, analysis.predecessors,
+               analysis.predecessorStart[count]);
+    FREE_ARRAY(int, analysis.predecessorStart, count + 1);
+}
+
+static int predecessorCount(int block)
+{
+    return analysis.predecessorStart[block + 1] - analysis.predecessorStart[block];
+}
+
+static bool dominates(int dominator, int block)
+{
+    for (;;)
+    {
+        if (block == dominator)
+            return true;
+        if (analysis.dominator[block] == block)
+            return false;
+        block = analysis.dominator[block];
+    }
+}
+
+// Stack depth after the last instruction of a reachable block.
+static int endDepth(ControlFlowGraph *graph, int block)
+{
+    BasicBlock *code = &graph->blocks[block];
+    int depth = analysis.depth[block];
+    for (int i = 0; i < code->count; i++)
+    {
+        depth += irStackEffect(&code->code[i]);
+    }
+    return depth;
+}
+
+static bool literalIsFalsey(ControlFlowGraph *graph, IrInstruction *literal, bool *falsey)
+{
+    switch (literal->op)
+    {
+    case OP_TRUE:
+        *falsey = false;
+        return true;
+    case OP_FALSE:
+    case OP_NULL:
+        *falsey = true;
+        return true;
+    case OP_CONSTANT:
+        *falsey = isFalsey(graph->chunk->constants.values[literal->operand]);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// A conditional jump on a literal always goes the same way. The literal
+// stays, for the pop on the path taken to remove with it.
+static bool foldBranches(ControlFlowGraph *graph, IrStats *stats)
+{
+    bool changed = false;
+    for (int position = 0; position < graph->layoutCount; position++)
+    {
+        BasicBlock *block = &graph->blocks[graph->layout[position]];
+        bool falsey;
+        if (block->count < 2 || block->code[block->count - 1].op != OP_JUMP_IF_FALSE ||
+            !literalIsFalsey(graph, &block->code[block->count - 2], &falsey))
+            continue;
+
+        if (falsey)
+            block->next = block->code[block->count - 1].target;
+        block->count--;
+        stats->branchesFolded++;
+        changed = true;
+    }
+    return changed;
+}
+
+static bool removeUnreachable(ControlFlowGraph *graph, IrStats *stats)
+{
+    analyze(graph);
+    bool changed = false;
+    for (int position = graph->layoutCount - 1; position >= 0; position--)
+    {
+        int block = graph->layout[position];
+        if (analysis.orderIndex[block] == -1)
+        {
+            removeBlock(graph, block);
+            stats->blocksRemoved++;
+            changed = true;
+        }
+    }
+    freeAnalysis();
+    return changed;
+}
+
+// Appends a block to the only block that leads to it. A merge moves the
+// edges out of the appended block to the block it joins without changing
+// any predecessor count, so one analysis serves every merge.
+static bool mergeBlocks(ControlFlowGraph *graph)
+{
+    analyze(graph);
+    bool changed = false;
+    for (int block = 0; block < analysis.count; block++)
+    {
+        BasicBlock *first = &graph->blocks[block];
+        if (first->removed || analysis.orderIndex[block] == -1)
+            continue;
+
+        for (;;)
+        {
+            int next = first->next;
+            if (next == -1 || next == block || next == entryBlock(graph) ||
+                branchTarget(first) != -1 || predecessorCount(next) != 1)
+                break;
+
+            BasicBlock *second = &graph->blocks[next];
+            for (int i = 0; i < second->count; i++)
+            {
+                appendInstruction(first, second->code[i]);
+            }
+            first->next = second->next;
+            removeBlock(graph, next);
+            changed = true;
+        }
+    }
+    freeAnalysis();
+    return changed;
+}
+
+// Removes stores to locals nothing reads, and values computed without
+// side effects or errors only to be popped.
+static bool eliminateDeadCode(ControlFlowGraph *graph, IrStats *stats)
+{
+    bool read[UINT8_COUNT] = {false};
+    for (int position = 0; position < graph->layoutCount; position++)
+    {
+        BasicBlock *block = &graph->blocks[graph->layout[position]];
+        for (int i = 0; i < block->count; i++)
+        {
+            uint8_t op = block->code[i].op;
+            if (op == OP_GET_LOCAL || op == OP_ADD_LOCAL_CONSTANT)
+                read[block->code[i].operand] = true;
+        }
+    }
+
+    int removed = 0;
+    for (int position = 0; position < graph->layoutCount; position++)
+    {
+        BasicBlock *block = &graph->blocks[graph->layout[position]];
+        int length = block->count;
+        Expression *stack = ALLOCATE(Expression, length);
+        bool *dead = ALLOCATE(bool, length);
+        memset(dead, 0, length * sizeof(bool));
+        int depth = 0;
+        for (int i = 0; i < length; i++)
+        {
+            IrInstruction *instruction = &block->code[i];
+            if ((instruction->op == OP_SET_LOCAL || instruction->op == OP_SET_LOCAL_POP) &&
+                !instruction->moves && !read[instruction->operand])
+            {
+                removed++;
+                if (instruction->op == OP_SET_LOCAL)
+                {
+                    dead[i] = true;
+                    continue;
+                }
+                instruction->op = OP_POP;
+            }
+
+            // Values from before the block are never removed.
+            Expression unknown = {-1, -1, false, true, false};
+            uint8_t op = instruction->op;
+            int pops, pushes;
+            stackUse(instruction, &pops, &pushes);
+            if (op == OP_CONSTANT || op == OP_NULL || op == OP_TRUE || op == OP_FALSE ||
+                op == OP_GET_LOCAL)
+            {
+                stack[depth++] = (Expression){i, i, false, false, false};
+            }
+            else if (op == OP_POP)
+            {
+                // The value has to be the last thing computed, or the range
+                // would take in whatever ran in between.
+                Expression value = depth > 0 ? stack[--depth] : unknown;
+                bool adjacent = !value.canFail;
+                for (int j = value.end + 1; j < i && adjacent; j++)
+                {
+                    adjacent = dead[j];
+                }
+                if (adjacent)
+                {
+                    for (int j = value.start; j <= i; j++)
+                    {
+                        removed += dead[j] ? 0 : 1;
+                        dead[j] = true;
+                    }
+                }
+            }
+            else if (operatorCannotFail(op))
+            {
+                bool canFail = false;
+                int start = i;
+                for (int j = 0; j < pops; j++)
+                {
+                    Expression operand = depth > 0 ? stack[--depth] : unknown;
+                    canFail = canFail || operand.canFail;
+                    start = operand.start;
+                }
+                stack[depth++] = (Expression){start, i, false, canFail, true};
+            }
+            else
+            {
+                depth = depth > pops ? depth - pops : 0;
+                for (int j = 0; j < pushes; j++)
+                {
+                    stack[depth++] = (Expression){i, i, false, true, true};
+                }
+            }
+        }
+
+        int count = 0;
+        for (int i = 0; i < length; i++)
+        {
+            if (!dead[i])
+                block->code[count++] = block->code[i];
+        }
+        block->count = count;
+        FREE_ARRAY(Expression, stack, length);
+        FREE_ARRAY(bool, dead, length);
+    }
+    stats->deadInstructions += removed;
+    return removed > 0;
+}
+
+// Finds the natural loop headed by `header`: every block that reaches a
+// back edge into it without passing through it.
+static bool findLoop(ControlFlowGraph *graph, int header, Loop *loop)
+{
+    // A back edge comes from no earlier in reverse postorder.
+    bool retreating = false;
+    for (int i = analysis.predecessorStart[header]; i < analysis.predecessorStart[header + 1]; i++)
+    {
+        retreating = retreating ||
+                     analysis.orderIndex[analysis.predecessors[i]] >= analysis.orderIndex[header];
+    }
+    if (!retreating)
+        return false;
+
+    int count = analysis.count;
+    memset(loop->blocks, 0, count * sizeof(bool));
+    int *work = ALLOCATE(int, count);
+    int top = 0;
+    bool isLoop = false;
+    loop->blocks[header] = true;
+    for (int i = analysis.predecessorStart[header]; i < analysis.predecessorStart[header + 1]; i++)
+    {
+        int source = analysis.predecessors[i];
+        if (!dominates(header, source))
+            continue;
+        isLoop = true;
+        if (!loop->blocks[source])
+        {
+            loop->blocks[source] = true;
+            work[top++] = source;
+        }
+    }
+    while (top > 0)
+    {
+        int block = work[--top];
+        for (int i = analysis.predecessorStart[block]; i < analysis.predecessorStart[block + 1]; i++)
+        {
+            int predecessor = analysis.predecessors[i];
+            if (!loop->blocks[predecessor])
+            {
+                loop->blocks[predecessor] = true;
+                work[top++] = predecessor;
+            }
+        }
+    }
+    FREE_ARRAY(int, work, count);
+    if (!isLoop)
+        return false;
+
+    loop->header = header;
+    loop->depth = analysis.depth[header];
+    memset(loop->writtenLocals, 0, sizeof(loop->writtenLocals));
+    memset(loop->writtenGlobals, 0, loop->globalCount * sizeof(bool));
+    memset(loop->definedGlobals, 0, loop->globalCount * sizeof(bool));
+    for (int block = 0; block < count; block++)
+    {
+        if (!loop->blocks[block])
+            continue;
+        BasicBlock *code = &graph->blocks[block];
+        for (int i = 0; i < code->count; i++)
+        {
+            IrInstruction *instruction = &code->code[i];
+            if (isLocalInstruction(instruction->op) && instruction->op != OP_GET_LOCAL)
+                loop->writtenLocals[instruction->operand] = true;
+            if (instruction->op == OP_SET_GLOBAL_SLOT || instruction->op == OP_DEFINE_GLOBAL_SLOT)
+                loop->writtenGlobals[instruction->operand] = true;
+        }
+    }
+    // Globals defined in a block that dominates the header are defined by
+    // the time the loop runs.
+    for (int block = header; analysis.dominator[block] != block;)
+    {
+        block = analysis.dominator[block];
+        BasicBlock *code = &graph->blocks[block];
+        for (int i = 0; i < code->count; i++)
+        {
+            if (code->code[i].op == OP_DEFINE_GLOBAL_SLOT)
+                loop->definedGlobals[code->code[i].operand] = true;
+        }
+    }
+    return true;
+}
+
+static bool cannotFail(Loop *loop, IrInstruction *instruction)
+{
+    switch (instruction->op)
+    {
+    case OP_CONSTANT:
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_POP:
+        return true;
+    case OP_GET_GLOBAL_SLOT:
+        return loop->definedGlobals[instruction->operand];
+    default:
+        return operatorCannotFail(instruction->op);
+    }
+}
+
+static Expression leaf(Loop *loop, IrInstruction *instruction, int index)
+{
+    Expression expression = {index, index, false, !cannotFail(loop, instruction), false};
+    switch (instruction->op)
+    {
+    case OP_GET_LOCAL:
+        expression.invariant = instruction->operand < loop->depth &&
+                               !loop->writtenLocals[instruction->operand];
+        break;
+    case OP_GET_GLOBAL_SLOT:
+        expression.invariant = !loop->writtenGlobals[instruction->operand];
+        break;
+    default:
+        expression.invariant = true;
+        break;
+    }
+    return expression;
+}
+
+// An invariant computation can run once before the loop if it cannot
+// fail, or if nothing that could fail or have an effect runs before it in
+// the header, since then it would have failed there on the first
+// iteration anyway.
+static bool canHoist(ControlFlowGraph *graph, Loop *loop, int block, Expression *expression)
+{
+    if (!expression->invariant || !expression->computed)
+        return false;
+    if (!expression->canFail)
+        return true;
+    if (block != loop->header)
+        return false;
+    BasicBlock *code = &graph->blocks[block];
+    for (int i = 0; i < expression->start; i++)
+    {
+        if (!cannotFail(loop, &code->code[i]))
+            return false;
+    }
+    return true;
+}
+
+// Finds the first largest invariant computation in a loop block that can
+// be hoisted.
+static bool findInvariant(ControlFlowGraph *graph, Loop *loop, int block, int *start, int *end)
+{
+    BasicBlock *code = &graph->blocks[block];
+    Expression *stack = ALLOCATE(Expression, code->count);
+    Expression unknown = {-1, -1, false, true, false};
+    Expression *found = NULL;
+    int depth = 0;
+    for (int i = 0; i < code->count && found == NULL; i++)
+    {
+        IrInstruction *instruction = &code->code[i];
+        int pops, pushes;
+        stackUse(instruction, &pops, &pushes);
+        if (pops == 0 && pushes == 1)
+        {
+            stack[depth++] = leaf(loop, instruction, i);
+            continue;
+        }
+
+        Expression operands[UINT8_COUNT];
+        for (int j = pops - 1; j >= 0; j--)
+        {
+            operands[j] = depth > 0 ? stack[--depth] : unknown;
+        }
+        Expression result = {i, i, false, true, true};
+        if (isBinaryOperator(instruction->op) || instruction->op == OP_NOT ||
+            instruction->op == OP_NEGATE)
+        {
+            result.start = operands[0].start;
+            result.invariant = true;
+            result.canFail = !operatorCannotFail(instruction->op);
+            for (int j = 0; j < pops; j++)
+            {
+                result.invariant = result.invariant && operands[j].invariant;
+                result.canFail = result.canFail || operands[j].canFail;
+            }
+        }
+        if (!canHoist(graph, loop, block, &result))
+        {
+            for (int j = 0; j < pops && found == NULL; j++)
+            {
+                if (canHoist(graph, loop, block, &operands[j]))
+                {
+                    stack[depth] = operands[j];
+                    found = &stack[depth];
+                }
+            }
+        }
+        if (found == NULL && pushes == 1)
+            stack[depth++] = result;
+    }
+    for (int j = 0; j < depth && found == NULL; j++)
+    {
+        if (canHoist(graph, loop, block, &stack[j]))
+            found = &stack[j];
+    }
+
+    if (found != NULL)
+    {
+        *start = found->start;
+        *end = found->end;
+    }
+    FREE_ARRAY(Expression, stack, code->count);
+    return found != NULL;
+}
+
+// Moves one invariant computation out of a loop. Its value lives in a new
+// stack slot at the loop's depth, pushed by a preheader in front of the
+// header; the loop's own slots above it move up by one, and every exit
+// drops the slot again.
+static bool hoistFromLoop(ControlFlowGraph *graph, Loop *loop, IrStats *stats)
+{
+    int count = analysis.count;
+    int header = loop->header;
+    int depth = loop->depth;
+    if (depth < 0 || depth >= UINT8_MAX)
+        return false;
+
+    // An exit may leave one value above the slot, such as a loop
+    // condition still to be popped; the exit then moves it down over the
+    // slot instead.
+    int *exitFrom = ALLOCATE(int, 2 * count);
+    int *exitTo = ALLOCATE(int, 2 * count);
+    bool *exitMoves = ALLOCATE(bool, 2 * count);
+    int exitCount = 0;
+    bool possible = true;
+    for (int block = 0; block < count && possible; block++)
+    {
+        if (!loop->blocks[block])
+            continue;
+        BasicBlock *code = &graph->blocks[block];
+        for (int i = 0; i < code->count; i++)
+        {
+            if (isLocalInstruction(code->code[i].op) && code->code[i].operand >= UINT8_MAX)
+                possible = false;
+        }
+
+        int next[2];
+        int nextCount = successors(code, next);
+        int extra = endDepth(graph, block) - depth;
+        for (int i = 0; i < nextCount; i++)
+        {
+            if (loop->blocks[next[i]])
+                continue;
+            if (extra != 0 && extra != 1)
+                possible = false;
+            exitFrom[exitCount] = block;
+            exitTo[exitCount] = next[i];
+            exitMoves[exitCount++] = extra == 1;
+        }
+    }
+
+    int block = header;
+    int start, end;
+    bool found = possible && findInvariant(graph, loop, header, &start, &end);
+    for (int position = 0; position < graph->layoutCount && possible && !found; position++)
+    {
+        block = graph->layout[position];
+        found = block < count && block != header && loop->blocks[block] &&
+                findInvariant(graph, loop, block, &start, &end);
+    }
+
+    if (found)
+    {
+        int preheader = addBlock(graph);
+        for (int i = start; i <= end; i++)
+        {
+            appendInstruction(&graph->blocks[preheader], graph->blocks[block].code[i]);
+        }
+        graph->blocks[preheader].next = header;
+        for (int other = 0; other < count; other++)
+        {
+            if (!graph->blocks[other].removed && !loop->blocks[other])
+                redirect(&graph->blocks[other], header, preheader);
+        }
+        insertLayout(graph, layoutPosition(graph, header), preheader);
+
+        for (int other = 0; other < count; other++)
+        {
+            if (!loop->blocks[other])
+                continue;
+            BasicBlock *code = &graph->blocks[other];
+            for (int i = 0; i < code->count; i++)
+            {
+                if (isLocalInstruction(code->code[i].op) && code->code[i].operand >= depth)
+                    code->code[i].operand++;
+            }
+        }
+
+        BasicBlock *code = &graph->blocks[block];
+        int line = code->code[end].line;
+        code->code[start] = instruction(OP_GET_LOCAL, depth, line);
+        memmove(&code->code[start + 1], &code->code[end + 1],
+                (code->count - end - 1) * sizeof(IrInstruction));
+        code->count -= end - start;
+
+        for (int i = 0; i < exitCount; i++)
+        {
+            int exit = addBlock(graph);
+            IrInstruction drop = exitMoves[i] ? instruction(OP_SET_LOCAL_POP, depth, line)
+                                              : instruction(OP_POP, 0, line);
+            drop.moves = exitMoves[i];
+            appendInstruction(&graph->blocks[exit], drop);
+            graph->blocks[exit].next = exitTo[i];
+            redirect(&graph->blocks[exitFrom[i]], exitTo[i], exit);
+            insertLayout(graph, layoutPosition(graph, exitTo[i]), exit);
+        }
+        stats->invariantsHoisted++;
+    }
+
+    FREE_ARRAY(int, exitFrom, 2 * count);
+    FREE_ARRAY(int, exitTo, 2 * count);
+    FREE_ARRAY(bool, exitMoves, 2 * count);
+    return found;
+}
+
+static bool hoistInvariant(ControlFlowGraph *graph, IrStats *stats)
+{
+    analyze(graph);
+    int count = analysis.count;
+    Loop loop;
+    loop.globalCount = 1;
+    for (int block = 0; block < count; block++)
+    {
+        BasicBlock *code = &graph->blocks[block];
+        for (int i = 0; i < code->count; i++)
+        {
+            uint8_t op = code->code[i].op;
+            if ((op == OP_GET_GLOBAL_SLOT || op == OP_SET_GLOBAL_SLOT ||
+                 op == OP_DEFINE_GLOBAL_SLOT) &&
+                code->code[i].operand >= loop.globalCount)
+                loop.globalCount = code->code[i].operand + 1;
+        }
+    }
+    loop.blocks = ALLOCATE(bool, count);
+    loop.writtenGlobals = ALLOCATE(bool, loop.globalCount);
+    loop.definedGlobals = ALLOCATE(bool, loop.globalCount);
+
+    bool hoisted = false;
+    for (int i = 0; i < analysis.orderCount && !hoisted; i++)
+    {
+        if (findLoop(graph, analysis.order[i], &loop))
+            hoisted = hoistFromLoop(graph, &loop, stats);
+    }
+
+    FREE_ARRAY(bool, loop.blocks, count);
+    FREE_ARRAY(bool, loop.writtenGlobals, loop.globalCount);
+    FREE_ARRAY(bool, loop.definedGlobals, loop.globalCount);
+    freeAnalysis();
+    return hoisted;
+}
+
+void optimizeGraph(ControlFlowGraph *graph, IrStats *stats)
+{
+    for (int hoists = 0;; hoists++)
+    {
+        bool changed = true;
+        while (changed)
+        {
+            changed = foldBranches(graph, stats);
+            changed = removeUnreachable(graph, stats) || changed;
+            changed = mergeBlocks(graph) || changed;
+            changed = eliminateDeadCode(graph, stats) || changed;
+        }
+        if (hoists == MAX_HOISTS || !hoistInvariant(graph, stats))
+            break;
+    }
+}
+
+// Adjacent local reads are lowered to one OP_GET_LOCAL_2.
+static bool fusesWithNext(BasicBlock *block, int index)
+{
+    return index + 1 < block->count && block->code[index].op == OP_GET_LOCAL &&
+           block->code[index + 1].op == OP_GET_LOCAL;
+}
+
+static int encodedLength(IrInstruction *instruction)
+{
+    switch (instruction->op)
+    {
+    case OP_CONSTANT:
+    case OP_GET_GLOBAL_SLOT:
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT:
+        return instruction->operand > UINT8_MAX ? 4 : 2;
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+    case OP_CONCAT_N:
+        return 2;
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+// Whether the block at `position` has to jump to its successor because
+// that is not laid out right after it.
+static bool needsJump(ControlFlowGraph *graph, int position)
+{
+    int next = graph->blocks[graph->layout[position]].next;
+    return next != -1 &&
+           (position + 1 == graph->layoutCount || graph->layout[position + 1] != next);
+}
+
+static bool isNumberConstant(ControlFlowGraph *graph, int index)
+{
+    return index <= UINT8_MAX && IS_NUMBER(graph->chunk->constants.values[index]);
+}
+
+// Whether the block at `position` ends the way a counted loop does: adding
+// a number to a local, and looping back to a block laid out before it while
+// the local is below a number, with the exit laid out right after it. Its
+// last four instructions and the back edge are lowered to an OP_FOR_RANGE.
+static bool closesCountedLoop(ControlFlowGraph *graph, int *positions, int position)
+{
+    BasicBlock *block = &graph->blocks[graph->layout[position]];
+    if (block->count < 4 || !needsJump(graph, position) ||
+        positions[block->next] > position || position + 1 == graph->layoutCount)
+        return false;
+
+    IrInstruction *tail = &block->code[block->count - 4];
+    return tail[0].op == OP_ADD_LOCAL_CONSTANT && isNumberConstant(graph, tail[0].operand2) &&
+           tail[1].op == OP_GET_LOCAL && tail[1].operand == tail[0].operand &&
+           tail[2].op == OP_CONSTANT && isNumberConstant(graph, tail[2].operand) &&
+           tail[3].op == OP_JUMP_IF_NOT_LESS &&
+           tail[3].target == graph->layout[position + 1];
+}
+
+static void emitOperand(Chunk *out, uint8_t op, uint8_t longOp, int operand, int line)
+{
+    if (operand > UINT8_MAX)
+    {
+        writeChunk(out, longOp, line);
+        writeChunk(out, (operand >> 16) & 0xff, line);
+        writeChunk(out, (operand >> 8) & 0xff, line);
+        writeChunk(out, operand & 0xff, line);
+    }
+    else
+    {
+        writeChunk(out, op, line);
+        writeChunk(out, (uint8_t)operand, line);
+    }
+}
+
+static void emitJump(Chunk *out, uint8_t op, int jump, int line)
+{
+    writeChunk(out, op, line);
+    writeChunk(out, (jump >> 8) & 0xff, line);
+    writeChunk(out, jump & 0xff, line);
+}
+
+bool lowerGraph(ControlFlowGraph *graph, Chunk *chunk)
+{
+    int *offsets = ALLOCATE(int, graph->count);
+    int *positions = ALLOCATE(int, graph->count);
+    bool *countedLoops = ALLOCATE(bool, graph->layoutCount);
+    for (int position = 0; position < graph->layoutCount; position++)
+        positions[graph->layout[position]] = position;
+
+    int size = 0;
+    for (int position = 0; position < graph->layoutCount; position++)
+    {
+        BasicBlock *block = &graph->blocks[graph->layout[position]];
+        offsets[graph->layout[position]] = size;
+        countedLoops[position] = closesCountedLoop(graph, positions, position);
+        int count = countedLoops[position] ? block->count - 4 : block->count;
+        for (int i = 0; i < count; i++)
+        {
+            size += fusesWithNext(block, i) ? 3 : encodedLength(&block->code[i]);
+            i += fusesWithNext(block, i) ? 1 : 0;
+        }
+        if (countedLoops[position])
+            size += 6;
+        else
+            size += needsJump(graph, position) ? 3 : 0;
+    }
+
+    // Only the 16-bit jump forms are emitted.
+    bool lowered = size <= UINT16_MAX;
+    Chunk out;
+    initChunk(&out);
+    int line = 0;
+    for (int position = 0; position < graph->layoutCount && lowered; position++)
+    {
+        BasicBlock *block = &graph->blocks[graph->layout[position]];
+        int count = countedLoops[position] ? block->count - 4 : block->count;
+        for (int i = 0; i < count && lowered; i++)
+        {
+            IrInstruction *instruction = &block->code[i];
+            line = instruction->line;
+            if (fusesWithNext(block, i))
+            {
+                writeChunk(&out, OP_GET_LOCAL_2, line);
+                writeChunk(&out, (uint8_t)instruction->operand, line);
+                writeChunk(&out, (uint8_t)block->code[++i].operand, line);
+                continue;
+            }
+
+            switch (instruction->op)
+            {
+            case OP_CONSTANT:
+                emitOperand(&out, OP_CONSTANT, OP_CONSTANT_LONG, instruction->operand, line);
+                break;
+            case OP_GET_GLOBAL_SLOT:
+                emitOperand(&out, OP_GET_GLOBAL_SLOT, OP_GET_GLOBAL_SLOT_LONG,
+                            instruction->operand, line);
+                break;
+            case OP_DEFINE_GLOBAL_SLOT:
+                emitOperand(&out, OP_DEFINE_GLOBAL_SLOT, OP_DEFINE_GLOBAL_SLOT_LONG,
+                            instruction->operand, line);
+                break;
+            case OP_SET_GLOBAL_SLOT:
+                emitOperand(&out, OP_SET_GLOBAL_SLOT, OP_SET_GLOBAL_SLOT_LONG,
+                            instruction->operand, line);
+                break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_POP:
+            case OP_CONCAT_N:
+                writeChunk(&out, instruction->op, line);
+                writeChunk(&out, (uint8_t)instruction->operand, line);
+                break;
+            case OP_ADD_LOCAL_CONSTANT:
+                writeChunk(&out, instruction->op, line);
+                writeChunk(&out, (uint8_t)instruction->operand, line);
+                writeChunk(&out, (uint8_t)instruction->operand2, line);
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_NOT_GREATER:
+            {
+                // Conditional jumps only go forward.
+                int jump = offsets[instruction->target] - (out.count + 3);
+                if (jump < 0)
+                    lowered = false;
+                else
+                    emitJump(&out, instruction->op, jump, line);
+                break;
+            }
+            default:
+                writeChunk(&out, instruction->op, line);
+                break;
+            }
+        }
+        if (lowered && countedLoops[position])
+        {
+            IrInstruction *tail = &block->code[block->count - 4];
+            line = tail[3].line;
+            int jump = out.count + 6 - offsets[block->next];
+            emitJump(&out, OP_FOR_RANGE, jump, line);
+            writeChunk(&out, (uint8_t)tail[0].operand, line);
+            writeChunk(&out, (uint8_t)tail[0].operand2, line);
+            writeChunk(&out, (uint8_t)tail[2].operand, line);
+        }
+        else if (lowered && needsJump(graph, position))
+        {
+            int from = out.count + 3;
+            int to = offsets[block->next];
+            if (to >= from)
+                emitJump(&out, OP_JUMP, to - from, line);
+            else
+                emitJump(&out, OP_LOOP, from - to, line);
+        }
+    }
+
+    if (lowered)
+    {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+        chunk->code = out.code;
+        chunk->lines = out.lines;
+        chunk->count = out.count;
+        chunk->capacity = out.capacity;
+    }
+    else
+    {
+        freeChunk(&out);
+    }
+    FREE_ARRAY(int, offsets, graph->count);
+    FREE_ARRAY(int, positions, graph->count);
+    FREE_ARRAY(bool, countedLoops, graph->layoutCount);
+    return lowered;
+}
+
+bool optimizeChunk(Chunk *chunk, IrStats *stats)
+{
+    // Lowering only emits short jumps.
+    if (chunk->count > UINT16_MAX)
+        return false;
+
+    // Blocks have at most two successors, so the graph cannot express the
+    // jump table of a match statement; such chunks keep their -O1 form.
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        if (isMatchInstruction(chunk->code[offset]))
+            return false;
+    }
+
+    ControlFlowGraph graph;
+    IrStats graphStats = {0, 0, 0, 0};
+    buildGraph(&graph, chunk);
+    optimizeGraph(&graph, &graphStats);
+    bool lowered = lowerGraph(&graph, chunk);
+    freeGraph(&graph);
+    if (lowered)
+    {
+        stats->branchesFolded += graphStats.branchesFolded;
+        stats->blocksRemoved += graphStats.blocksRemoved;
+        stats->deadInstructions += graphStats.deadInstructions;
+        stats->invariantsHoisted += graphStats.invariantsHoisted;
+    }
+    return lowered;
+}
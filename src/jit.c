@@ -0,0 +1,977 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "kavya/jit.h"
+#include "kavya/memory.h"
+#include "kavya/vm.h"
+
+bool jitEnabled = true;
+
+#ifdef KAVYA_JIT
+
+#include <sys/mman.h>
+
+// Native code is a template per instruction working on the VM stack in
+// memory, so the interpreter can take over at any instruction boundary.
+// Pinned registers:
+//   rbx  stack top (vm.stackTop)      r12  vm.stack (local slots)
+//   r13  global values                r14  INT_VAL(0), the integer tag
+//   r15  FALSE_VAL; NULL_VAL and UNDEFINED_VAL are r15 - 1 and r15 + 2
+// Each instruction checks its operand types before touching any state.
+// When a check fails, or the opcode has no template, the code returns the
+// instruction's offset and the interpreter runs it instead.
+
+typedef int (*NativeEntry)(void *target, Value *slots, Value *globals);
+
+struct JitCode
+{
+    uint8_t *memory;
+    size_t size;
+    // Native offset of each instruction, -1 inside an instruction.
+    int *entries;
+    int count;
+};
+
+typedef enum
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+} Register;
+
+typedef enum
+{
+    XMM0,
+    XMM1
+} XmmRegister;
+
+typedef enum
+{
+    CC_O = 0x0,
+    CC_B = 0x2,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_NP = 0xb,
+    CC_L = 0xc,
+    CC_GE = 0xd,
+    CC_LE = 0xe,
+    CC_G = 0xf,
+} Condition;
+
+// A rel32 field waiting for its destination: a bytecode offset for jumps,
+// or the offset of the instruction to hand back to the interpreter.
+typedef struct
+{
+    int position;
+    int offset;
+} Fixup;
+
+typedef struct
+{
+    uint8_t *code;
+    int count;
+    int capacity;
+    Fixup *jumps;
+    int jumpCount;
+    int jumpCapacity;
+    Fixup *exits;
+    int exitCount;
+    int exitCapacity;
+    // Offset of the instruction being compiled.
+    int offset;
+} Assembler;
+
+static Assembler as;
+
+static void emit(uint8_t byte)
+{
+    if (as.capacity < as.count + 1)
+    {
+        int oldCapacity = as.capacity;
+        as.capacity = GROW_CAPACITY(oldCapacity);
+        as.code = GROW_ARRAY(uint8_t, as.code, oldCapacity, as.capacity);
+    }
+    as.code[as.count++] = byte;
+}
+
+static void emit32(uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        emit((value >> (8 * i)) & 0xff);
+}
+
+static void emit64(uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        emit((value >> (8 * i)) & 0xff);
+}
+
+static void patch32(int position, int target)
+{
+    uint32_t relative = (uint32_t)(target - (position + 4));
+    for (int i = 0; i < 4; i++)
+        as.code[position + i] = (relative >> (8 * i)) & 0xff;
+}
+
+static void addFixup(Fixup **fixups, int *count, int *capacity, int offset)
+{
+    if (*capacity < *count + 1)
+    {
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *fixups = GROW_ARRAY(Fixup, *fixups, oldCapacity, *capacity);
+    }
+    (*fixups)[(*count)++] = (Fixup){as.count, offset};
+    emit32(0);
+}
+
+static void rex(bool wide, int reg, int base)
+{
+    uint8_t prefix = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+    if (prefix != 0x40)
+        emit(prefix);
+}
+
+static void modrm(int mod, int reg, int rm)
+{
+    emit((uint8_t)((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// [base + displacement], always with a 32-bit displacement.
+static void memoryOperand(int reg, Register base, int32_t displacement)
+{
+    modrm(2, reg, base);
+    if ((base & 7) == RSP)
+        emit(0x24);
+    emit32((uint32_t)displacement);
+}
+
+static void movLoad(Register dst, Register base, int32_t displacement)
+{
+    rex(true, dst, base);
+    emit(0x8b);
+    memoryOperand(dst, base, displacement);
+}
+
+static void movStore(Register base, int32_t displacement, Register src)
+{
+    rex(true, src, base);
+    emit(0x89);
+    memoryOperand(src, base, displacement);
+}
+
+static void movImmediate(Register dst, uint64_t value)
+{
+    rex(true, 0, dst);
+    emit(0xb8 + (dst & 7));
+    emit64(value);
+}
+
+// Two-register ALU form `op dst, src` for add (0x01), or (0x09),
+// and (0x21), sub (0x29), xor (0x31), cmp (0x39), test (0x85) and
+// mov (0x89).
+static void alu(uint8_t op, Register dst, Register src)
+{
+    rex(true, src, dst);
+    emit(op);
+    modrm(3, src, dst);
+}
+
+#define MOV(dst, src) alu(0x89, dst, src)
+#define ADD(dst, src) alu(0x01, dst, src)
+#define OR(dst, src) alu(0x09, dst, src)
+#define AND(dst, src) alu(0x21, dst, src)
+#define SUB(dst, src) alu(0x29, dst, src)
+#define CMP(dst, src) alu(0x39, dst, src)
+#define TEST(dst, src) alu(0x85, dst, src)
+
+static void shift(int extension, Register reg, uint8_t amount)
+{
+    rex(true, 0, reg);
+    emit(0xc1);
+    modrm(3, extension, reg);
+    emit(amount);
+}
+
+#define SHL(reg, amount) shift(4, reg, amount)
+#define SHR(reg, amount) shift(5, reg, amount)
+#define SAR(reg, amount) shift(7, reg, amount)
+
+// 32-bit `op reg, imm32` for and (extension 4) and cmp (extension 7).
+static void alu32Immediate(int extension, Register reg, uint32_t value)
+{
+    rex(false, 0, reg);
+    emit(0x81);
+    modrm(3, extension, reg);
+    emit32(value);
+}
+
+static void imul(Register dst, Register src)
+{
+    rex(true, dst, src);
+    emit(0x0f);
+    emit(0xaf);
+    modrm(3, dst, src);
+}
+
+static void lea(Register dst, Register base, int32_t displacement)
+{
+    rex(true, dst, base);
+    emit(0x8d);
+    memoryOperand(dst, base, displacement);
+}
+
+// Moves the stack top without touching the flags.
+static void adjustStack(int values)
+{
+    lea(RBX, RBX, values * (int)sizeof(Value));
+}
+
+static void setcc(Condition condition, Register reg)
+{
+    emit(0x0f);
+    emit(0x90 + condition);
+    modrm(3, 0, reg);
+}
+
+static void sse(uint8_t prefix, uint8_t op, int reg, int rm, bool wide)
+{
+    emit(prefix);
+    rex(wide, reg, rm);
+    emit(0x0f);
+    emit(op);
+    modrm(3, reg, rm);
+}
+
+#define CVTSI2SD(xmm, reg) sse(0xf2, 0x2a, xmm, reg, true)
+#define MOVQ_TO_XMM(xmm, reg) sse(0x66, 0x6e, xmm, reg, true)
+#define MOVQ_FROM_XMM(reg, xmm) sse(0x66, 0x7e, xmm, reg, true)
+#define UCOMISD(a, b) sse(0x66, 0x2e, a, b, false)
+
+// Emits jmp rel32, or jcc rel32 for a non-negative condition, without
+// the displacement.
+static void jumpOpcode(int condition)
+{
+    if (condition < 0)
+    {
+        emit(0xe9);
+    }
+    else
+    {
+        emit(0x0f);
+        emit(0x80 + condition);
+    }
+}
+
+// Jumps to a label placed later with `here()`.
+static int jumpForward(int condition)
+{
+    jumpOpcode(condition);
+    emit32(0);
+    return as.count - 4;
+}
+
+static void here(int position)
+{
+    patch32(position, as.count);
+}
+
+// Leaves native code for the instruction at `offset` when `condition`
+// holds, or unconditionally when it is negative.
+static void exitTo(int condition, int offset)
+{
+    jumpOpcode(condition);
+    addFixup(&as.exits, &as.exitCount, &as.exitCapacity, offset);
+}
+
+// Leaves native code at the current instruction.
+static void exitIf(int condition)
+{
+    exitTo(condition, as.offset);
+}
+
+static void jumpTo(int condition, int target)
+{
+    jumpOpcode(condition);
+    addFixup(&as.jumps, &as.jumpCount, &as.jumpCapacity, target);
+}
+
+static void pushRegister(Register reg)
+{
+    rex(false, 0, reg);
+    emit(0x50 + (reg & 7));
+}
+
+static void popRegister(Register reg)
+{
+    rex(false, 0, reg);
+    emit(0x58 + (reg & 7));
+}
+
+// Sets the flags so CC_E means `reg` holds an integer. Clobbers scratch.
+static void testInt(Register reg, Register scratch)
+{
+    MOV(scratch, reg);
+    SHR(scratch, 49);
+    alu32Immediate(7, scratch, 0x3fff);
+}
+
+// Only integers have both the INT bit and the quiet NaN bits set, so the
+// bitwise and of two values passes testInt() exactly when both are ints.
+static void testBothInt(Register a, Register b)
+{
+    MOV(RDX, a);
+    AND(RDX, b);
+    SHR(RDX, 49);
+    alu32Immediate(7, RDX, 0x3fff);
+}
+
+static void unboxInt(Register dst, Register src)
+{
+    MOV(dst, src);
+    SHL(dst, 16);
+    SAR(dst, 16);
+}
+
+// Boxes the integer in `reg` into RAX, or jumps to the returned label when
+// it does not fit in the 48-bit payload. RAX is only written on success.
+static int boxInt(Register reg)
+{
+    MOV(RDI, reg);
+    SHL(RDI, 16);
+    SAR(RDI, 16);
+    CMP(RDI, reg);
+    int overflow = jumpForward(CC_NE);
+    SHL(RDI, 16);
+    SHR(RDI, 16);
+    OR(RDI, R14);
+    MOV(RAX, RDI);
+    return overflow;
+}
+
+// Loads the number in `reg` into `xmm` as a double. For anything else it
+// jumps to the returned label, or leaves native code if `exitIfNotNumber`.
+static int toDouble(Register reg, XmmRegister xmm, bool exitIfNotNumber)
+{
+    testInt(reg, RDX);
+    int notInt = jumpForward(CC_NE);
+    unboxInt(RDX, reg);
+    CVTSI2SD(xmm, RDX);
+    int done = jumpForward(-1);
+
+    here(notInt);
+    MOV(RDX, reg);
+    SHR(RDX, 50);
+    alu32Immediate(4, RDX, 0x1fff);
+    alu32Immediate(7, RDX, 0x1fff);
+    int notNumber = -1;
+    if (exitIfNotNumber)
+        exitIf(CC_E);
+    else
+        notNumber = jumpForward(CC_E);
+    MOVQ_TO_XMM(xmm, reg);
+    here(done);
+    return notNumber;
+}
+
+// Turns the 0 or 1 in AL into FALSE_VAL or TRUE_VAL.
+static void boxBool()
+{
+    emit(0x0f);
+    emit(0xb6);
+    modrm(3, RAX, RAX); // movzx eax, al
+    OR(RAX, R15);
+}
+
+static void storeResult()
+{
+    movStore(RBX, -2 * (int)sizeof(Value), RAX);
+    adjustStack(-1);
+}
+
+// RAX = RAX op RCX for +, - and *, following numberAdd() and friends:
+// integers stay integers unless the result overflows the payload or is a
+// product that has to be -0.
+static void arithmetic(uint8_t op)
+{
+    testBothInt(RAX, RCX);
+    int mixed = jumpForward(CC_NE);
+    unboxInt(RDX, RAX);
+    unboxInt(RSI, RCX);
+    int overflow = -1;
+    int negativeZero = -1;
+    if (op == OP_MULTIPLY)
+    {
+        // The sign bit of RDI is set when either factor is negative.
+        MOV(RDI, RDX);
+        OR(RDI, RSI);
+        imul(RDX, RSI);
+        overflow = jumpForward(CC_O);
+        TEST(RDX, RDX);
+        int nonzero = jumpForward(CC_NE);
+        TEST(RDI, RDI);
+        negativeZero = jumpForward(CC_L);
+        here(nonzero);
+    }
+    else
+    {
+        alu(op == OP_ADD ? 0x01 : 0x29, RDX, RSI);
+    }
+    int tooWide = boxInt(RDX);
+    int done = jumpForward(-1);
+
+    here(mixed);
+    here(tooWide);
+    if (overflow != -1)
+    {
+        here(overflow);
+        here(negativeZero);
+    }
+    toDouble(RAX, XMM0, true);
+    toDouble(RCX, XMM1, true);
+    uint8_t sseOp = op == OP_ADD ? 0x58 : op == OP_SUBTRACT ? 0x5c : 0x59;
+    sse(0xf2, sseOp, XMM0, XMM1, false);
+    MOVQ_FROM_XMM(RAX, XMM0);
+    here(done);
+}
+
+// Compares RAX with RCX as numbers and leaves the result in the flags.
+// Integer pairs compare as signed integers and jump to `*intDone`; other
+// numbers fall through after a `ucomisd` where CC_A means the comparison
+// holds, with the operands swapped for <.
+static void compareNumbers(bool less, int *intDone)
+{
+    testBothInt(RAX, RCX);
+    int mixed = jumpForward(CC_NE);
+    unboxInt(RDX, RAX);
+    unboxInt(RSI, RCX);
+    CMP(RDX, RSI);
+    *intDone = jumpForward(-1);
+
+    here(mixed);
+    toDouble(RAX, XMM0, true);
+    toDouble(RCX, XMM1, true);
+    if (less)
+        UCOMISD(XMM1, XMM0);
+    else
+        UCOMISD(XMM0, XMM1);
+}
+
+static void loadOperands()
+{
+    movLoad(RAX, RBX, -2 * (int)sizeof(Value));
+    movLoad(RCX, RBX, -1 * (int)sizeof(Value));
+}
+
+// Flipping the low bit of a condition code gives its negation.
+static Condition negation(Condition condition)
+{
+    return (Condition)(condition ^ 1);
+}
+
+// With `negate` set the result is the negated comparison, which is true
+// for NaN operands like OP_NOT after the plain one would be.
+static void comparison(bool less, bool negate)
+{
+    loadOperands();
+    int intDone;
+    compareNumbers(less, &intDone);
+    setcc(negate ? negation(CC_A) : CC_A, RAX);
+    int done = jumpForward(-1);
+    here(intDone);
+    Condition intCondition = less ? CC_L : CC_G;
+    setcc(negate ? negation(intCondition) : intCondition, RAX);
+    here(done);
+    boxBool();
+    storeResult();
+}
+
+// Pops both operands and jumps to `target` unless the comparison holds.
+static void compareAndBranch(bool less, int target)
+{
+    loadOperands();
+    int intDone;
+    compareNumbers(less, &intDone);
+    adjustStack(-2);
+    jumpTo(CC_BE, target);
+    int done = jumpForward(-1);
+    here(intDone);
+    adjustStack(-2);
+    jumpTo(less ? CC_GE : CC_LE, target);
+    here(done);
+}
+
+// Takes a back edge to `target`, charging fuel like the interpreter. Once
+// vm.fuelCheck runs out, native code leaves at `target` with the fuel
+// already charged, and the interpreter checks the limits.
+static void backEdge(int cost, int target)
+{
+    movImmediate(RAX, (uint64_t)(uintptr_t)&vm.fuelCheck);
+    rex(true, 0, RAX);
+    emit(0x81);
+    memoryOperand(5, RAX, 0); // sub qword [rax], cost
+    emit32((uint32_t)cost);
+    exitTo(CC_L, target);
+    jumpTo(-1, target);
+}
+
+// Follows valuesEqual(): numbers compare numerically, everything else by
+// identity, which for interned strings is string equality.
+static void equality(bool negate)
+{
+    loadOperands();
+    testBothInt(RAX, RCX);
+    int identity = jumpForward(CC_E);
+    int notNumber = toDouble(RAX, XMM0, false);
+    int notNumber2 = toDouble(RCX, XMM1, false);
+    UCOMISD(XMM0, XMM1);
+    setcc(CC_E, RAX);
+    setcc(CC_NP, RDX);
+    emit(0x20);
+    modrm(3, RDX, RAX); // and al, dl
+    int done = jumpForward(-1);
+
+    here(identity);
+    here(notNumber);
+    here(notNumber2);
+    CMP(RAX, RCX);
+    setcc(CC_E, RAX);
+    here(done);
+    if (negate)
+    {
+        emit(0x34);
+        emit(0x01); // xor al, 1
+    }
+    boxBool();
+    storeResult();
+}
+
+#define FALSEY_CHECKS 4
+
+// Branches when RAX is falsey: null, false or a zero number. Each check
+// jumps to bytecode offset `target`, or forward with its position stored
+// in `forward` when that is not NULL.
+static void branchIfFalsey(int target, int *forward)
+{
+    for (int check = 0; check < FALSEY_CHECKS; check++)
+    {
+        switch (check)
+        {
+        case 0:
+            CMP(RAX, R15);
+            break;
+        case 1:
+            lea(RDX, R15, -1);
+            CMP(RAX, RDX);
+            break;
+        case 2:
+            CMP(RAX, R14);
+            break;
+        case 3:
+            // 0.0 and -0.0 are the only values with no bits besides the sign.
+            MOV(RDX, RAX);
+            ADD(RDX, RDX);
+            break;
+        }
+        if (forward != NULL)
+            forward[check] = jumpForward(CC_E);
+        else
+            jumpTo(CC_E, target);
+    }
+}
+
+static void pushValue(Register reg)
+{
+    movStore(RBX, 0, reg);
+    adjustStack(1);
+}
+
+static void checkDefined()
+{
+    lea(RDX, R15, 2);
+    CMP(RAX, RDX);
+    exitIf(CC_E);
+}
+
+static void writeValue(Value value)
+{
+    printValue(value);
+    printf("\n");
+}
+
+static void callWrite()
+{
+    movLoad(RDI, RBX, -1 * (int)sizeof(Value));
+    adjustStack(-1);
+    movImmediate(RAX, (uint64_t)(uintptr_t)writeValue);
+    emit(0xff);
+    modrm(3, 2, RAX); // call rax
+}
+
+static int readLong(uint8_t *operand)
+{
+    return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+static void compileInstruction(Chunk *chunk, int offset)
+{
+    uint8_t *code = &chunk->code[offset];
+    Value *constants = chunk->constants.values;
+#define SLOT(operand) (code[operand] * (int)sizeof(Value))
+
+    switch (code[0])
+    {
+    case OP_CONSTANT:
+        movImmediate(RAX, constants[code[1]]);
+        pushValue(RAX);
+        break;
+    case OP_CONSTANT_LONG:
+        movImmediate(RAX, constants[readLong(&code[1])]);
+        pushValue(RAX);
+        break;
+    case OP_NULL:
+        lea(RAX, R15, -1);
+        pushValue(RAX);
+        break;
+    case OP_TRUE:
+        lea(RAX, R15, 1);
+        pushValue(RAX);
+        break;
+    case OP_FALSE:
+        pushValue(R15);
+        break;
+    case OP_POP:
+        adjustStack(-1);
+        break;
+    case OP_GET_LOCAL:
+        movLoad(RAX, R12, SLOT(1));
+        pushValue(RAX);
+        break;
+    case OP_GET_LOCAL_2:
+        // The second slot may be the one the first read pushes to.
+        movLoad(RAX, R12, SLOT(1));
+        movStore(RBX, 0, RAX);
+        movLoad(RCX, R12, SLOT(2));
+        movStore(RBX, sizeof(Value), RCX);
+        adjustStack(2);
+        break;
+    case OP_SET_LOCAL:
+        movLoad(RAX, RBX, -1 * (int)sizeof(Value));
+        movStore(R12, SLOT(1), RAX);
+        break;
+    case OP_SET_LOCAL_POP:
+        movLoad(RAX, RBX, -1 * (int)sizeof(Value));
+        movStore(R12, SLOT(1), RAX);
+        adjustStack(-1);
+        break;
+    case OP_GET_GLOBAL_SLOT:
+    case OP_GET_GLOBAL_SLOT_LONG:
+    {
+        int global = code[0] == OP_GET_GLOBAL_SLOT ? code[1] : readLong(&code[1]);
+        movLoad(RAX, R13, global * (int)sizeof(Value));
+        checkDefined();
+        pushValue(RAX);
+        break;
+    }
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_DEFINE_GLOBAL_SLOT_LONG:
+    {
+        int global = code[0] == OP_DEFINE_GLOBAL_SLOT ? code[1] : readLong(&code[1]);
+        movLoad(RAX, RBX, -1 * (int)sizeof(Value));
+        movStore(R13, global * (int)sizeof(Value), RAX);
+        adjustStack(-1);
+        break;
+    }
+    case OP_SET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT_LONG:
+    {
+        int global = code[0] == OP_SET_GLOBAL_SLOT ? code[1] : readLong(&code[1]);
+        movLoad(RAX, R13, global * (int)sizeof(Value));
+        checkDefined();
+        movLoad(RAX, RBX, -1 * (int)sizeof(Value));
+        movStore(R13, global * (int)sizeof(Value), RAX);
+        break;
+    }
+    case OP_EQUAL:
+    case OP_EQUAL_NUM:
+    case OP_IS:
+        equality(false);
+        break;
+    case OP_NOT_EQUAL:
+        equality(true);
+        break;
+    case OP_LESS:
+    case OP_LESS_NN:
+        comparison(true, false);
+        break;
+    case OP_GREATER:
+    case OP_GREATER_NN:
+        comparison(false, false);
+        break;
+    case OP_GREATER_EQUAL:
+    case OP_GREATER_EQUAL_NN:
+        comparison(true, true);
+        break;
+    case OP_LESS_EQUAL:
+    case OP_LESS_EQUAL_NN:
+        comparison(false, true);
+        break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_ADD_NN:
+        loadOperands();
+        arithmetic(OP_ADD);
+        storeResult();
+        break;
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+        loadOperands();
+        arithmetic(code[0]);
+        storeResult();
+        break;
+    case OP_SUBTRACT_NN:
+        loadOperands();
+        arithmetic(OP_SUBTRACT);
+        storeResult();
+        break;
+    case OP_MULTIPLY_NN:
+        loadOperands();
+        arithmetic(OP_MULTIPLY);
+        storeResult();
+        break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NN:
+        loadOperands();
+        toDouble(RAX, XMM0, true);
+        toDouble(RCX, XMM1, true);
+        sse(0xf2, 0x5e, XMM0, XMM1, false);
+        MOVQ_FROM_XMM(RAX, XMM0);
+        storeResult();
+        break;
+    case OP_ADD_LOCAL_CONSTANT:
+        movLoad(RAX, R12, SLOT(1));
+        movImmediate(RCX, constants[code[2]]);
+        arithmetic(OP_ADD);
+        movStore(R12, SLOT(1), RAX);
+        break;
+    case OP_NOT:
+    {
+        movLoad(RAX, RBX, -1 * (int)sizeof(Value));
+        int falsey[FALSEY_CHECKS];
+        branchIfFalsey(0, falsey);
+        movStore(RBX, -1 * (int)sizeof(Value), R15);
+        int done = jumpForward(-1);
+        for (int i = 0; i < FALSEY_CHECKS; i++)
+            here(falsey[i]);
+        lea(RAX, R15, 1);
+        movStore(RBX, -1 * (int)sizeof(Value), RAX);
+        here(done);
+        break;
+    }
+    case OP_NEGATE:
+    {
+        movLoad(RAX, RBX, -1 * (int)sizeof(Value));
+        testInt(RAX, RDX);
+        int notInt = jumpForward(CC_NE);
+        unboxInt(RCX, RAX);
+        TEST(RCX, RCX);
+        int zero = jumpForward(CC_E);
+        rex(true, 0, RCX);
+        emit(0xf7);
+        modrm(3, 3, RCX); // neg rcx
+        int tooWide = boxInt(RCX);
+        int done = jumpForward(-1);
+
+        here(notInt);
+        here(zero);
+        here(tooWide);
+        movLoad(RAX, RBX, -1 * (int)sizeof(Value));
+        toDouble(RAX, XMM0, true);
+        MOVQ_FROM_XMM(RAX, XMM0);
+        rex(true, 0, RAX);
+        emit(0x0f);
+        emit(0xba);
+        modrm(3, 7, RAX); // btc rax, 63
+        emit(63);
+        here(done);
+        movStore(RBX, -1 * (int)sizeof(Value), RAX);
+        break;
+    }
+    case OP_WRITE:
+        callWrite();
+        break;
+    case OP_JUMP:
+    case OP_JUMP_LONG:
+        jumpTo(-1, jumpTarget(chunk, offset));
+        break;
+    case OP_LOOP:
+    case OP_LOOP_LONG:
+    {
+        int target = jumpTarget(chunk, offset);
+        backEdge(offset + instructionLength(chunk, offset) - target, target);
+        break;
+    }
+    case OP_FOR_RANGE:
+    {
+        // Once the increment has stored a number, comparing it with the
+        // constant cannot fail. Like the interpreter, only a loop that
+        // continues is charged fuel.
+        int target = jumpTarget(chunk, offset);
+        movLoad(RAX, R12, SLOT(3));
+        movImmediate(RCX, constants[code[4]]);
+        arithmetic(OP_ADD);
+        movStore(R12, SLOT(3), RAX);
+        movImmediate(RCX, constants[code[5]]);
+        int intDone;
+        compareNumbers(true, &intDone);
+        int doubleLoop = jumpForward(CC_A);
+        int doubleExit = jumpForward(-1);
+        here(intDone);
+        int intExit = jumpForward(CC_GE);
+        here(doubleLoop);
+        backEdge(offset + instructionLength(chunk, offset) - target, target);
+        here(doubleExit);
+        here(intExit);
+        break;
+    }
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+        movLoad(RAX, RBX, -1 * (int)sizeof(Value));
+        branchIfFalsey(jumpTarget(chunk, offset), NULL);
+        break;
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_NN:
+        compareAndBranch(true, jumpTarget(chunk, offset));
+        break;
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_NN:
+        compareAndBranch(false, jumpTarget(chunk, offset));
+        break;
+    default:
+        // OP_RETURN, OP_ASK and anything else run in the interpreter.
+        exitIf(-1);
+        break;
+    }
+#undef SLOT
+}
+
+static void freeAssembler()
+{
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+    FREE_ARRAY(Fixup, as.jumps, as.jumpCapacity);
+    FREE_ARRAY(Fixup, as.exits, as.exitCapacity);
+}
+
+// Compiles the whole chunk and attaches the result to it. Returns false,
+// leaving the chunk to the interpreter, if executable memory is not
+// available.
+bool jitCompile(Chunk *chunk)
+{
+    as = (Assembler){0};
+    int *entries = ALLOCATE(int, chunk->count);
+    for (int offset = 0; offset < chunk->count; offset++)
+        entries[offset] = -1;
+
+    // Prologue: save the callee-saved registers, which also leaves the
+    // stack aligned for calls, load the pinned ones and jump to the entry.
+    Register saved[] = {RBX, R12, R13, R14, R15};
+    for (int i = 0; i < 5; i++)
+        pushRegister(saved[i]);
+    movImmediate(RAX, (uint64_t)(uintptr_t)&vm.stackTop);
+    movLoad(RBX, RAX, 0);
+    MOV(R12, RSI);
+    MOV(R13, RDX);
+    movImmediate(R14, INT_VAL(0));
+    movImmediate(R15, FALSE_VAL);
+    emit(0xff);
+    modrm(3, 4, RDI); // jmp rdi
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        as.offset = offset;
+        entries[offset] = as.count;
+        compileInstruction(chunk, offset);
+    }
+
+    // Shared exit: store the stack top and return the offset in eax.
+    int exitCode = as.count;
+    movImmediate(RDX, (uint64_t)(uintptr_t)&vm.stackTop);
+    movStore(RDX, 0, RBX);
+    for (int i = 4; i >= 0; i--)
+        popRegister(saved[i]);
+    emit(0xc3);
+
+    // One stub per instruction native code can leave for.
+    int stub = -1;
+    for (int i = 0; i < as.exitCount; i++)
+    {
+        Fixup *fixup = &as.exits[i];
+        if (i == 0 || fixup->offset != as.exits[i - 1].offset)
+        {
+            stub = as.count;
+            emit(0xb8); // mov eax, imm32
+            emit32((uint32_t)fixup->offset);
+            emit(0xe9);
+            emit32(0);
+            patch32(as.count - 4, exitCode);
+        }
+        patch32(fixup->position, stub);
+    }
+    for (int i = 0; i < as.jumpCount; i++)
+    {
+        patch32(as.jumps[i].position, entries[as.jumps[i].offset]);
+    }
+
+    size_t size = (size_t)as.count;
+    uint8_t *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        freeAssembler();
+        FREE_ARRAY(int, entries, chunk->count);
+        return false;
+    }
+    memcpy(memory, as.code, size);
+    freeAssembler();
+    // Hardened systems may refuse to make the code executable.
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, size);
+        FREE_ARRAY(int, entries, chunk->count);
+        return false;
+    }
+
+    JitCode *jit = ALLOCATE(JitCode, 1);
+    jit->memory = memory;
+    jit->size = size;
+    jit->entries = entries;
+    jit->count = chunk->count;
+    chunk->jitCode = jit;
+    return true;
+}
+
+// Runs the chunk's native code from the instruction at `offset` and
+// returns the offset of the instruction the interpreter continues with.
+int jitRun(Chunk *chunk, int offset)
+{
+    JitCode *jit = chunk->jitCode;
+    NativeEntry entry = (NativeEntry)(uintptr_t)jit->memory;
+    return entry(jit->memory + jit->entries[offset], vm.stack,
+                 vm.globalValues.values);
+}
+
+void jitFree(Chunk *chunk)
+{
+    JitCode *jit = chunk->jitCode;
+    if (jit == NULL)
+        return;
+    munmap(jit->memory, jit->size);
+    FREE_ARRAY(int, jit->entries, jit->count);
+    FREE(JitCode, jit);
+    chunk->jitCode = NULL;
+}
+
+#endif
\ No newline at end of file
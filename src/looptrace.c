@@ -0,0 +1,846 @@
+#include <stdio.h>
+
+#include "kavya/looptrace.h"
+#include "kavya/memory.h"
+#include "kavya/vm.h"
+
+bool loopTracesEnabled = true;
+
+#ifdef KAVYA_LOOP_TRACES
+
+// A loop trace is one recorded iteration of a hot loop, flattened into
+// straight-line three-address instructions. The stack depth is fixed at
+// every point of a trace, so operands are plain pointers to stack slots,
+// globals and constants, and pushing a local or a constant emits nothing.
+// Each instruction is specialized to the operand types seen while
+// recording and checks them before touching any state. When a check fails,
+// or a branch goes the other way than it did while recording, the trace
+// returns a bytecode offset and stack depth for the interpreter to resume
+// from, after which the stack holds exactly what the interpreter expects.
+// A guard that keeps failing gets a side trace recorded from its exit back
+// to the loop header, so branchy loops stay in the trace.
+
+// Failures of a guard before a side trace is recorded for it.
+#define SIDE_TRACE_THRESHOLD 10
+
+// Longest iteration that is recorded, in bytecode instructions. Inner
+// loops are followed, so this also bounds how far they are unrolled.
+#define MAX_RECORDED_INSTRUCTIONS 1000
+
+typedef enum
+{
+    TRACE_MOVE,
+    TRACE_ADD_INT,
+    TRACE_SUBTRACT_INT,
+    TRACE_MULTIPLY_INT,
+    TRACE_ADD_DOUBLE,
+    TRACE_SUBTRACT_DOUBLE,
+    TRACE_MULTIPLY_DOUBLE,
+    TRACE_ADD_NUMBER,
+    TRACE_SUBTRACT_NUMBER,
+    TRACE_MULTIPLY_NUMBER,
+    TRACE_DIVIDE,
+    TRACE_NEGATE,
+    TRACE_LESS_INT,
+    TRACE_LESS_NUMBER,
+    TRACE_GREATER_INT,
+    TRACE_GREATER_NUMBER,
+    TRACE_EQUAL_INT,
+    TRACE_EQUAL,
+    TRACE_NOT,
+    TRACE_WRITE,
+    // Guards for the direction a branch took while recording.
+    TRACE_GUARD_TRUTHY,
+    TRACE_GUARD_FALSEY,
+    TRACE_GUARD_LESS_INT,
+    TRACE_GUARD_LESS_NUMBER,
+    TRACE_GUARD_GREATER_INT,
+    TRACE_GUARD_GREATER_NUMBER,
+    // A back edge, charging fuel like the interpreter. It is a guard that
+    // always fails over to its side: the start of the main trace for the
+    // back edge to the loop header, which ends the main trace and every
+    // side trace, or the next instruction for a loop nested inside.
+    TRACE_LOOP,
+} TraceOp;
+
+typedef struct
+{
+    TraceOp op;
+    // Comparison result the TRACE_GUARD_LESS/GREATER forms expect.
+    bool expect;
+    uint8_t exits;
+    // Where the interpreter resumes when the instruction's guard fails.
+    int exit;
+    int depth;
+    // Index of the side trace run when the guard fails, or -1.
+    int side;
+    // Fuel TRACE_LOOP charges: the size of the loop body it jumps over.
+    int cost;
+    Value *dst;
+    Value *a;
+    Value *b;
+} TraceInstruction;
+
+typedef struct
+{
+    // The main trace followed by its side traces.
+    TraceInstruction *code;
+    int count;
+    int capacity;
+    int header;
+} LoopTrace;
+
+struct LoopTraces
+{
+    // Back edges seen per loop header, kept at LOOP_TRACE_THRESHOLD once
+    // the loop has been recorded or found untraceable.
+    uint8_t *heat;
+    LoopTrace **traces;
+    int count;
+};
+
+// A value on the stack while recording. Values pushed from a local, a
+// global or a constant are only pointed at until something needs them in
+// their stack slot.
+typedef struct
+{
+    Value *value;
+    // Offset of the instruction that pushed a value not yet stored in its
+    // slot, or -1 once it is.
+    int pushedAt;
+} Operand;
+
+typedef struct
+{
+    Chunk *chunk;
+    LoopTrace *trace;
+    // Index of the first instruction of the trace being recorded.
+    int start;
+    Operand *stack;
+    int depth;
+} Recorder;
+
+static Recorder recorder;
+
+// Targets for the operands of OP_NULL, OP_TRUE and OP_FALSE.
+static Value literals[3];
+
+#define INT_OP(overflow)                                                \
+    do                                                                  \
+    {                                                                   \
+        Value a = *instruction->a;                                      \
+        Value b = *instruction->b;                                      \
+        int64_t result;                                                 \
+        if (!IS_INT(a) || !IS_INT(b) ||                                 \
+            overflow(AS_INT(a), AS_INT(b), &result) || !fitsInt(result)) \
+            return false;                                               \
+        *instruction->dst = INT_VAL(result);                            \
+        return true;                                                    \
+    } while (false)
+#define DOUBLE_OP(op)                                                      \
+    do                                                                     \
+    {                                                                      \
+        Value a = *instruction->a;                                         \
+        Value b = *instruction->b;                                         \
+        if (!IS_DOUBLE(a) || !IS_DOUBLE(b))                                \
+            return false;                                                  \
+        *instruction->dst = NUMBER_VAL(AS_DOUBLE(a) op AS_DOUBLE(b));      \
+        return true;                                                       \
+    } while (false)
+#define NUMBER_OP(function)                         \
+    do                                              \
+    {                                               \
+        Value a = *instruction->a;                  \
+        Value b = *instruction->b;                  \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))         \
+            return false;                           \
+        *instruction->dst = function(a, b);         \
+        return true;                                \
+    } while (false)
+#define INT_COMPARE(op)                                         \
+    do                                                          \
+    {                                                           \
+        Value a = *instruction->a;                              \
+        Value b = *instruction->b;                              \
+        if (!IS_INT(a) || !IS_INT(b))                           \
+            return false;                                       \
+        *instruction->dst = BOOL_VAL(AS_INT(a) op AS_INT(b));   \
+        return true;                                            \
+    } while (false)
+#define GUARD_INT(op)                                                  \
+    do                                                                 \
+    {                                                                  \
+        Value a = *instruction->a;                                     \
+        Value b = *instruction->b;                                     \
+        return IS_INT(a) && IS_INT(b) &&                               \
+               (AS_INT(a) op AS_INT(b)) == instruction->expect;        \
+    } while (false)
+#define GUARD_NUMBER(function)                                          \
+    do                                                                  \
+    {                                                                   \
+        Value a = *instruction->a;                                      \
+        Value b = *instruction->b;                                      \
+        return IS_NUMBER(a) && IS_NUMBER(b) &&                          \
+               function(a, b) == instruction->expect;                   \
+    } while (false)
+
+// Runs one trace instruction. Returns false, with nothing changed, when
+// its guard fails.
+static inline bool execute(TraceInstruction *instruction)
+{
+    switch (instruction->op)
+    {
+    case TRACE_MOVE:
+        *instruction->dst = *instruction->a;
+        return true;
+    case TRACE_ADD_INT:
+        INT_OP(__builtin_add_overflow);
+    case TRACE_SUBTRACT_INT:
+        INT_OP(__builtin_sub_overflow);
+    case TRACE_MULTIPLY_INT:
+        INT_OP(intMultiplyOverflow);
+    case TRACE_ADD_DOUBLE:
+        DOUBLE_OP(+);
+    case TRACE_SUBTRACT_DOUBLE:
+        DOUBLE_OP(-);
+    case TRACE_MULTIPLY_DOUBLE:
+        DOUBLE_OP(*);
+    case TRACE_ADD_NUMBER:
+        NUMBER_OP(numberAdd);
+    case TRACE_SUBTRACT_NUMBER:
+        NUMBER_OP(numberSubtract);
+    case TRACE_MULTIPLY_NUMBER:
+        NUMBER_OP(numberMultiply);
+    case TRACE_DIVIDE:
+        NUMBER_OP(numberDivide);
+    case TRACE_NEGATE:
+    {
+        Value a = *instruction->a;
+        if (!IS_NUMBER(a))
+            return false;
+        *instruction->dst = numberNegate(a);
+        return true;
+    }
+    case TRACE_LESS_INT:
+        INT_COMPARE(<);
+    case TRACE_LESS_NUMBER:
+        NUMBER_OP(numberLess);
+    case TRACE_GREATER_INT:
+        INT_COMPARE(>);
+    case TRACE_GREATER_NUMBER:
+        NUMBER_OP(numberGreater);
+    case TRACE_EQUAL_INT:
+        INT_COMPARE(==);
+    case TRACE_EQUAL:
+        *instruction->dst = BOOL_VAL(valuesEqual(*instruction->a, *instruction->b));
+        return true;
+    case TRACE_NOT:
+        *instruction->dst = BOOL_VAL(isFalsey(*instruction->a));
+        return true;
+    case TRACE_WRITE:
+        printValue(*instruction->a);
+        printf("\n");
+        return true;
+    case TRACE_GUARD_TRUTHY:
+        return !isFalsey(*instruction->a);
+    case TRACE_GUARD_FALSEY:
+        return isFalsey(*instruction->a);
+    case TRACE_GUARD_LESS_INT:
+        GUARD_INT(<);
+    case TRACE_GUARD_LESS_NUMBER:
+        GUARD_NUMBER(numbersLess);
+    case TRACE_GUARD_GREATER_INT:
+        GUARD_INT(>);
+    case TRACE_GUARD_GREATER_NUMBER:
+        GUARD_NUMBER(numbersGreater);
+    case TRACE_LOOP:
+        return false;
+    }
+    return false;
+}
+
+#undef INT_OP
+#undef DOUBLE_OP
+#undef NUMBER_OP
+#undef INT_COMPARE
+#undef GUARD_INT
+#undef GUARD_NUMBER
+
+static void freeTrace(LoopTrace *trace)
+{
+    FREE_ARRAY(TraceInstruction, trace->code, trace->capacity);
+    FREE(LoopTrace, trace);
+}
+
+// Where the interpreter has to resume if the instruction at `offset`
+// bails out: at the oldest value that is still only pointed at, since
+// everything pushed from there on has no side effects and can simply run
+// again, or else at the instruction itself.
+static void resumePoint(int offset, int *exit, int *depth)
+{
+    for (int i = 0; i < recorder.depth; i++)
+    {
+        if (recorder.stack[i].pushedAt != -1)
+        {
+            *exit = recorder.stack[i].pushedAt;
+            *depth = i;
+            return;
+        }
+    }
+    *exit = offset;
+    *depth = recorder.depth;
+}
+
+// Appends an instruction for the bytecode at `offset` and runs it, so
+// recording executes the iteration it records. Returns false if the
+// instruction's guard fails, leaving the recorded iteration unfinished.
+static bool emit(TraceOp op, Value *dst, Value *a, Value *b, bool expect, int offset)
+{
+    LoopTrace *trace = recorder.trace;
+    if (trace->capacity < trace->count + 1)
+    {
+        int oldCapacity = trace->capacity;
+        trace->capacity = GROW_CAPACITY(oldCapacity);
+        trace->code = GROW_ARRAY(TraceInstruction, trace->code, oldCapacity,
+                                 trace->capacity);
+    }
+
+    TraceInstruction *instruction = &trace->code[trace->count++];
+    instruction->op = op;
+    instruction->expect = expect;
+    instruction->dst = dst;
+    instruction->a = a;
+    instruction->b = b;
+    instruction->side = -1;
+    instruction->exits = 0;
+    instruction->cost = 0;
+    resumePoint(offset, &instruction->exit, &instruction->depth);
+    return execute(instruction);
+}
+
+static Operand *operand(int distance)
+{
+    return &recorder.stack[recorder.depth - 1 - distance];
+}
+
+static void pushOperand(Value *value, int offset)
+{
+    recorder.stack[recorder.depth].value = value;
+    recorder.stack[recorder.depth].pushedAt = offset;
+    recorder.depth++;
+}
+
+// Pushes the result an instruction just stored in the next stack slot.
+static void pushResult()
+{
+    pushOperand(&vm.stack[recorder.depth], -1);
+}
+
+// Copies a value that is only pointed at into its stack slot.
+static void materialize(int position)
+{
+    Operand *value = &recorder.stack[position];
+    if (value->pushedAt == -1)
+        return;
+    emit(TRACE_MOVE, &vm.stack[position], value->value, NULL, false, value->pushedAt);
+    value->value = &vm.stack[position];
+    value->pushedAt = -1;
+}
+
+// Stores every value below the top `keep` ones in its slot. Instructions
+// with side effects do this first so that no later guard resumes the
+// interpreter from before them.
+static void flush(int keep)
+{
+    for (int i = 0; i < recorder.depth - keep; i++)
+    {
+        materialize(i);
+    }
+}
+
+// Stores the top of the stack in a local or global, popping it when
+// `pop` is set.
+static void store(Value *target, bool pop, int offset)
+{
+    flush(pop ? 1 : 0);
+    Operand *value = operand(0);
+    LoopTrace *trace = recorder.trace;
+    TraceInstruction *last = trace->count > recorder.start ? &trace->code[trace->count - 1] : NULL;
+    if (pop && value->pushedAt == -1 && last != NULL && last->dst == value->value)
+    {
+        // Have the instruction that computed the value store it directly.
+        last->dst = target;
+        *target = *value->value;
+    }
+    else
+    {
+        emit(TRACE_MOVE, target, value->value, NULL, false, offset);
+    }
+    if (pop)
+        recorder.depth--;
+}
+
+// Replaces the top `operands` values with the result of `op`.
+static bool operation(TraceOp op, int operands, int offset)
+{
+    int position = recorder.depth - operands;
+    Value *a = recorder.stack[position].value;
+    Value *b = operands == 2 ? operand(0)->value : NULL;
+    if (!emit(op, &vm.stack[position], a, b, false, offset))
+        return false;
+    recorder.depth = position;
+    pushResult();
+    return true;
+}
+
+// Picks the form of an arithmetic instruction that matches the operand
+// types seen now, or returns false if the trace cannot handle them.
+static bool arithmetic(Value a, Value b, TraceOp intOp, TraceOp doubleOp,
+                       TraceOp numberOp, TraceOp *op)
+{
+    if (IS_INT(a) && IS_INT(b))
+        *op = intOp;
+    else if (IS_DOUBLE(a) && IS_DOUBLE(b))
+        *op = doubleOp;
+    else if (IS_NUMBER(a) && IS_NUMBER(b))
+        *op = numberOp;
+    else
+        return false;
+    return true;
+}
+
+static bool binaryArithmetic(TraceOp intOp, TraceOp doubleOp, TraceOp numberOp, int offset)
+{
+    TraceOp op;
+    if (!arithmetic(*operand(1)->value, *operand(0)->value, intOp, doubleOp, numberOp, &op))
+        return false;
+    return operation(op, 2, offset);
+}
+
+// Guards a fused compare-and-jump and pops its operands. Sets *taken to
+// whether the jump was taken.
+static bool compareBranch(bool less, int offset, bool *taken)
+{
+    Value a = *operand(1)->value;
+    Value b = *operand(0)->value;
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    bool result = less ? numbersLess(a, b) : numbersGreater(a, b);
+    TraceOp op;
+    if (IS_INT(a) && IS_INT(b))
+        op = less ? TRACE_GUARD_LESS_INT : TRACE_GUARD_GREATER_INT;
+    else
+        op = less ? TRACE_GUARD_LESS_NUMBER : TRACE_GUARD_GREATER_NUMBER;
+    if (!emit(op, NULL, operand(1)->value, operand(0)->value, result, offset))
+        return false;
+    recorder.depth -= 2;
+    *taken = !result;
+    return true;
+}
+
+static int readLong(uint8_t *operands)
+{
+    return (operands[0] << 16) | (operands[1] << 8) | operands[2];
+}
+
+// Stops recording before the instruction at `offset` and hands the
+// interpreter a consistent stack to resume with.
+static bool abandon(int offset, int *resume)
+{
+    int depth;
+    resumePoint(offset, resume, &depth);
+    vm.stackTop = vm.stack + depth;
+    return false;
+}
+
+// Follows a back edge from the instruction at `offset` to `target`,
+// charging its fuel, and returns true if recording ends there: at the loop
+// header, which completes the iteration, or once a limit stops the script,
+// which sets *resume to LOOP_TRACE_STOPPED.
+static bool closesLoop(int offset, int target, int *resume)
+{
+    LoopTrace *trace = recorder.trace;
+    bool header = target == trace->header;
+    if (header)
+        flush(0);
+    emit(TRACE_LOOP, NULL, NULL, NULL, false, target);
+    TraceInstruction *loop = &trace->code[trace->count - 1];
+    loop->side = header ? 0 : trace->count;
+    loop->cost = offset + instructionLength(recorder.chunk, offset) - target;
+    if ((vm.fuelCheck -= loop->cost) < 0 && !checkLimits())
+    {
+        *resume = LOOP_TRACE_STOPPED;
+        return true;
+    }
+    if (!header)
+        return false;
+
+    vm.stackTop = vm.stack + recorder.depth;
+    *resume = trace->header;
+    return true;
+}
+
+// Records the rest of a loop iteration from `offset` while running it.
+// Returns true if the iteration made it back to the loop header;
+// otherwise *resume is where the interpreter takes over.
+static bool recordIteration(int offset, int *resume)
+{
+    Chunk *chunk = recorder.chunk;
+    Value *constants = chunk->constants.values;
+    Value *globals = vm.globalValues.values;
+
+    for (int length = 0;; length++)
+    {
+        uint8_t *ip = chunk->code + offset;
+        int next = offset + instructionLength(chunk, offset);
+        bool ok = true;
+        if (length == MAX_RECORDED_INSTRUCTIONS)
+            return abandon(offset, resume);
+
+        switch (*ip)
+        {
+        case OP_CONSTANT:
+            pushOperand(&constants[ip[1]], offset);
+            break;
+        case OP_CONSTANT_LONG:
+            pushOperand(&constants[readLong(ip + 1)], offset);
+            break;
+        case OP_NULL:
+            pushOperand(&literals[0], offset);
+            break;
+        case OP_TRUE:
+            pushOperand(&literals[1], offset);
+            break;
+        case OP_FALSE:
+            pushOperand(&literals[2], offset);
+            break;
+        case OP_POP:
+            recorder.depth--;
+            break;
+        case OP_GET_LOCAL:
+            // A local can itself be a value that is only pointed at.
+            materialize(ip[1]);
+            pushOperand(&vm.stack[ip[1]], offset);
+            break;
+        case OP_GET_LOCAL_2:
+            // The second slot may be the one the first read pushes to.
+            materialize(ip[1]);
+            pushOperand(&vm.stack[ip[1]], offset);
+            materialize(ip[2]);
+            pushOperand(&vm.stack[ip[2]], offset);
+            break;
+        case OP_SET_LOCAL:
+            store(&vm.stack[ip[1]], false, offset);
+            break;
+        case OP_SET_LOCAL_POP:
+            store(&vm.stack[ip[1]], true, offset);
+            break;
+        case OP_GET_GLOBAL_SLOT:
+        case OP_GET_GLOBAL_SLOT_LONG:
+        {
+            // Globals stay defined once they are, so the check the
+            // interpreter makes on every access is only needed here.
+            int slot = *ip == OP_GET_GLOBAL_SLOT ? ip[1] : readLong(ip + 1);
+            ok = !IS_UNDEFINED(globals[slot]);
+            if (ok)
+                pushOperand(&globals[slot], offset);
+            break;
+        }
+        case OP_SET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT_LONG:
+        {
+            int slot = *ip == OP_SET_GLOBAL_SLOT ? ip[1] : readLong(ip + 1);
+            ok = !IS_UNDEFINED(globals[slot]);
+            if (ok)
+                store(&globals[slot], false, offset);
+            break;
+        }
+        case OP_DEFINE_GLOBAL_SLOT:
+            store(&globals[ip[1]], true, offset);
+            break;
+        case OP_DEFINE_GLOBAL_SLOT_LONG:
+            store(&globals[readLong(ip + 1)], true, offset);
+            break;
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:
+        case OP_IS:
+            ok = operation(IS_INT(*operand(0)->value) && IS_INT(*operand(1)->value)
+                               ? TRACE_EQUAL_INT
+                               : TRACE_EQUAL,
+                           2, offset);
+            break;
+        case OP_GREATER:
+        case OP_GREATER_NN:
+            ok = binaryArithmetic(TRACE_GREATER_INT, TRACE_GREATER_NUMBER,
+                                  TRACE_GREATER_NUMBER, offset);
+            break;
+        case OP_LESS:
+        case OP_LESS_NN:
+            ok = binaryArithmetic(TRACE_LESS_INT, TRACE_LESS_NUMBER,
+                                  TRACE_LESS_NUMBER, offset);
+            break;
+        // Negated comparisons record as the comparison and a TRACE_NOT,
+        // which cannot fail once the comparison has run.
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUAL_NN:
+            ok = binaryArithmetic(TRACE_LESS_INT, TRACE_LESS_NUMBER,
+                                  TRACE_LESS_NUMBER, offset) &&
+                 operation(TRACE_NOT, 1, offset);
+            break;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_NN:
+            ok = binaryArithmetic(TRACE_GREATER_INT, TRACE_GREATER_NUMBER,
+                                  TRACE_GREATER_NUMBER, offset) &&
+                 operation(TRACE_NOT, 1, offset);
+            break;
+        case OP_NOT_EQUAL:
+            ok = operation(IS_INT(*operand(0)->value) && IS_INT(*operand(1)->value)
+                               ? TRACE_EQUAL_INT
+                               : TRACE_EQUAL,
+                           2, offset) &&
+                 operation(TRACE_NOT, 1, offset);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_ADD_NN:
+            ok = binaryArithmetic(TRACE_ADD_INT, TRACE_ADD_DOUBLE,
+                                  TRACE_ADD_NUMBER, offset);
+            break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NN:
+            ok = binaryArithmetic(TRACE_SUBTRACT_INT, TRACE_SUBTRACT_DOUBLE,
+                                  TRACE_SUBTRACT_NUMBER, offset);
+            break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NN:
+            ok = binaryArithmetic(TRACE_MULTIPLY_INT, TRACE_MULTIPLY_DOUBLE,
+                                  TRACE_MULTIPLY_NUMBER, offset);
+            break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NN:
+            ok = binaryArithmetic(TRACE_DIVIDE, TRACE_DIVIDE, TRACE_DIVIDE, offset);
+            break;
+        case OP_NOT:
+            ok = operation(TRACE_NOT, 1, offset);
+            break;
+        case OP_NEGATE:
+            ok = IS_NUMBER(*operand(0)->value) && operation(TRACE_NEGATE, 1, offset);
+            break;
+        case OP_WRITE:
+            flush(1);
+            emit(TRACE_WRITE, NULL, operand(0)->value, NULL, false, offset);
+            recorder.depth--;
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+        {
+            Value *local = &vm.stack[ip[1]];
+            Value *constant = &constants[ip[2]];
+            TraceOp op;
+            flush(0);
+            ok = arithmetic(*local, *constant, TRACE_ADD_INT, TRACE_ADD_DOUBLE,
+                            TRACE_ADD_NUMBER, &op) &&
+                 emit(op, local, local, constant, false, offset);
+            break;
+        }
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+            next = jumpTarget(chunk, offset);
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+        {
+            Operand *condition = operand(0);
+            bool taken = isFalsey(*condition->value);
+            emit(taken ? TRACE_GUARD_FALSEY : TRACE_GUARD_TRUTHY, NULL,
+                 condition->value, NULL, false, offset);
+            if (taken)
+                next = jumpTarget(chunk, offset);
+            break;
+        }
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS_NN:
+        case OP_JUMP_IF_NOT_GREATER_NN:
+        {
+            bool taken;
+            bool less = *ip == OP_JUMP_IF_NOT_LESS || *ip == OP_JUMP_IF_NOT_LESS_NN;
+            ok = compareBranch(less, offset, &taken);
+            if (ok && taken)
+                next = jumpTarget(chunk, offset);
+            break;
+        }
+        case OP_FOR_RANGE:
+        {
+            // A failed increment resumes here with nothing changed. After
+            // it the counter is a number, so the guard only fails when the
+            // loop goes the other way, and resumes past the increment.
+            Value *local = &vm.stack[ip[3]];
+            Value *step = &constants[ip[4]];
+            Value *limit = &constants[ip[5]];
+            int target = jumpTarget(chunk, offset);
+            TraceOp op;
+            flush(0);
+            ok = arithmetic(*local, *step, TRACE_ADD_INT, TRACE_ADD_DOUBLE,
+                            TRACE_ADD_NUMBER, &op) &&
+                 emit(op, local, local, step, false, offset);
+            if (!ok)
+                break;
+            bool less = numbersLess(*local, *limit);
+            emit(op == TRACE_ADD_INT && IS_INT(*limit) ? TRACE_GUARD_LESS_INT
+                                                      : TRACE_GUARD_LESS_NUMBER,
+                 NULL, local, limit, less, less ? next : target);
+            if (less)
+            {
+                next = target;
+                if (closesLoop(offset, next, resume))
+                    return *resume != LOOP_TRACE_STOPPED;
+            }
+            break;
+        }
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+            next = jumpTarget(chunk, offset);
+            if (closesLoop(offset, next, resume))
+                return *resume != LOOP_TRACE_STOPPED;
+            break;
+        default:
+            // Returning and reading input are left to the interpreter.
+            ok = false;
+            break;
+        }
+
+        if (!ok)
+            return abandon(offset, resume);
+        offset = next;
+    }
+}
+
+// Records a trace into `trace` starting from the bytecode at `offset`,
+// with the VM stack as the interpreter left it. Leaves the trace as it was
+// if the iteration cannot be recorded to the end. Either way, *resume is
+// where execution continues.
+static bool record(Chunk *chunk, LoopTrace *trace, int offset, int *resume)
+{
+    literals[0] = NULL_VAL;
+    literals[1] = BOOL_VAL(true);
+    literals[2] = BOOL_VAL(false);
+
+    recorder.chunk = chunk;
+    recorder.trace = trace;
+    recorder.start = trace->count;
+    recorder.stack = ALLOCATE(Operand, vm.stackCapacity);
+    recorder.depth = 0;
+    int depth = (int)(vm.stackTop - vm.stack);
+    for (int i = 0; i < depth; i++)
+    {
+        pushResult();
+    }
+
+    bool recorded = recordIteration(offset, resume);
+    FREE_ARRAY(Operand, recorder.stack, vm.stackCapacity);
+    if (!recorded)
+        trace->count = recorder.start;
+    return recorded;
+}
+
+// Runs the trace from the loop header until a guard without a side trace
+// fails, and returns the offset of the instruction the interpreter
+// continues with, or LOOP_TRACE_STOPPED if a limit stopped the script.
+static int runTrace(Chunk *chunk, LoopTrace *trace)
+{
+    TraceInstruction *instruction = trace->code;
+    for (;;)
+    {
+        if (execute(instruction))
+        {
+            instruction++;
+            continue;
+        }
+        if (instruction->op == TRACE_LOOP &&
+            (vm.fuelCheck -= instruction->cost) < 0 && !checkLimits())
+            return LOOP_TRACE_STOPPED;
+        if (instruction->side != -1)
+        {
+            instruction = trace->code + instruction->side;
+            continue;
+        }
+
+        vm.stackTop = vm.stack + instruction->depth;
+        int resume = instruction->exit;
+        if (instruction->exits == SIDE_TRACE_THRESHOLD ||
+            ++instruction->exits < SIDE_TRACE_THRESHOLD)
+            return resume;
+
+        // Recording runs the rest of this iteration, so a side trace that
+        // makes it back to the header continues at the main trace.
+        int guard = (int)(instruction - trace->code);
+        int side = trace->count;
+        if (!record(chunk, trace, resume, &resume))
+            return resume;
+        trace->code[guard].side = side;
+        instruction = trace->code;
+    }
+}
+
+// Called by the interpreter whenever a back edge reaches the loop header
+// at `header`. Returns the offset of the instruction to run next, or
+// LOOP_TRACE_STOPPED.
+int loopTraceBackEdge(Chunk *chunk, int header)
+{
+    LoopTraces *loops = chunk->loopTraces;
+    if (loops == NULL)
+    {
+        loops = ALLOCATE(LoopTraces, 1);
+        loops->count = chunk->count;
+        loops->heat = ALLOCATE(uint8_t, chunk->count);
+        loops->traces = ALLOCATE(LoopTrace *, chunk->count);
+        memset(loops->heat, 0, chunk->count);
+        for (int i = 0; i < chunk->count; i++)
+        {
+            loops->traces[i] = NULL;
+        }
+        chunk->loopTraces = loops;
+    }
+
+    if (loops->traces[header] != NULL)
+        return runTrace(chunk, loops->traces[header]);
+    if (loops->heat[header] == LOOP_TRACE_THRESHOLD ||
+        ++loops->heat[header] < LOOP_TRACE_THRESHOLD)
+        return header;
+
+    LoopTrace *trace = ALLOCATE(LoopTrace, 1);
+    trace->code = NULL;
+    trace->count = 0;
+    trace->capacity = 0;
+    trace->header = header;
+    int resume;
+    // A trace that is nothing but TRACE_LOOP would spin forever without
+    // reaching a guard.
+    if (!record(chunk, trace, header, &resume) || trace->count == 1)
+    {
+        freeTrace(trace);
+        return resume;
+    }
+    loops->traces[header] = trace;
+    return runTrace(chunk, trace);
+}
+
+void freeLoopTraces(Chunk *chunk)
+{
+    LoopTraces *loops = chunk->loopTraces;
+    if (loops == NULL)
+        return;
+    for (int i = 0; i < loops->count; i++)
+    {
+        if (loops->traces[i] != NULL)
+            freeTrace(loops->traces[i]);
+    }
+    FREE_ARRAY(uint8_t, loops->heat, loops->count);
+    FREE_ARRAY(LoopTrace *, loops->traces, loops->count);
+    FREE(LoopTraces, loops);
+    chunk->loopTraces = NULL;
+}
+
+#endif
\ No newline at end of file
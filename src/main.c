@@ -1,12 +1,24 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "kavya/main.h"
+#include "kavya/aot.h"
 #include "kavya/chunk.h"
+#include "kavya/compiler.h"
 #include "kavya/debug.h"
+#include "kavya/jit.h"
+#include "kavya/looptrace.h"
+#include "kavya/recorder.h"
+#include "kavya/stream.h"
 #include "kavya/vm.h"
 
+static bool showStats = false;
+static bool emitOutput = false;
+static bool streamScript = false;
+static ExecutionLimits limits = {0};
+
 // Function to check if the file has the .kav extension
 static int hasKavExtension(const char *path)
 {
@@ -50,13 +62,57 @@ static char *readFile(const char *path)
 static void runFile(const char *path)
 {
     char *source = readFile(path);
-    InterpretResult result = interpret(source);
+    int64_t start = monotonicNanos();
+    InterpretResult result = streamScript ? interpretStreamed(source, limits)
+                                          : interpret(source, limits);
+    int64_t totalNanos = monotonicNanos() - start;
     free(source);
 
+#ifdef KAVYA_COUNT_INSTRUCTIONS
+    fprintf(stderr, "instructions: %llu\n", vm.instructionCount);
+#endif
+
+    if (showStats)
+    {
+        fprintf(stderr, "constant globals: %d\n", compileStats.constantGlobals);
+        fprintf(stderr, "global reads inlined: %d\n", compileStats.inlinedGlobalReads);
+        fprintf(stderr, "operations folded: %d\n", compileStats.foldedOperations);
+        fprintf(stderr, "peephole rewrites: %d\n", compileStats.peepholeRewrites);
+        fprintf(stderr, "branches folded: %d\n", compileStats.ir.branchesFolded);
+        fprintf(stderr, "blocks removed: %d\n", compileStats.ir.blocksRemoved);
+        fprintf(stderr, "dead instructions removed: %d\n", compileStats.ir.deadInstructions);
+        fprintf(stderr, "invariants hoisted: %d\n", compileStats.ir.invariantsHoisted);
+        TypeStats types = compileStats.types;
+        fprintf(stderr, "numeric operators proven: %d of %d (%.1f%%)\n", types.proven,
+                types.sites, types.sites == 0 ? 0.0 : 100.0 * types.proven / types.sites);
+        fprintf(stderr, "compile time: %.3f ms\n", compileStats.compileNanos / 1e6);
+        // A streamed script compiles while it runs.
+        int64_t runNanos = streamScript ? totalNanos : totalNanos - compileStats.compileNanos;
+        fprintf(stderr, "run time: %.3f ms\n", runNanos / 1e6);
+    }
+
     if (result == INTERPRET_COMPILE_ERROR)
         exit(65);
     if (result == INTERPRET_RUNTIME_ERROR)
         exit(70);
+    if (result == INTERPRET_LIMIT_EXCEEDED)
+        exit(75);
+}
+
+static void emitFile(const char *path)
+{
+    char *source = readFile(path);
+    Chunk chunk;
+    initChunk(&chunk);
+    // The C emitter works on stack code.
+    compileTarget = TARGET_STACK;
+    bool compiled = compile(source, &chunk);
+    free(source);
+    if (!compiled)
+        exit(65);
+
+    emitC(&chunk, path, stdout);
+    freeChunk(&chunk);
 }
 
 static void repl()
@@ -79,37 +135,136 @@ static void repl()
             printf("Exiting...\nGoodbye!\n");
             break;
         }
-        interpret(line);
+        interpret(line, limits);
     }
 }
 
+// Parses the positive number following a flag, which must not exceed
+// `max`.
+static int64_t limitArgument(const char *value, int64_t max)
+{
+    char *end;
+    errno = 0;
+    long long number = value != NULL ? strtoll(value, &end, 10) : 0;
+    if (value == NULL || *end != '\0' || number <= 0)
+    {
+        fprintf(stderr, "Expected a positive number after a limit flag.\n");
+        exit(64);
+    }
+    if (errno == ERANGE || number > max)
+    {
+        fprintf(stderr, "Limit too large; the most allowed is %lld.\n", (long long)max);
+        exit(64);
+    }
+    return number;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: kavya [-O0|-O1|-O2] [--registers] [--stats] [--trace] [--dump-bytecode] [--flight-recorder] [--fuel N] [--timeout MS] [--no-jit] [--no-loop-traces] [--stream] [--emit-c] [path to .kav file]\n");
+    exit(64);
+}
+
 int main(int argc, const char *argv[])
 {
     initVM();
 
-    if (argc == 1)
+    const char *filePath = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0 ||
+            strcmp(argv[i], "-O2") == 0)
+        {
+            // Choose how much the compiler optimizes
+            optimizationLevel = argv[i][2] - '0';
+        }
+        else if (strcmp(argv[i], "--registers") == 0)
+        {
+            // Lower compiled chunks to register instructions
+            compileTarget = TARGET_REGISTER;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            // Print compiler statistics after running a file
+            showStats = true;
+        }
+        else if (strcmp(argv[i], "--trace") == 0)
+        {
+            // Print the stack and each instruction as it runs
+            traceExecution = true;
+        }
+        else if (strcmp(argv[i], "--dump-bytecode") == 0)
+        {
+            // Disassemble each chunk after compiling it
+            dumpBytecode = true;
+        }
+        else if (strcmp(argv[i], "--flight-recorder") == 0)
+        {
+            // Keep the last instructions run to dump on a runtime error,
+            // recording only jumps so that it costs a few percent at most
+            flightRecorderEnabled = true;
+            startFlightRecorder();
+        }
+        else if (strcmp(argv[i], "--fuel") == 0)
+        {
+            // Stop once loops have run this many bytes of bytecode
+            limits.fuel = limitArgument(argv[++i], INT64_MAX);
+        }
+        else if (strcmp(argv[i], "--timeout") == 0)
+        {
+            // Stop after running for this many milliseconds
+            limits.timeoutMs = limitArgument(argv[++i], INT64_MAX / 1000000);
+        }
+        else if (strcmp(argv[i], "--no-jit") == 0)
+        {
+            // Run hot loops as loop traces instead of native code
+            jitEnabled = false;
+        }
+        else if (strcmp(argv[i], "--no-loop-traces") == 0)
+        {
+            // Interpret hot loops that are not compiled to native code
+            loopTracesEnabled = false;
+        }
+        else if (strcmp(argv[i], "--stream") == 0)
+        {
+            // Run each batch of statements while the next one compiles
+            streamScript = true;
+        }
+        else if (strcmp(argv[i], "--emit-c") == 0)
+        {
+            // Print the file compiled to C instead of running it
+            emitOutput = true;
+        }
+        else if (argv[i][0] == '-' || filePath != NULL)
+        {
+            usage();
+        }
+        else
+        {
+            filePath = argv[i];
+        }
+    }
+
+    if (filePath == NULL && emitOutput)
+    {
+        usage();
+    }
+    else if (filePath == NULL)
     {
         // Start the REPL if no file argument is provided
         repl();
     }
-    else if (argc == 2)
+    else if (hasKavExtension(filePath))
     {
-        const char *filePath = argv[1];
-
         // Check if the file has the .kav extension
-        if (hasKavExtension(filePath))
-        {
-            runFile(filePath);
-        }
+        if (emitOutput)
+            emitFile(filePath);
         else
-        {
-            fprintf(stderr, "Unsupported file type. Please use a .kav file.\n");
-            exit(64);
-        }
+            runFile(filePath);
     }
     else
     {
-        fprintf(stderr, "Usage: kavya [path to .kav file]\n");
+        fprintf(stderr, "Unsupported file type. Please use a .kav file.\n");
         exit(64);
     }
 
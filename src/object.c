@@ -48,28 +48,31 @@ static uint32_t hashString(const char *key, int length)
 ObjString *takeString(char *chars, int length)
 {
     uint32_t hash = hashString(chars, length);
+    lockShared();
     ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString *string = interned != NULL ? interned : allocateString(chars, length, hash);
+    unlockShared();
 
     if (interned != NULL)
-    {
         FREE_ARRAY(char, chars, length + 1);
-        return interned;
-    }
-    return allocateString(chars, length, hash);
+    return string;
 }
 
 ObjString *copyString(const char *chars, int length)
 {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    lockShared();
+    ObjString *string = tableFindString(&vm.strings, chars, length, hash);
 
-    if (interned != NULL)
-        return interned;
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-
-    return allocateString(heapChars, length, hash);
+    if (string == NULL)
+    {
+        char *heapChars = ALLOCATE(char, length + 1);
+        memcpy(heapChars, chars, length);
+        heapChars[length] = '\0';
+        string = allocateString(heapChars, length, hash);
+    }
+    unlockShared();
+    return string;
 }
 
 void printObject(Value value)
@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "kavya/memory.h"
+#include "kavya/peephole.h"
+
+// The pass decodes the chunk into one entry per instruction, rewrites the
+// entries until nothing more matches, and then compacts the code over
+// itself. A rewrite only removes instructions or swaps one for another of
+// the same length, so no instruction moves to a higher offset and every
+// jump still fits the encoding it was emitted with.
+
+typedef struct
+{
+    int offset;
+    uint8_t op;
+    // Index of the instruction a jump lands on, or -1.
+    int target;
+    bool removed;
+    bool isTarget;
+    // A jump table entry after a match instruction, which has to stay in
+    // place even when it jumps to the next instruction.
+    bool pinned;
+} Instruction;
+
+typedef struct
+{
+    Instruction *code;
+    int rewrites;
+} Peephole;
+
+static Peephole peephole;
+
+static int lengthOf(int index)
+{
+    return peephole.code[index + 1].offset - peephole.code[index].offset;
+}
+
+// The first instruction from `index` on that has not been removed.
+static int live(int index)
+{
+    while (peephole.code[index].removed)
+        index++;
+    return index;
+}
+
+static int next(int index)
+{
+    return live(index + 1);
+}
+
+// Removes an instruction. Jumps to it land on the one after it instead.
+static void removeInstruction(int index)
+{
+    Instruction *instruction = &peephole.code[index];
+    instruction->removed = true;
+    if (instruction->isTarget)
+        peephole.code[next(index)].isTarget = true;
+}
+
+static uint8_t negatedComparison(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_LESS:
+        return OP_GREATER_EQUAL;
+    case OP_GREATER:
+        return OP_LESS_EQUAL;
+    case OP_EQUAL:
+        return OP_NOT_EQUAL;
+    default:
+        return op;
+    }
+}
+
+// Instructions that only push a value and cannot fail.
+static bool pushesValue(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NULL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool isUnconditionalJump(uint8_t op)
+{
+    return op == OP_JUMP || op == OP_JUMP_LONG;
+}
+
+// Applies the first rewrite that matches at `index`.
+static bool rewrite(int index)
+{
+    Instruction *instruction = &peephole.code[index];
+    int following = next(index);
+    Instruction *after = &peephole.code[following];
+
+    // `a >= b` compiles to OP_LESS, OP_NOT, and `!=` and `<=` likewise.
+    uint8_t negated = negatedComparison(instruction->op);
+    if (negated != instruction->op && after->op == OP_NOT && !after->isTarget)
+    {
+        instruction->op = negated;
+        removeInstruction(following);
+        return true;
+    }
+
+    // Expression statements and empty scopes leave a value that is pushed
+    // only to be popped.
+    if (pushesValue(instruction->op) && after->op == OP_POP && !after->isTarget)
+    {
+        removeInstruction(index);
+        removeInstruction(following);
+        return true;
+    }
+
+    if (instruction->target == -1 || isBackwardJump(instruction->op))
+        return false;
+
+    int target = live(instruction->target);
+    if (isUnconditionalJump(instruction->op) && target == following && !instruction->pinned)
+    {
+        removeInstruction(index);
+        return true;
+    }
+
+    // Forward jumps only lead further forward, so threading terminates.
+    if (isUnconditionalJump(peephole.code[target].op))
+    {
+        int destination = live(peephole.code[target].target);
+        int distance = peephole.code[destination].offset - peephole.code[index + 1].offset;
+        if (lengthOf(index) == 5 || distance <= UINT16_MAX)
+        {
+            instruction->target = destination;
+            peephole.code[destination].isTarget = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void writeJump(uint8_t *bytes, int length, int jump)
+{
+    if (length == 5)
+    {
+        bytes[1] = (jump >> 24) & 0xff;
+        bytes[2] = (jump >> 16) & 0xff;
+        bytes[3] = (jump >> 8) & 0xff;
+        bytes[4] = jump & 0xff;
+    }
+    else
+    {
+        bytes[1] = (jump >> 8) & 0xff;
+        bytes[2] = jump & 0xff;
+    }
+}
+
+int optimizePeepholes(Chunk *chunk)
+{
+    int codeSize = chunk->count;
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        count++;
+    }
+
+    // One extra entry marks the end of the code.
+    peephole.code = ALLOCATE(Instruction, count + 1);
+    peephole.rewrites = 0;
+    int *indices = ALLOCATE(int, codeSize + 1);
+    int index = 0;
+    for (int offset = 0; offset <= chunk->count; index++)
+    {
+        bool end = offset == chunk->count;
+        peephole.code[index] = (Instruction){offset, end ? OP_RETURN : chunk->code[offset],
+                                             -1, false, false, false};
+        indices[offset] = index;
+        offset += end ? 1 : instructionLength(chunk, offset);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        Instruction *instruction = &peephole.code[i];
+        if (isJumpInstruction(instruction->op))
+        {
+            instruction->target = indices[jumpTarget(chunk, instruction->offset)];
+            peephole.code[instruction->target].isTarget = true;
+        }
+        if (isMatchInstruction(instruction->op))
+        {
+            for (int entry = 1; entry <= matchEntryCount(chunk, instruction->offset); entry++)
+                peephole.code[i + entry].pinned = true;
+        }
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (int i = live(0); i < count; i = next(i))
+        {
+            if (rewrite(i))
+            {
+                peephole.rewrites++;
+                changed = true;
+            }
+        }
+    }
+
+    // Where each instruction ends up; a removed one maps to the next
+    // instruction that stays.
+    int *offsets = ALLOCATE(int, count + 1);
+    int size = 0;
+    for (int i = 0; i <= count; i++)
+    {
+        offsets[i] = size;
+        if (i < count && !peephole.code[i].removed)
+            size += lengthOf(i);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        Instruction *instruction = &peephole.code[i];
+        if (instruction->removed)
+            continue;
+
+        int length = lengthOf(i);
+        uint8_t bytes[6];
+        memcpy(bytes, &chunk->code[instruction->offset], length);
+        bytes[0] = instruction->op;
+        if (instruction->target != -1)
+        {
+            int end = offsets[i] + length;
+            int target = offsets[instruction->target];
+            bool backward = isBackwardJump(instruction->op);
+            writeJump(bytes, length, backward ? end - target : target - end);
+        }
+        memcpy(&chunk->code[offsets[i]], bytes, length);
+        memmove(&chunk->lines[offsets[i]], &chunk->lines[instruction->offset],
+                length * sizeof(int));
+    }
+    chunk->count = size;
+
+    FREE_ARRAY(Instruction, peephole.code, count + 1);
+    FREE_ARRAY(int, indices, codeSize + 1);
+    FREE_ARRAY(int, offsets, count + 1);
+    return peephole.rewrites;
+}
\ No newline at end of file
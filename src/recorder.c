@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "kavya/debug.h"
+#include "kavya/recorder.h"
+
+#ifdef __unix__
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+bool flightRecorderEnabled = false;
+FlightRecorder flightRecorder;
+
+// The dump may run inside a signal handler, so it formats by hand and
+// writes straight to stderr instead of going through stdio.
+static void writeOut(const char *text, size_t length)
+{
+#ifdef __unix__
+    while (length > 0)
+    {
+        ssize_t written = write(STDERR_FILENO, text, length);
+        if (written <= 0)
+            return;
+        text += written;
+        length -= (size_t)written;
+    }
+#else
+    fwrite(text, 1, length, stderr);
+#endif
+}
+
+// Appends `number` right-aligned in `width` characters, padded with `pad`.
+static char *formatNumber(char *out, unsigned int number, int width, char pad)
+{
+    char digits[16];
+    int count = 0;
+    do
+    {
+        digits[count++] = (char)('0' + number % 10);
+        number /= 10;
+    } while (number > 0);
+    for (int i = count; i < width; i++)
+        *out++ = pad;
+    while (count > 0)
+        *out++ = digits[--count];
+    return out;
+}
+
+// Prints one instruction in the disassembler's offset and line columns.
+// Opcodes are read from the chunk, so quickened instructions show their
+// specialized form.
+static void printInstruction(Chunk *chunk, int offset)
+{
+    char line[32];
+    const char *name = opcodeName(chunk->code[offset]);
+    if (name == NULL)
+        name = "OP_UNKNOWN";
+    char *out = formatNumber(line, (unsigned int)offset, 4, '0');
+    *out++ = ' ';
+    out = formatNumber(out, (unsigned int)chunk->lines[offset], 4, ' ');
+    *out++ = ' ';
+    writeOut(line, (size_t)(out - line));
+    writeOut(name, strlen(name));
+    writeOut("\n", 1);
+}
+
+// Walks the instructions that start in [start, end), printing them if
+// `print` is set once the first *skip have gone by, and returns how many
+// there were.
+static unsigned int walkRun(Chunk *chunk, uint8_t *start, uint8_t *end,
+                            unsigned int *skip, bool print)
+{
+    int offset = (int)(start - chunk->code);
+    int stop = (int)(end - chunk->code);
+    if (offset < 0 || stop > chunk->count)
+        return 0;
+    unsigned int walked = 0;
+    for (; offset < stop; offset += instructionLength(chunk, offset))
+    {
+        walked++;
+        if (!print)
+            continue;
+        if (*skip > 0)
+            (*skip)--;
+        else
+            printInstruction(chunk, offset);
+    }
+    return walked;
+}
+
+// Walks every run of instructions between the first `count` recorded
+// jumps that is still known, up to `ip` if that is set.
+static unsigned int walkRecorded(Chunk *chunk, unsigned int count, uint8_t *ip,
+                                 unsigned int skip, bool print)
+{
+    // Once the ring has wrapped, where the oldest jump's run started is
+    // lost.
+    unsigned int first = count < FLIGHT_RECORDER_JUMPS ? 0 : count - FLIGHT_RECORDER_JUMPS;
+    uint8_t *start = count < FLIGHT_RECORDER_JUMPS ? chunk->code : NULL;
+    unsigned int walked = 0;
+    for (unsigned int i = first; i != count; i++)
+    {
+        unsigned int index = i % FLIGHT_RECORDER_JUMPS;
+        if (start != NULL)
+            walked += walkRun(chunk, start, flightRecorder.from[index], &skip, print);
+        start = flightRecorder.to[index];
+    }
+    if (ip != NULL && start != NULL)
+        walked += walkRun(chunk, start, ip, &skip, print);
+    return walked;
+}
+
+// Prints the last FLIGHT_RECORDER_SIZE instructions the chunk being run
+// went through, oldest first.
+void dumpFlightRecorder(uint8_t *ip)
+{
+    Chunk *chunk = flightRecorder.chunk;
+    unsigned int count = flightRecorder.count;
+    unsigned int walked = chunk == NULL ? 0 : walkRecorded(chunk, count, ip, 0, false);
+    unsigned int shown = walked < FLIGHT_RECORDER_SIZE ? walked : FLIGHT_RECORDER_SIZE;
+
+    char line[64];
+    char *out = line;
+    memcpy(out, "== flight recorder: last ", 25);
+    out = formatNumber(out + 25, shown, 0, ' ');
+    memcpy(out, " instructions ==\n", 17);
+    writeOut(line, (size_t)(out + 17 - line));
+
+    if (chunk != NULL)
+        walkRecorded(chunk, count, ip, walked - shown, true);
+}
+
+#ifdef __unix__
+static void dumpOnSignal(int signal)
+{
+    (void)signal;
+    dumpFlightRecorder(NULL);
+}
+#endif
+
+// Lets SIGUSR1 dump the recorder while a script is running.
+void startFlightRecorder()
+{
+#ifdef __unix__
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dumpOnSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,546 @@
+#include <stdlib.h>
+
+#include "kavya/memory.h"
+#include "kavya/register.h"
+
+// Lowers a finished stack chunk into three-address register code.
+//
+// Stack position N maps to register N. While walking a basic block the
+// translator keeps a virtual stack of operands that may still live somewhere
+// else (a constant, or the local register an OP_GET_LOCAL read from); they
+// are only copied into their own register when something needs them there,
+// and every operand is in its own register at block boundaries.
+
+typedef struct
+{
+    bool isConstant;
+    uint8_t index;
+} Operand;
+
+typedef struct
+{
+    int offset;
+    int target;
+} Patch;
+
+typedef struct
+{
+    Chunk *source;
+    Chunk out;
+    int *outOffsets;
+    int *depths;
+    bool *targets;
+    Patch *patches;
+    int patchCount;
+    int patchCapacity;
+    Operand stack[REGISTER_MAX];
+    int depth;
+    int lastDestination;
+    int line;
+    bool failed;
+} Lowering;
+
+static Lowering lowering;
+
+static void emit(uint8_t byte)
+{
+    writeChunk(&lowering.out, byte, lowering.line);
+}
+
+static void emitOp(uint8_t op)
+{
+    lowering.lastDestination = -1;
+    emit(op);
+}
+
+// Emits an instruction whose first operand is the register it writes, and
+// remembers where that operand is so a store to a local that directly
+// follows can retarget it.
+static void emitValue(uint8_t op, uint8_t destination)
+{
+    emitOp(op);
+    lowering.lastDestination = lowering.out.count;
+    emit(destination);
+}
+
+static Operand registerOperand(int index)
+{
+    return (Operand){false, (uint8_t)index};
+}
+
+static void push(Operand operand)
+{
+    if (lowering.depth == REGISTER_MAX)
+    {
+        lowering.failed = true;
+        return;
+    }
+    lowering.stack[lowering.depth++] = operand;
+}
+
+static bool inPlace(int position)
+{
+    Operand operand = lowering.stack[position];
+    return !operand.isConstant && operand.index == position;
+}
+
+// Copies the operand at a stack position into that position's register.
+static void materialize(int position)
+{
+    if (inPlace(position))
+        return;
+
+    Operand operand = lowering.stack[position];
+    emitOp(operand.isConstant ? REG_LOADK : REG_MOVE);
+    emit((uint8_t)position);
+    emit(operand.index);
+    lowering.stack[position] = registerOperand(position);
+}
+
+static void flush(int depth)
+{
+    for (int position = 0; position < depth; position++)
+    {
+        materialize(position);
+    }
+}
+
+// Makes sure no pending operand still reads a register about to be written.
+static void clobber(int reg)
+{
+    for (int position = 0; position < lowering.depth; position++)
+    {
+        Operand operand = lowering.stack[position];
+        if (position != reg && !operand.isConstant && operand.index == reg)
+            materialize(position);
+    }
+}
+
+static uint8_t rk(int position)
+{
+    Operand operand = lowering.stack[position];
+    if (!operand.isConstant)
+        return operand.index;
+    if (operand.index < RK_CONSTANT)
+        return RK_CONSTANT | operand.index;
+
+    materialize(position);
+    return (uint8_t)position;
+}
+
+static void addPatch(int target)
+{
+    if (lowering.patchCapacity < lowering.patchCount + 1)
+    {
+        int oldCapacity = lowering.patchCapacity;
+        lowering.patchCapacity = GROW_CAPACITY(oldCapacity);
+        lowering.patches = GROW_ARRAY(Patch, lowering.patches,
+                                      oldCapacity, lowering.patchCapacity);
+    }
+    lowering.patches[lowering.patchCount++] = (Patch){lowering.out.count, target};
+    emit(0xff);
+    emit(0xff);
+}
+
+static void recordDepth(int target, int depth)
+{
+    if (lowering.depths[target] == -1)
+        lowering.depths[target] = depth;
+}
+
+static void binary(uint8_t op)
+{
+    uint8_t b = rk(lowering.depth - 2);
+    uint8_t c = rk(lowering.depth - 1);
+    lowering.depth -= 2;
+    int destination = lowering.depth;
+    emitValue(op, (uint8_t)destination);
+    emit(b);
+    emit(c);
+    push(registerOperand(destination));
+}
+
+static void unary(uint8_t op)
+{
+    uint8_t b = rk(lowering.depth - 1);
+    int destination = --lowering.depth;
+    emitValue(op, (uint8_t)destination);
+    emit(b);
+    push(registerOperand(destination));
+}
+
+static void setLocal(int slot)
+{
+    int top = lowering.depth - 1;
+    Operand value = lowering.stack[top];
+    if (!value.isConstant && value.index == slot)
+        return;
+
+    // The old value of the local is dead, so it never has to be copied in.
+    lowering.stack[slot] = registerOperand(slot);
+
+    bool retarget = lowering.lastDestination != -1 && inPlace(top) &&
+                    lowering.out.code[lowering.lastDestination] == top;
+    for (int position = 0; position < top && retarget; position++)
+    {
+        Operand operand = lowering.stack[position];
+        if (position != slot && !operand.isConstant && operand.index == slot)
+            retarget = false;
+    }
+
+    if (retarget)
+    {
+        // The value was computed by the last instruction; have it write the
+        // local directly instead of going through the temporary.
+        lowering.out.code[lowering.lastDestination] = (uint8_t)slot;
+        lowering.stack[top] = registerOperand(slot);
+    }
+    else
+    {
+        clobber(slot);
+        emitOp(value.isConstant ? REG_LOADK : REG_MOVE);
+        emit((uint8_t)slot);
+        emit(value.index);
+    }
+}
+
+static void lowerInstruction(int offset)
+{
+    Chunk *source = lowering.source;
+    uint8_t *code = source->code;
+
+    switch (code[offset])
+    {
+    case OP_CONSTANT:
+        push((Operand){true, code[offset + 1]});
+        break;
+    case OP_NULL:
+        emitValue(REG_NULL, (uint8_t)lowering.depth);
+        push(registerOperand(lowering.depth));
+        break;
+    case OP_TRUE:
+        emitValue(REG_TRUE, (uint8_t)lowering.depth);
+        push(registerOperand(lowering.depth));
+        break;
+    case OP_FALSE:
+        emitValue(REG_FALSE, (uint8_t)lowering.depth);
+        push(registerOperand(lowering.depth));
+        break;
+    case OP_POP:
+        lowering.depth--;
+        break;
+    case OP_GET_LOCAL:
+        materialize(code[offset + 1]);
+        push(registerOperand(code[offset + 1]));
+        break;
+    case OP_GET_LOCAL_2:
+        // The second slot may be the one the first read pushes to.
+        materialize(code[offset + 1]);
+        push(registerOperand(code[offset + 1]));
+        materialize(code[offset + 2]);
+        push(registerOperand(code[offset + 2]));
+        break;
+    case OP_SET_LOCAL:
+        setLocal(code[offset + 1]);
+        break;
+    case OP_SET_LOCAL_POP:
+        setLocal(code[offset + 1]);
+        lowering.depth--;
+        break;
+    case OP_ADD_LOCAL_CONSTANT:
+    {
+        uint8_t slot = code[offset + 1];
+        push((Operand){true, code[offset + 2]});
+        uint8_t constant = rk(lowering.depth - 1);
+        lowering.depth--;
+        materialize(slot);
+        clobber(slot);
+        emitOp(REG_ADD);
+        emit(slot);
+        emit(slot);
+        emit(constant);
+        break;
+    }
+    case OP_GET_GLOBAL_SLOT:
+        emitValue(REG_GET_GLOBAL, (uint8_t)lowering.depth);
+        emit(code[offset + 1]);
+        push(registerOperand(lowering.depth));
+        break;
+    case OP_DEFINE_GLOBAL_SLOT:
+    {
+        uint8_t value = rk(lowering.depth - 1);
+        lowering.depth--;
+        emitOp(REG_DEFINE_GLOBAL);
+        emit(code[offset + 1]);
+        emit(value);
+        break;
+    }
+    case OP_SET_GLOBAL_SLOT:
+    {
+        uint8_t value = rk(lowering.depth - 1);
+        emitOp(REG_SET_GLOBAL);
+        emit(code[offset + 1]);
+        emit(value);
+        break;
+    }
+    case OP_EQUAL:
+    case OP_IS:
+        binary(REG_EQUAL);
+        break;
+    case OP_GREATER:
+    case OP_GREATER_NN:
+        binary(REG_GREATER);
+        break;
+    case OP_LESS:
+    case OP_LESS_NN:
+        binary(REG_LESS);
+        break;
+    // Register code has no negated comparisons; they take a REG_NOT.
+    case OP_GREATER_EQUAL:
+    case OP_GREATER_EQUAL_NN:
+        binary(REG_LESS);
+        unary(REG_NOT);
+        break;
+    case OP_LESS_EQUAL:
+    case OP_LESS_EQUAL_NN:
+        binary(REG_GREATER);
+        unary(REG_NOT);
+        break;
+    case OP_NOT_EQUAL:
+        binary(REG_EQUAL);
+        unary(REG_NOT);
+        break;
+    case OP_ADD:
+    case OP_ADD_NN:
+        binary(REG_ADD);
+        break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NN:
+        binary(REG_SUBTRACT);
+        break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NN:
+        binary(REG_MULTIPLY);
+        break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NN:
+        binary(REG_DIVIDE);
+        break;
+    case OP_NOT:
+        unary(REG_NOT);
+        break;
+    case OP_NEGATE:
+        unary(REG_NEGATE);
+        break;
+    case OP_ASK:
+        unary(REG_ASK);
+        break;
+    case OP_TO_STRING:
+        unary(REG_TO_STRING);
+        break;
+    case OP_CONCAT_N:
+    {
+        // The parts have to sit in consecutive registers. The result
+        // overwrites the first part, so a following store to a local can
+        // not retarget it.
+        int first = lowering.depth - code[offset + 1];
+        for (int position = first; position < lowering.depth; position++)
+            materialize(position);
+        lowering.depth = first;
+        emitOp(REG_CONCAT);
+        emit((uint8_t)first);
+        emit(code[offset + 1]);
+        push(registerOperand(first));
+        break;
+    }
+    case OP_WRITE:
+    {
+        uint8_t value = rk(lowering.depth - 1);
+        lowering.depth--;
+        emitOp(REG_WRITE);
+        emit(value);
+        break;
+    }
+    case OP_JUMP:
+    {
+        int target = jumpTarget(source, offset);
+        flush(lowering.depth);
+        recordDepth(target, lowering.depth);
+        emitOp(REG_JUMP);
+        addPatch(target);
+        break;
+    }
+    case OP_JUMP_IF_FALSE:
+    {
+        int target = jumpTarget(source, offset);
+        int top = lowering.depth - 1;
+        // When both paths start by popping the condition it never has to be
+        // copied into its own register.
+        if (code[target] == OP_POP && code[offset + 3] == OP_POP)
+        {
+            flush(top);
+        }
+        else
+        {
+            flush(lowering.depth);
+        }
+        uint8_t condition = rk(top);
+        recordDepth(target, lowering.depth);
+        emitOp(REG_JUMP_IF_FALSE);
+        emit(condition);
+        addPatch(target);
+        break;
+    }
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_LESS_NN:
+    case OP_JUMP_IF_NOT_GREATER_NN:
+    {
+        int target = jumpTarget(source, offset);
+        flush(lowering.depth - 2);
+        uint8_t b = rk(lowering.depth - 2);
+        uint8_t c = rk(lowering.depth - 1);
+        lowering.depth -= 2;
+        recordDepth(target, lowering.depth);
+        bool less = code[offset] == OP_JUMP_IF_NOT_LESS ||
+                    code[offset] == OP_JUMP_IF_NOT_LESS_NN;
+        emitOp(less ? REG_JUMP_IF_NOT_LESS : REG_JUMP_IF_NOT_GREATER);
+        emit(b);
+        emit(c);
+        addPatch(target);
+        break;
+    }
+    case OP_LOOP:
+    {
+        flush(lowering.depth);
+        int jump = lowering.out.count + 3 - lowering.outOffsets[jumpTarget(source, offset)];
+        if (jump > UINT16_MAX)
+        {
+            lowering.failed = true;
+            break;
+        }
+        emitOp(REG_LOOP);
+        emit((jump >> 8) & 0xff);
+        emit(jump & 0xff);
+        break;
+    }
+    case OP_FOR_RANGE:
+    {
+        flush(lowering.depth);
+        int jump = lowering.out.count + 6 - lowering.outOffsets[jumpTarget(source, offset)];
+        if (jump > UINT16_MAX)
+        {
+            lowering.failed = true;
+            break;
+        }
+        emitOp(REG_FOR_RANGE);
+        emit(code[offset + 3]);
+        emit(code[offset + 4]);
+        emit(code[offset + 5]);
+        emit((jump >> 8) & 0xff);
+        emit(jump & 0xff);
+        break;
+    }
+    case OP_RETURN:
+        emitOp(REG_RETURN);
+        break;
+    default:
+        lowering.failed = true;
+        break;
+    }
+}
+
+static bool endsBlock(uint8_t op)
+{
+    return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN;
+}
+
+bool lowerToRegisters(Chunk *chunk)
+{
+    // The tables are indexed by stack code offsets, so they are sized and
+    // freed by the stack code's length even after chunk->count is replaced.
+    int sourceCount = chunk->count;
+    lowering.source = chunk;
+    initChunk(&lowering.out);
+    lowering.outOffsets = ALLOCATE(int, sourceCount + 1);
+    lowering.depths = ALLOCATE(int, sourceCount + 1);
+    lowering.targets = ALLOCATE(bool, sourceCount + 1);
+    lowering.patches = NULL;
+    lowering.patchCount = 0;
+    lowering.patchCapacity = 0;
+    lowering.depth = 0;
+    lowering.lastDestination = -1;
+    lowering.failed = false;
+
+    for (int i = 0; i <= sourceCount; i++)
+    {
+        lowering.depths[i] = -1;
+        lowering.targets[i] = false;
+    }
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        if (isJumpInstruction(chunk->code[offset]))
+            lowering.targets[jumpTarget(chunk, offset)] = true;
+    }
+
+    bool reachable = true;
+    for (int offset = 0; offset < chunk->count && !lowering.failed;
+         offset += instructionLength(chunk, offset))
+    {
+        lowering.line = chunk->lines[offset];
+        if (lowering.targets[offset])
+        {
+            if (reachable)
+            {
+                flush(lowering.depth);
+            }
+            else if (lowering.depths[offset] != -1)
+            {
+                lowering.depth = lowering.depths[offset];
+            }
+            for (int position = 0; position < lowering.depth; position++)
+            {
+                lowering.stack[position] = registerOperand(position);
+            }
+            lowering.lastDestination = -1;
+        }
+        lowering.outOffsets[offset] = lowering.out.count;
+        lowerInstruction(offset);
+        reachable = !endsBlock(chunk->code[offset]);
+    }
+
+    for (int i = 0; i < lowering.patchCount && !lowering.failed; i++)
+    {
+        Patch *patch = &lowering.patches[i];
+        int jump = lowering.outOffsets[patch->target] - patch->offset - 2;
+        if (jump > UINT16_MAX)
+        {
+            lowering.failed = true;
+            break;
+        }
+        lowering.out.code[patch->offset] = (jump >> 8) & 0xff;
+        lowering.out.code[patch->offset + 1] = jump & 0xff;
+    }
+
+    bool lowered = !lowering.failed;
+    if (lowered)
+    {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+        chunk->code = lowering.out.code;
+        chunk->lines = lowering.out.lines;
+        chunk->count = lowering.out.count;
+        chunk->capacity = lowering.out.capacity;
+        chunk->registerCode = true;
+    }
+    else
+    {
+        freeChunk(&lowering.out);
+    }
+
+    FREE_ARRAY(int, lowering.outOffsets, sourceCount + 1);
+    FREE_ARRAY(int, lowering.depths, sourceCount + 1);
+    FREE_ARRAY(bool, lowering.targets, sourceCount + 1);
+    FREE_ARRAY(Patch, lowering.patches, lowering.patchCapacity);
+    return lowered;
+}
\ No newline at end of file
@@ -4,14 +4,6 @@
 #include "kavya/main.h"
 #include "kavya/scanner.h"
 
-typedef struct
-{
-
-    const char *start;
-    const char *current;
-    int line;
-} Scanner;
-
 Scanner scanner;
 
 void initScanner(const char *source)
@@ -19,6 +11,7 @@ void initScanner(const char *source)
     scanner.start = source;
     scanner.current = source;
     scanner.line = 1;
+    scanner.interpolationDepth = 0;
 }
 
 static bool isAlpha(char c)
@@ -176,6 +169,8 @@ static TokenType identifierType()
             }
         }
         break;
+    case 'm':
+        return checkKeyword(1, 4, "atch", TOKEN_MATCH);
     case 'n':
         return checkKeyword(1, 3, "ull", TOKEN_NULL);
     case 'o':
@@ -244,6 +239,15 @@ static Token string()
 {
     while (peek() != '"' && !isAtEnd())
     {
+        if (peek() == '$' && peekNext() == '{')
+        {
+            if (scanner.interpolationDepth == MAX_INTERPOLATION_DEPTH)
+                return errorToken("Interpolation nested too deeply.");
+            advance();
+            advance();
+            scanner.braces[scanner.interpolationDepth++] = 0;
+            return makeToken(TOKEN_INTERPOLATION);
+        }
         if (peek() == '\n')
             scanner.line++;
         advance();
@@ -292,8 +296,20 @@ Token scanToken()
     case ')':
         return makeToken(TOKEN_RIGHT_PAREN);
     case '{':
+        if (scanner.interpolationDepth > 0)
+            scanner.braces[scanner.interpolationDepth - 1]++;
         return makeToken(TOKEN_LEFT_BRACE);
     case '}':
+        if (scanner.interpolationDepth > 0)
+        {
+            int *braces = &scanner.braces[scanner.interpolationDepth - 1];
+            if (*braces == 0)
+            {
+                scanner.interpolationDepth--;
+                return string();
+            }
+            (*braces)--;
+        }
         return makeToken(TOKEN_RIGHT_BRACE);
     case ';':
         return makeToken(TOKEN_SEMICOLON);
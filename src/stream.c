@@ -0,0 +1,146 @@
+#include <pthread.h>
+
+#include "kavya/compiler.h"
+#include "kavya/memory.h"
+#include "kavya/stream.h"
+
+// Compiled batches waiting to run. A small bound keeps the compiler from
+// running far ahead of the VM, which would only hold on to more chunks.
+#define QUEUE_CAPACITY 4
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    // Signalled whenever a batch is added or taken, or the run ends.
+    pthread_cond_t changed;
+    Chunk *batches[QUEUE_CAPACITY];
+    int head;
+    int count;
+    const char *source;
+    // Set by the compiler once it has compiled its last batch.
+    bool finished;
+    bool compileError;
+    // Set by the VM when a batch fails, so no more are compiled.
+    bool cancelled;
+} BatchQueue;
+
+// Waits for room in the queue. Returns false, without adding the batch, if
+// the VM has stopped.
+static bool putBatch(BatchQueue *queue, Chunk *chunk)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == QUEUE_CAPACITY && !queue->cancelled)
+        pthread_cond_wait(&queue->changed, &queue->lock);
+
+    bool added = !queue->cancelled;
+    if (added)
+    {
+        queue->batches[(queue->head + queue->count) % QUEUE_CAPACITY] = chunk;
+        queue->count++;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return added;
+}
+
+// Waits for the next batch, or returns NULL once there are no more.
+static Chunk *takeBatch(BatchQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->finished)
+        pthread_cond_wait(&queue->changed, &queue->lock);
+
+    Chunk *chunk = NULL;
+    if (queue->count > 0)
+    {
+        chunk = queue->batches[queue->head];
+        queue->head = (queue->head + 1) % QUEUE_CAPACITY;
+        queue->count--;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return chunk;
+}
+
+static void freeBatch(Chunk *chunk)
+{
+    freeChunk(chunk);
+    FREE(Chunk, chunk);
+}
+
+// The compiler thread. After a compile error it keeps compiling, only to
+// report the errors after it, and queues nothing more.
+static void *compileBatches(void *argument)
+{
+    BatchQueue *queue = argument;
+    beginBatches(queue->source);
+
+    bool compiled = true;
+    bool last = false;
+    while (!last)
+    {
+        Chunk *chunk = ALLOCATE(Chunk, 1);
+        initChunk(chunk);
+        compiled = compileBatch(chunk, &last);
+        if (!compiled || !putBatch(queue, chunk))
+        {
+            freeBatch(chunk);
+            if (compiled)
+                break;
+        }
+    }
+    endBatches();
+
+    pthread_mutex_lock(&queue->lock);
+    queue->finished = true;
+    queue->compileError = !compiled;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+InterpretResult interpretStreamed(const char *source, ExecutionLimits limits)
+{
+    // Both would print from the two threads at once.
+    if (traceExecution || dumpBytecode)
+        return interpret(source, limits);
+
+    BatchQueue queue = {.head = 0, .count = 0, .source = source};
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+
+    vm.streaming = true;
+    pthread_t compiler;
+    if (pthread_create(&compiler, NULL, compileBatches, &queue) != 0)
+    {
+        vm.streaming = false;
+        return interpret(source, limits);
+    }
+
+    setLimits(limits);
+    InterpretResult result = INTERPRET_OK;
+    Chunk *chunk;
+    while ((chunk = takeBatch(&queue)) != NULL)
+    {
+        result = runChunk(chunk);
+        freeBatch(chunk);
+        if (result != INTERPRET_OK)
+            break;
+    }
+
+    pthread_mutex_lock(&queue.lock);
+    queue.cancelled = true;
+    pthread_cond_broadcast(&queue.changed);
+    pthread_mutex_unlock(&queue.lock);
+    pthread_join(compiler, NULL);
+    vm.streaming = false;
+
+    while (queue.count > 0)
+        freeBatch(takeBatch(&queue));
+    pthread_cond_destroy(&queue.changed);
+    pthread_mutex_destroy(&queue.lock);
+
+    if (result == INTERPRET_OK && queue.compileError)
+        return INTERPRET_COMPILE_ERROR;
+    return result;
+}
\ No newline at end of file
@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "kavya/memory.h"
+#include "kavya/types.h"
+
+// The pass walks the chunk the way computeMaxStackDepth() does, carrying an
+// abstract state instead of a depth: one type per stack slot, followed by
+// one per global. States are only kept at jump targets, where paths meet.
+// Whenever a path widens the state at a target, the code from there is
+// walked again; types only ever widen, so this settles. A last walk over
+// the settled states rewrites the operators.
+
+// Globals past this many are not tracked and always hold TYPE_ANY.
+#define TRACKED_GLOBALS UINT8_COUNT
+
+typedef enum
+{
+    // No path has reached the slot yet.
+    TYPE_NONE,
+    TYPE_NUMBER,
+    TYPE_ANY
+} Type;
+
+typedef struct
+{
+    Chunk *chunk;
+    int globalCount;
+    // Types per slot: maxStackDepth stack slots, then globalCount globals.
+    int width;
+    // State at each jump target, or NULL until a path reaches it, and the
+    // stack depth there.
+    uint8_t **states;
+    int *depths;
+    bool *isTarget;
+    bool *queued;
+    int *pending;
+    int pendingCount;
+} Inference;
+
+static Inference inference;
+
+static Type join(Type a, Type b)
+{
+    if (a == TYPE_NONE)
+        return b;
+    if (b == TYPE_NONE || a == b)
+        return a;
+    return TYPE_ANY;
+}
+
+static int readLong(uint8_t *operands)
+{
+    return (operands[0] << 16) | (operands[1] << 8) | operands[2];
+}
+
+static Type constantType(int index)
+{
+    return IS_NUMBER(inference.chunk->constants.values[index]) ? TYPE_NUMBER : TYPE_ANY;
+}
+
+static Type globalType(uint8_t *types, int slot)
+{
+    return slot < inference.globalCount ? (Type)types[inference.chunk->maxStackDepth + slot]
+                                        : TYPE_ANY;
+}
+
+static void setGlobalType(uint8_t *types, int slot, Type type)
+{
+    if (slot < inference.globalCount)
+        types[inference.chunk->maxStackDepth + slot] = (uint8_t)type;
+}
+
+// Merges a state into the one kept at `target`, queueing the target to be
+// walked again if that changed anything.
+static void reach(int target, uint8_t *types, int depth)
+{
+    uint8_t *state = inference.states[target];
+    bool changed = false;
+    if (state == NULL)
+    {
+        state = ALLOCATE(uint8_t, inference.width);
+        memcpy(state, types, inference.width);
+        inference.states[target] = state;
+        inference.depths[target] = depth;
+        changed = true;
+    }
+    else
+    {
+        for (int i = 0; i < inference.width; i++)
+        {
+            // Slots above the depth are dead; the globals always count.
+            if (i >= depth && i < inference.chunk->maxStackDepth)
+                continue;
+            Type joined = join((Type)state[i], (Type)types[i]);
+            changed = changed || joined != state[i];
+            state[i] = (uint8_t)joined;
+        }
+    }
+    if (changed && !inference.queued[target])
+    {
+        inference.queued[target] = true;
+        inference.pending[inference.pendingCount++] = target;
+    }
+}
+
+static uint8_t numericForm(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_ADD:
+        return OP_ADD_NN;
+    case OP_SUBTRACT:
+        return OP_SUBTRACT_NN;
+    case OP_MULTIPLY:
+        return OP_MULTIPLY_NN;
+    case OP_DIVIDE:
+        return OP_DIVIDE_NN;
+    case OP_GREATER:
+        return OP_GREATER_NN;
+    case OP_LESS:
+        return OP_LESS_NN;
+    case OP_GREATER_EQUAL:
+        return OP_GREATER_EQUAL_NN;
+    case OP_LESS_EQUAL:
+        return OP_LESS_EQUAL_NN;
+    case OP_JUMP_IF_NOT_LESS:
+        return OP_JUMP_IF_NOT_LESS_NN;
+    case OP_JUMP_IF_NOT_GREATER:
+        return OP_JUMP_IF_NOT_GREATER_NN;
+    default:
+        return op;
+    }
+}
+
+// Walks straight-line code from the target at `start` until control leaves
+// it, updating `types` in place. With `stats` set, proven operators are
+// rewritten and counted.
+static void walk(int start, uint8_t *types, TypeStats *stats)
+{
+    Chunk *chunk = inference.chunk;
+    int depth = inference.depths[start];
+    int offset = start;
+    for (;;)
+    {
+        uint8_t *code = &chunk->code[offset];
+        uint8_t op = code[0];
+        int next = offset + instructionLength(chunk, offset);
+
+        uint8_t numeric = numericForm(op);
+        if (numeric != op && stats != NULL)
+        {
+            stats->sites++;
+            if (types[depth - 1] == TYPE_NUMBER && types[depth - 2] == TYPE_NUMBER)
+            {
+                code[0] = numeric;
+                stats->proven++;
+            }
+        }
+
+        switch (op)
+        {
+        case OP_CONSTANT:
+            types[depth++] = constantType(code[1]);
+            break;
+        case OP_CONSTANT_LONG:
+            types[depth++] = constantType(readLong(code + 1));
+            break;
+        case OP_GET_LOCAL:
+            types[depth] = types[code[1]];
+            depth++;
+            break;
+        case OP_GET_LOCAL_2:
+            types[depth] = types[code[1]];
+            depth++;
+            types[depth] = types[code[2]];
+            depth++;
+            break;
+        case OP_SET_LOCAL:
+            types[code[1]] = types[depth - 1];
+            break;
+        case OP_SET_LOCAL_POP:
+            types[code[1]] = types[--depth];
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+            // A number added to anything else fails, so a number results.
+            types[code[1]] = constantType(code[2]) == TYPE_NUMBER ? TYPE_NUMBER : TYPE_ANY;
+            break;
+        case OP_GET_GLOBAL_SLOT:
+            types[depth++] = globalType(types, code[1]);
+            break;
+        case OP_GET_GLOBAL_SLOT_LONG:
+            types[depth++] = globalType(types, readLong(code + 1));
+            break;
+        case OP_SET_GLOBAL_SLOT:
+            setGlobalType(types, code[1], (Type)types[depth - 1]);
+            break;
+        case OP_SET_GLOBAL_SLOT_LONG:
+            setGlobalType(types, readLong(code + 1), (Type)types[depth - 1]);
+            break;
+        case OP_DEFINE_GLOBAL_SLOT:
+            setGlobalType(types, code[1], (Type)types[--depth]);
+            break;
+        case OP_DEFINE_GLOBAL_SLOT_LONG:
+            setGlobalType(types, readLong(code + 1), (Type)types[--depth]);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_NN:
+            // Strings only add to strings, so one number operand makes the
+            // other a number too.
+            depth--;
+            types[depth - 1] = types[depth - 1] == TYPE_NUMBER || types[depth] == TYPE_NUMBER
+                                   ? TYPE_NUMBER
+                                   : TYPE_ANY;
+            break;
+        case OP_CONCAT_N:
+        {
+            // Likewise, one number part makes every part a number.
+            Type type = TYPE_ANY;
+            for (int part = 0; part < code[1]; part++)
+                type = types[--depth] == TYPE_NUMBER ? TYPE_NUMBER : type;
+            types[depth++] = (uint8_t)type;
+            break;
+        }
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_SUBTRACT_NN:
+        case OP_MULTIPLY_NN:
+        case OP_DIVIDE_NN:
+            types[--depth - 1] = TYPE_NUMBER;
+            break;
+        case OP_NEGATE:
+            types[depth - 1] = TYPE_NUMBER;
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+            reach(jumpTarget(chunk, offset), types, depth);
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS_NN:
+        case OP_JUMP_IF_NOT_GREATER_NN:
+            depth -= 2;
+            reach(jumpTarget(chunk, offset), types, depth);
+            break;
+        case OP_FOR_RANGE:
+            // Its constants are numbers, so the counter is one if it runs.
+            types[code[3]] = TYPE_NUMBER;
+            reach(jumpTarget(chunk, offset), types, depth);
+            break;
+        case OP_MATCH_TABLE:
+        case OP_MATCH_HASH:
+        {
+            // Every jump table entry is reached with the subject popped.
+            int entries = offset + instructionLength(chunk, offset);
+            int stride = instructionLength(chunk, entries);
+            depth--;
+            for (int entry = 0; entry < matchEntryCount(chunk, offset); entry++)
+                reach(entries + entry * stride, types, depth);
+            return;
+        }
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+            reach(jumpTarget(chunk, offset), types, depth);
+            return;
+        case OP_RETURN:
+            return;
+        case OP_POP:
+        case OP_WRITE:
+            depth--;
+            break;
+        default:
+            // Everything else leaves a value that is not a number, such as a
+            // boolean, or that could be anything, such as input.
+            depth += instructionStackEffect(chunk, offset);
+            types[depth - 1] = TYPE_ANY;
+            break;
+        }
+
+        if (next >= chunk->count)
+            return;
+        if (inference.isTarget[next])
+        {
+            reach(next, types, depth);
+            return;
+        }
+        offset = next;
+    }
+}
+
+void inferTypes(Chunk *chunk, TypeStats *stats)
+{
+    if (chunk->count == 0)
+        return;
+
+    int globalCount = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        uint8_t *code = &chunk->code[offset];
+        int slot = -1;
+        if (code[0] == OP_GET_GLOBAL_SLOT || code[0] == OP_SET_GLOBAL_SLOT ||
+            code[0] == OP_DEFINE_GLOBAL_SLOT)
+            slot = code[1];
+        if (slot >= globalCount)
+            globalCount = slot + 1 < TRACKED_GLOBALS ? slot + 1 : TRACKED_GLOBALS;
+    }
+
+    inference.width = chunk->maxStackDepth + globalCount;
+    if (inference.width == 0)
+        return;
+    inference.chunk = chunk;
+    inference.globalCount = globalCount;
+    inference.states = ALLOCATE(uint8_t *, chunk->count);
+    inference.depths = ALLOCATE(int, chunk->count);
+    inference.isTarget = ALLOCATE(bool, chunk->count);
+    inference.queued = ALLOCATE(bool, chunk->count);
+    inference.pending = ALLOCATE(int, chunk->count);
+    inference.pendingCount = 0;
+    memset(inference.states, 0, chunk->count * sizeof(uint8_t *));
+    memset(inference.isTarget, 0, chunk->count * sizeof(bool));
+    memset(inference.queued, 0, chunk->count * sizeof(bool));
+    inference.isTarget[0] = true;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        if (isJumpInstruction(chunk->code[offset]))
+            inference.isTarget[jumpTarget(chunk, offset)] = true;
+    }
+
+    // Globals hold nothing yet; reading one before it is defined fails.
+    uint8_t *types = ALLOCATE(uint8_t, inference.width);
+    memset(types, TYPE_ANY, inference.width);
+    reach(0, types, 0);
+    while (inference.pendingCount > 0)
+    {
+        int target = inference.pending[--inference.pendingCount];
+        inference.queued[target] = false;
+        memcpy(types, inference.states[target], inference.width);
+        walk(target, types, NULL);
+    }
+
+    for (int offset = 0; offset < chunk->count; offset++)
+    {
+        if (inference.states[offset] == NULL)
+            continue;
+        memcpy(types, inference.states[offset], inference.width);
+        walk(offset, types, stats);
+    }
+
+    for (int offset = 0; offset < chunk->count; offset++)
+    {
+        FREE_ARRAY(uint8_t, inference.states[offset], inference.width);
+    }
+    FREE_ARRAY(uint8_t, types, inference.width);
+    FREE_ARRAY(uint8_t *, inference.states, chunk->count);
+    FREE_ARRAY(int, inference.depths, chunk->count);
+    FREE_ARRAY(bool, inference.isTarget, chunk->count);
+    FREE_ARRAY(bool, inference.queued, chunk->count);
+    FREE_ARRAY(int, inference.pending, chunk->count);
+}
\ No newline at end of file
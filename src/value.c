@@ -33,6 +33,26 @@ void freeValueArray(ValueArray *array)
 
 void printValue(Value value)
 {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value))
+    {
+        printf(AS_BOOL(value) ? "true" : "false");
+    }
+    else if (IS_NULL(value))
+    {
+        printf("null");
+    }
+    else if (IS_NUMBER(value))
+    {
+        // Integers print as the double they equal, so a number prints the
+        // same whichever kind it happens to be held in.
+        printf("%g", AS_NUMBER(value));
+    }
+    else if (IS_OBJ(value))
+    {
+        printObject(value);
+    }
+#else
     switch (value.type)
     {
     case VAL_BOOL:
@@ -42,16 +62,27 @@ void printValue(Value value)
         printf("null");
         break;
     case VAL_NUMBER:
+    case VAL_INT:
         printf("%g", AS_NUMBER(value));
         break;
     case VAL_OBJ:
         printObject(value);
         break;
+    case VAL_UNDEFINED:
+        break;
     }
+#endif
 }
 
 bool valuesEqual(Value a, Value b)
 {
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        return numbersEqual(a, b);
+    }
+#ifdef NAN_BOXING
+    return a == b;
+#else
     if (a.type != b.type)
         return false;
 
@@ -61,11 +92,68 @@ bool valuesEqual(Value a, Value b)
         return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NULL:
         return true;
-    case VAL_NUMBER:
-        return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ:
         return AS_OBJ(a) == AS_OBJ(b);
     default:
         return false; // Unreacable
     }
+#endif
+}
+
+// Unlike valuesEqual(), integers never match doubles and 0.0 never matches
+// -0.0, so identical values can share a constant slot.
+bool valuesIdentical(Value a, Value b)
+{
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if (a.type != b.type)
+        return false;
+
+    switch (a.type)
+    {
+    case VAL_BOOL:
+        return AS_BOOL(a) == AS_BOOL(b);
+    case VAL_NUMBER:
+        return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+    case VAL_INT:
+        return AS_INT(a) == AS_INT(b);
+    case VAL_OBJ:
+        return AS_OBJ(a) == AS_OBJ(b);
+    default:
+        return true;
+    }
+#endif
+}
+
+uint32_t hashValue(Value value)
+{
+    uint64_t bits;
+#ifdef NAN_BOXING
+    bits = value;
+#else
+    switch (value.type)
+    {
+    case VAL_BOOL:
+        bits = AS_BOOL(value);
+        break;
+    case VAL_NUMBER:
+        memcpy(&bits, &value.as.number, sizeof(double));
+        break;
+    case VAL_INT:
+        bits = (uint64_t)AS_INT(value);
+        break;
+    case VAL_OBJ:
+        bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+        break;
+    default:
+        bits = 0;
+        break;
+    }
+    bits ^= (uint64_t)value.type << 56;
+#endif
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
 }
\ No newline at end of file
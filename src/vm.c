@@ -1,12 +1,18 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
 
 #include "kavya/main.h"
 #include "kavya/compiler.h"
 #include "kavya/debug.h"
+#include "kavya/jit.h"
+#include "kavya/looptrace.h"
 #include "kavya/object.h"
 #include "kavya/memory.h"
+#include "kavya/recorder.h"
+#include "kavya/register.h"
 #include "kavya/vm.h"
 
 VM vm;
@@ -28,24 +34,166 @@ static void runtimeError(const char *format, ...)
     int line = vm.chunk->lines[instruction];
     (void)line;
 
+    // Register code is not recorded.
+    if (flightRecorderEnabled && !vm.chunk->registerCode)
+        dumpFlightRecorder(vm.ip);
+
     resetStack();
 }
 
+// Most fuel back edges charge between two calls to checkLimits(), which
+// bounds how late a deadline is noticed.
+#define LIMIT_CHECK_INTERVAL 65536
+
+int64_t monotonicNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void refillFuelCheck()
+{
+    int64_t window = vm.fuel < LIMIT_CHECK_INTERVAL ? vm.fuel : LIMIT_CHECK_INTERVAL;
+    if (vm.fuel != INT64_MAX)
+        vm.fuel -= window;
+    vm.fuelCheck = window;
+}
+
+void setLimits(ExecutionLimits limits)
+{
+    vm.fuel = limits.fuel > 0 ? limits.fuel : INT64_MAX;
+    vm.deadline = 0;
+    if (limits.timeoutMs > 0)
+    {
+        // A deadline past what the clock can reach is no deadline at all.
+        int64_t now = monotonicNanos();
+        vm.deadline = limits.timeoutMs < (INT64_MAX - now) / 1000000
+                          ? now + limits.timeoutMs * 1000000
+                          : INT64_MAX;
+    }
+    refillFuelCheck();
+}
+
+// Called once back edges have charged more than vm.fuelCheck. Returns
+// false, after reporting which limit was hit, when execution has to stop.
+bool checkLimits()
+{
+    const char *exceeded = NULL;
+    if (vm.fuel != INT64_MAX && (vm.fuel += vm.fuelCheck) < 0)
+        exceeded = "Fuel exhausted.";
+    else if (vm.deadline != 0 && monotonicNanos() >= vm.deadline)
+        exceeded = "Time limit exceeded.";
+
+    if (exceeded == NULL)
+    {
+        refillFuelCheck();
+        return true;
+    }
+
+    fprintf(stderr, "%s\n", exceeded);
+    if (flightRecorderEnabled && !vm.chunk->registerCode)
+        dumpFlightRecorder(vm.ip);
+    resetStack();
+    return false;
+}
+
 void initVM()
 {
+    vm.stack = ALLOCATE(Value, STACK_MAX);
+    vm.stackCapacity = STACK_MAX;
     resetStack();
+    setLimits((ExecutionLimits){0});
     vm.objects = NULL;
-    initTable(&vm.globals);
+    vm.streaming = false;
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
     initTable(&vm.strings);
 }
 
 void freeVM()
 {
-    freeTable(&vm.globals);
+    FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
     freeTable(&vm.strings);
     freeObjects();
 }
 
+static pthread_mutex_t sharedLock = PTHREAD_MUTEX_INITIALIZER;
+
+// While a script streams, the compiler thread interns strings and resolves
+// global slots as the VM thread runs, so both take this lock to touch the
+// string table, the object list or the global names.
+void lockShared()
+{
+    if (vm.streaming)
+        pthread_mutex_lock(&sharedLock);
+}
+
+void unlockShared()
+{
+    if (vm.streaming)
+        pthread_mutex_unlock(&sharedLock);
+}
+
+// Returns the slot holding the global called `name`, adding one the first
+// time the name is seen. Its value is only added by ensureGlobals().
+int resolveGlobalSlot(ObjString *name)
+{
+    lockShared();
+    Value slot;
+    int index;
+    if (tableGet(&vm.globalSlots, name, &slot))
+    {
+        index = (int)AS_INT(slot);
+    }
+    else
+    {
+        index = vm.globalNames.count;
+        writeValueArray(&vm.globalNames, OBJ_VAL(name));
+        tableSet(&vm.globalSlots, name, INT_VAL(index));
+    }
+    unlockShared();
+    return index;
+}
+
+// Gives every resolved global an undefined value before code that may use
+// it runs. Kept apart from resolveGlobalSlot() so the values only ever move
+// between runs.
+void ensureGlobals()
+{
+    lockShared();
+    int count = vm.globalNames.count;
+    unlockShared();
+    while (vm.globalValues.count < count)
+        writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+}
+
+const char *globalName(int slot)
+{
+    lockShared();
+    const char *name = AS_CSTRING(vm.globalNames.values[slot]);
+    unlockShared();
+    return name;
+}
+
+// Grows the stack once before a chunk runs, so push() itself never needs a
+// bounds check.
+void ensureStack(int depth)
+{
+    if (depth <= vm.stackCapacity)
+        return;
+
+    int oldCapacity = vm.stackCapacity;
+    while (vm.stackCapacity < depth)
+        vm.stackCapacity = GROW_CAPACITY(vm.stackCapacity);
+    vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
+    resetStack();
+}
+
 void push(Value value)
 {
     *vm.stackTop++ = value;
@@ -61,300 +209,360 @@ static Value peek(int distance)
     return vm.stackTop[-1 - distance];
 }
 
-static bool isFalsey(Value value)
+Value concatenate(ObjString *a, ObjString *b)
 {
-    return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value)) || (IS_NUMBER(value) && AS_NUMBER(value) == 0);
-}
-
-static void concatenate()
-{
-    ObjString *b = AS_STRING(pop());
-    ObjString *a = AS_STRING(pop());
-
     int length = a->length + b->length;
     char *chars = ALLOCATE(char, length + 1);
     memcpy(chars, a->chars, a->length + 1);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
     ObjString *result = takeString(chars, length);
-    push(OBJ_VAL(result));
+    return OBJ_VAL(result);
 }
 
-static inline uint8_t READ_BYTE()
+// Joins `count` values the way a chain of OP_ADDs would, with every part
+// evaluated up front. Strings are measured first and copied into a single
+// buffer, so only the result is hashed and interned. Returns false when the
+// chain would add a string to something else.
+bool concatenateValues(Value *parts, int count, Value *result)
 {
-    return *vm.ip++;
-}
+    int length = 0;
+    bool strings = true;
+    bool numbers = true;
+    for (int i = 0; i < count; i++)
+    {
+        strings = strings && IS_STRING(parts[i]);
+        numbers = numbers && IS_NUMBER(parts[i]);
+        if (strings)
+            length += AS_STRING(parts[i])->length;
+    }
 
-static inline Value READ_CONSTANT()
-{
-    return vm.chunk->constants.values[READ_BYTE()];
+    if (numbers)
+    {
+        Value sum = parts[0];
+        for (int i = 1; i < count; i++)
+            sum = numberAdd(sum, parts[i]);
+        *result = sum;
+        return true;
+    }
+    if (!strings)
+        return false;
+
+    char *chars = ALLOCATE(char, length + 1);
+    int written = 0;
+    for (int i = 0; i < count; i++)
+    {
+        ObjString *part = AS_STRING(parts[i]);
+        memcpy(chars + written, part->chars, part->length);
+        written += part->length;
+    }
+    chars[length] = '\0';
+    *result = OBJ_VAL(takeString(chars, length));
+    return true;
 }
 
-static inline uint16_t READ_SHORT()
+// The string printValue() writes for `value`.
+Value stringify(Value value)
 {
-    return (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]));
+    if (IS_STRING(value))
+        return value;
+
+    char buffer[32];
+    int length;
+    if (IS_BOOL(value))
+        length = snprintf(buffer, sizeof(buffer), "%s", AS_BOOL(value) ? "true" : "false");
+    else if (IS_NULL(value))
+        length = snprintf(buffer, sizeof(buffer), "null");
+    else
+        length = snprintf(buffer, sizeof(buffer), "%g", AS_NUMBER(value));
+    return OBJ_VAL(copyString(buffer, length));
 }
 
-static InterpretResult run()
+bool readInput(ObjString *message, Value *input)
 {
+    printf("%s", message->chars);
 
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                        \
-    do                                                  \
-    {                                                   \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
-        {                                               \
-            runtimeError("Operands must be numbers.");  \
-            return INTERPRET_RUNTIME_ERROR;             \
-        }                                               \
-        double b = AS_NUMBER(pop());                    \
-        double a = AS_NUMBER(pop());                    \
-        push(valueType(a op b));                        \
-    } while (false);
-
-    for (;;)
-    {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("        ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
-        {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
-#endif
+    size_t bufferSize = 256;
+    char *buffer = ALLOCATE(char, bufferSize);
+    size_t inputLength = 0;
+    int c;
 
-        uint8_t instruction = READ_BYTE();
-        switch (__builtin_expect(instruction, OP_CONSTANT))
-        {
-        case OP_CONSTANT:
-        {
-            Value constant = READ_CONSTANT();
-            push(constant);
-            break;
-        }
-        case OP_NULL:
-        {
-            push(NULL_VAL);
-            break;
-        }
-        case OP_TRUE:
-        {
-            push(BOOL_VAL(true));
-            break;
-        }
-        case OP_FALSE:
-        {
-            push(BOOL_VAL(false));
-            break;
-        }
-        case OP_POP:
-        {
-            pop();
-            break;
-        }
-        case OP_GET_LOCAL:
-        {
-            uint8_t slot = READ_BYTE();
-            push(vm.stack[slot]);
-            break;
-        }
-        case OP_SET_LOCAL:
-        {
-            uint8_t slot = READ_BYTE();
-            vm.stack[slot] = peek(0);
-            break;
-        }
-        case OP_GET_GLOBAL:
-        {
-            ObjString *name = READ_STRING();
-            Value value;
-            if (!tableGet(&vm.globals, name, &value))
-            {
-                runtimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(value);
-            break;
-        }
-        case OP_DEFINE_GLOBAL:
-        {
-            ObjString *name = READ_STRING();
-            tableSet(&vm.globals, name, peek(0));
-            pop();
-            break;
-        }
-        case OP_SET_GLOBAL:
-        {
-            ObjString *name = READ_STRING();
-            if (tableSet(&vm.globals, name, peek(0)))
-            {
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_EQUAL:
-        {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
-            break;
-        }
-        case OP_IS:
-        {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
-            break;
-        }
-        case OP_GREATER:
-        {
-            BINARY_OP(BOOL_VAL, >);
-            break;
-        }
-        case OP_LESS:
-        {
-            BINARY_OP(BOOL_VAL, <);
-            break;
-        }
-        case OP_ADD:
-        {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-            {
-                concatenate();
-            }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
-            {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
-            }
-            else
-            {
-                runtimeError(
-                    "Operands must be two numbers or two strings.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_SUBTRACT:
-        {
-            BINARY_OP(NUMBER_VAL, -);
-            break;
-        }
-        case OP_MULTIPLY:
-        {
-            BINARY_OP(NUMBER_VAL, *);
-            break;
-        }
-        case OP_DIVIDE:
-        {
-            BINARY_OP(NUMBER_VAL, /);
-            break;
-        }
-        case OP_NOT:
-        {
-            push(BOOL_VAL(isFalsey(pop())));
-            break;
-        }
-        case OP_NEGATE:
+    while ((c = getchar()) != '\n' && c != EOF)
+    {
+        if (inputLength == bufferSize - 1)
         {
-            if (!IS_NUMBER(peek(0)))
+            size_t oldSize = bufferSize;
+            bufferSize *= 1.5;
+            char *newBuffer = GROW_ARRAY(char, buffer, oldSize, bufferSize);
+            if (newBuffer == NULL)
             {
-                runtimeError("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
+                runtimeError("Memory allocation failed.");
+                FREE_ARRAY(char, buffer, oldSize);
+                return false;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        }
-        case OP_WRITE:
-        {
-            printValue(pop());
-            printf("\n");
-            break;
+            buffer = newBuffer;
         }
-        case OP_ASK:
-        {
-            ObjString *message = AS_STRING(pop());
-            printf("%s", message->chars);
+        buffer[inputLength++] = (char)c;
+    }
 
-            size_t bufferSize = 256;
-            char *buffer = ALLOCATE(char, bufferSize);
-            size_t inputLength = 0;
-            int c;
+    buffer[inputLength] = '\0';
 
-            while ((c = getchar()) != '\n' && c != EOF)
-            {
-                if (inputLength == bufferSize - 1)
-                {
-                    size_t oldSize = bufferSize;
-                    bufferSize *= 1.5;
-                    char *newBuffer = GROW_ARRAY(char, buffer, oldSize, bufferSize);
-                    if (newBuffer == NULL)
-                    {
-                        runtimeError("Memory allocation failed.");
-                        FREE_ARRAY(char, buffer, oldSize);
-                        return INTERPRET_RUNTIME_ERROR;
-                    }
-                    buffer = newBuffer;
-                }
-                buffer[inputLength++] = (char)c;
-            }
+    if (c == EOF && inputLength == 0)
+    {
+        FREE_ARRAY(char, buffer, bufferSize);
+        *input = OBJ_VAL(copyString("", 0));
+    }
+    else
+    {
+        *input = OBJ_VAL(takeString(buffer, inputLength));
+    }
+    return true;
+}
 
-            buffer[inputLength] = '\0';
+// Writes run()'s cached instruction pointer back to the VM.
+#define SAVE_IP() (vm.ip = ip)
 
-            if (c == EOF && inputLength == 0)
-            {
-                FREE_ARRAY(char, buffer, bufferSize);
-                push(OBJ_VAL(copyString("", 0)));
-            }
-            else
-            {
-                push(OBJ_VAL(takeString(buffer, inputLength)));
-            }
-            break;
-        }
-        case OP_JUMP:
-        {
-            uint16_t offset = READ_SHORT();
-            vm.ip += offset;
-            break;
-        }
-        case OP_JUMP_IF_FALSE:
-        {
-            uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0)))
-            {
-                vm.ip += offset;
-            }
-            break;
-        }
-        case OP_LOOP:
-        {
-            uint16_t offset = READ_SHORT();
-            vm.ip -= offset;
-            break;
-        }
-        case OP_RETURN:
-        {
-            return INTERPRET_OK;
-        }
-        default:
-        {
-            runtimeError("Unknown opcode %d.", instruction);
-            return INTERPRET_RUNTIME_ERROR;
-        }
-        }
+bool traceExecution = false;
+
+static void traceInstruction()
+{
+    printf("        ");
+    for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+    {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
     }
-#undef READ_STRING
-#undef BINARY_OP
+    printf("\n");
+    disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
 }
 
-InterpretResult interpret(const char *source)
+#ifdef KAVYA_COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() (vm.instructionCount++)
+#else
+#define COUNT_INSTRUCTION() ((void)0)
+#endif
+
+// Labels-as-values is a GNU extension; everything else uses the portable
+// switch, which is also the default.
+#if !defined(__GNUC__) || (!defined(KAVYA_DISPATCH_COMPUTED_GOTO) && \
+                           !defined(KAVYA_DISPATCH_THREADED))
+#undef KAVYA_DISPATCH_COMPUTED_GOTO
+#undef KAVYA_DISPATCH_THREADED
+#ifndef KAVYA_DISPATCH_SWITCH
+#define KAVYA_DISPATCH_SWITCH
+#endif
+#endif
+
+#ifdef KAVYA_DISPATCH_SWITCH
+#define DISPATCH_LOOP()          \
+    for (;;)                     \
+    {                            \
+        TRACE_INSTRUCTION();     \
+        COUNT_INSTRUCTION();     \
+        switch (__builtin_expect(READ_BYTE(), OP_CONSTANT))
+#define DISPATCH_END() }
+#define CASE(op) case op
+#define DEFAULT default
+#define DISPATCH() break
+#else
+#define DISPATCH_LOOP() DISPATCH();
+#define DISPATCH_END()
+#define CASE(op) op_##op
+#define DEFAULT op_unknown
+#define HANDLER(op) [op] = &&op_##op
+#ifdef KAVYA_DISPATCH_THREADED
+#define DISPATCH()                                          \
+    do                                                      \
+    {                                                       \
+        TRACE_INSTRUCTION();                                \
+        COUNT_INSTRUCTION();                                \
+        goto *threaded[ip++ - code];                        \
+    } while (false)
+#else
+#define DISPATCH()                            \
+    do                                        \
+    {                                         \
+        TRACE_INSTRUCTION();                  \
+        COUNT_INSTRUCTION();                  \
+        goto *dispatchTable[READ_BYTE()];     \
+    } while (false)
+#endif
+#endif
+
+// Rewrites the instruction being executed in place once its operand types
+// have been seen, so later executions take a specialized handler.
+#ifdef KAVYA_DISPATCH_THREADED
+#define QUICKEN(op)                                    \
+    do                                                 \
+    {                                                  \
+        ip[-1] = (op);                                 \
+        threaded[ip - 1 - code] = dispatchTable[op];   \
+    } while (false)
+#else
+#define QUICKEN(op) (ip[-1] = (op))
+#endif
+
+// Back edges charge the size of the loop body against the execution limits.
+#define CHARGE_FUEL(cost)                        \
+    do                                           \
+    {                                            \
+        if ((vm.fuelCheck -= (cost)) < 0)        \
+        {                                        \
+            SAVE_IP();                           \
+            if (!checkLimits())                  \
+                return INTERPRET_LIMIT_EXCEEDED; \
+        }                                        \
+    } while (false)
+
+// Hot loops leave the interpreter at their back edges. With the JIT, loop
+// iterations are counted per chunk, which is compiled once they reach the
+// JIT threshold; otherwise, each loop is recorded into a loop trace once it
+// gets hot. Either way, the loop continues outside the interpreter, which
+// is handed back the offset of the next instruction it must run.
+#define RUN_LOOP_TRACE()                                                  \
+    do                                                                    \
+    {                                                                     \
+        SAVE_IP();                                                        \
+        int resume = loopTraceBackEdge(vm.chunk,                          \
+                                       (int)(ip - vm.chunk->code));       \
+        if (resume == LOOP_TRACE_STOPPED)                                 \
+            return INTERPRET_LIMIT_EXCEEDED;                              \
+        JUMP(vm.chunk->code + resume);                                    \
+    } while (false)
+#ifdef KAVYA_JIT
+// Native code leaves at the loop header once a back edge it charged runs
+// out of fuel, so the limits are checked as if the interpreter had taken it.
+#define BACK_EDGE()                                                       \
+    do                                                                    \
+    {                                                                     \
+        if (jitEnabled)                                                   \
+        {                                                                 \
+            if (vm.chunk->jitCode == NULL &&                              \
+                vm.chunk->backEdges < JIT_THRESHOLD &&                    \
+                ++vm.chunk->backEdges == JIT_THRESHOLD)                   \
+                jitCompile(vm.chunk);                                     \
+            if (vm.chunk->jitCode != NULL)                                \
+            {                                                             \
+                JUMP(vm.chunk->code +                                     \
+                     jitRun(vm.chunk, (int)(ip - vm.chunk->code)));       \
+                CHARGE_FUEL(0);                                           \
+            }                                                             \
+        }                                                                 \
+        else if (loopTracesEnabled)                                       \
+            RUN_LOOP_TRACE();                                             \
+    } while (false)
+#elif defined(KAVYA_LOOP_TRACES)
+#define BACK_EDGE()                \
+    do                             \
+    {                              \
+        if (loopTracesEnabled)     \
+            RUN_LOOP_TRACE();      \
+    } while (false)
+#else
+#define BACK_EDGE() ((void)0)
+#endif
+
+// Undoes a specialization whose type guard failed and re-executes the
+// instruction with the generic handler. Not wrapped in do/while so that
+// DISPATCH() can break out of the switch.
+#define DEOPTIMIZE(op) \
+    {                  \
+        QUICKEN(op);   \
+        ip--;          \
+        DISPATCH();    \
+    }
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+#endif
+
+// run() never traces, so the default path has no tracing code at all.
+// --trace switches to runTraced(), which prints the stack and each
+// instruction before running it and keeps hot loops in the interpreter so
+// that every instruction shows up. Threaded chunks cache handler addresses
+// of whichever variant ran them first; the flag is fixed per process.
+#define RUN_FUNCTION run
+#define TRACE_INSTRUCTION() ((void)0)
+#define TRACE_JUMP(from) ((void)(from))
+#include "run.inc"
+#undef RUN_FUNCTION
+#undef TRACE_INSTRUCTION
+#undef TRACE_JUMP
+
+// --flight-recorder switches to runRecorded(), which keeps the JIT and loop
+// traces; the instructions they run are not recorded. Only jumps are, so
+// that straight-line code runs as fast as in run(). Without `hot`, GCC
+// lays this copy out noticeably slower than run(), which it inlines.
+static InterpretResult runRecorded(void) __attribute__((noinline, hot));
+#define RUN_FUNCTION runRecorded
+#define TRACE_INSTRUCTION() ((void)0)
+#define TRACE_JUMP(from) recordJump(from, ip)
+#include "run.inc"
+#undef RUN_FUNCTION
+#undef TRACE_INSTRUCTION
+#undef TRACE_JUMP
+#undef BACK_EDGE
+
+static InterpretResult runTraced(void) __attribute__((noinline, cold));
+#define RUN_FUNCTION runTraced
+#define TRACE_INSTRUCTION() (SAVE_IP(), traceInstruction())
+#define TRACE_JUMP(from) ((void)(from))
+#define BACK_EDGE() ((void)0)
+#include "run.inc"
+#undef RUN_FUNCTION
+#undef TRACE_INSTRUCTION
+#undef TRACE_JUMP
+#undef BACK_EDGE
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+// The register loop is built the same way. Every loop stays out of
+// interpret(): inlined together there, they measured slower.
+static InterpretResult runRegisters(void) __attribute__((noinline));
+#define RUN_FUNCTION runRegisters
+#define TRACE_INSTRUCTION() ((void)0)
+#include "runregisters.inc"
+#undef RUN_FUNCTION
+#undef TRACE_INSTRUCTION
+
+static InterpretResult runRegistersTraced(void) __attribute__((noinline, cold));
+#define RUN_FUNCTION runRegistersTraced
+#define TRACE_INSTRUCTION() \
+    disassembleInstruction(vm.chunk, (int)(ip - vm.chunk->code))
+#include "runregisters.inc"
+#undef RUN_FUNCTION
+#undef TRACE_INSTRUCTION
+
+// Runs a compiled chunk against the VM's current globals and limits.
+InterpretResult runChunk(Chunk *chunk)
+{
+    ensureGlobals();
+    ensureStack(chunk->maxStackDepth);
+    vm.chunk = chunk;
+    vm.ip = vm.chunk->code;
+    flightRecorder.chunk = chunk;
+    flightRecorder.count = 0;
+
+    InterpretResult result;
+    if (chunk->registerCode)
+        result = traceExecution ? runRegistersTraced() : runRegisters();
+    else if (traceExecution)
+        result = runTraced();
+    else if (flightRecorderEnabled)
+        result = runRecorded();
+    else
+        result = run();
+
+    flightRecorder.chunk = NULL;
+    return result;
+}
+
+InterpretResult interpret(const char *source, ExecutionLimits limits)
 {
     Chunk chunk;
     initChunk(&chunk);
@@ -365,11 +573,8 @@ InterpretResult interpret(const char *source)
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
-
-    InterpretResult result = run();
-
+    setLimits(limits);
+    InterpretResult result = runChunk(&chunk);
     freeChunk(&chunk);
     return result;
 }
\ No newline at end of file
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Checks constant folding on the scripts in tests/fold. Each script must
+# produce its .expected output at every optimization level, and its -O0
+# and -O1 bytecode must have the instruction counts its "instructions:"
+# comment records, -O0 being the code before folding.
+#
+# Usage: tests/fold.sh path/to/kavya
+
+kavya=${1:?usage: tests/fold.sh path/to/kavya}
+dir=$(dirname "$0")/fold
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failures=0
+
+# Prints stdout, stderr and the exit status of a run. The count that
+# KAVYA_COUNT_INSTRUCTIONS builds print varies by mode and is left out.
+observe()
+{
+    "$@" > "$tmp/stdout" 2> "$tmp/stderr"
+    status=$?
+    cat "$tmp/stdout"
+    echo "--- stderr"
+    sed '/^instructions: /d' "$tmp/stderr"
+    echo "--- exit $status"
+}
+
+# Instructions in the stack code --dump-bytecode prints for a script.
+instructions()
+{
+    "$kavya" "$1" --dump-bytecode "$2" 2> /dev/null |
+        awk '/^== / { code = $2 == "code" } code && /^[0-9][0-9][0-9][0-9] / { n++ } END { print n + 0 }'
+}
+
+fail()
+{
+    echo "FAIL $1"
+    failures=$((failures + 1))
+}
+
+for script in "$dir"/*.kav; do
+    name=$(basename "$script" .kav)
+    for level in -O0 -O1 -O2; do
+        observe "$kavya" $level "$script" > "$tmp/actual"
+        if ! cmp -s "$tmp/actual" "$dir/$name.expected"; then
+            fail "$name $level: output differs from $name.expected"
+            diff "$dir/$name.expected" "$tmp/actual" | head -20
+        fi
+    done
+
+    expected=$(sed -n 's|^// instructions: *\([0-9]*\) *-> *\([0-9]*\)$|\1 -> \2|p' "$script")
+    actual="$(instructions -O0 "$script") -> $(instructions -O1 "$script")"
+    if [ -z "$expected" ]; then
+        fail "$name: no instructions comment, counted $actual"
+    elif [ "$actual" != "$expected" ]; then
+        fail "$name: expected $expected instructions, counted $actual"
+    fi
+done
+
+if [ $failures -ne 0 ]; then
+    echo "$failures folding check(s) failed"
+    exit 1
+fi
+echo "folding checks passed"
@@ -0,0 +1,90 @@
+#!/bin/sh
+# Runs every script in tests/corpus and tests/fold in each execution mode
+# and checks that stdout, stderr and the exit status all match a run that
+# interprets every instruction without optimizing. Given the runtime
+# library, each script is also compiled with --emit-c and $CC (cc by
+# default) and the resulting program checked the same way.
+#
+# The scripts in tests/fuel run out of --fuel partway. Fuel is charged in
+# bytes of bytecode, so where they stop depends on the -O level and on
+# --registers, but for each kind of code it must not depend on whether
+# loops run in the interpreter, as loop traces or as native code.
+#
+# Usage: tests/run.sh path/to/kavya [path/to/libkavyart.a]
+
+kavya=${1:?usage: tests/run.sh path/to/kavya [path/to/libkavyart.a]}
+runtime=$2
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failures=0
+
+# Prints stdout, stderr and the exit status of a run. The count that
+# KAVYA_COUNT_INSTRUCTIONS builds print varies by mode and is left out.
+observe()
+{
+    "$@" < /dev/null > "$tmp/stdout" 2> "$tmp/stderr"
+    status=$?
+    cat "$tmp/stdout"
+    echo "--- stderr"
+    sed '/^instructions: /d' "$tmp/stderr"
+    echo "--- exit $status"
+}
+
+# Like observe, for the script compiled to C. A script that does not
+# compile reports its errors from --emit-c instead.
+observeEmitted()
+{
+    if ! "$kavya" --emit-c "$1" > "$tmp/program.c" 2> "$tmp/emit"; then
+        observe "$kavya" --emit-c "$1"
+    elif ${CC:-cc} -O2 -I "$dir/../include" "$tmp/program.c" "$runtime" \
+        -lm -pthread -o "$tmp/program" 2> "$tmp/cc"; then
+        observe "$tmp/program"
+    else
+        cat "$tmp/cc"
+    fi
+}
+
+fail()
+{
+    echo "FAIL $1"
+    diff "$tmp/reference" "$tmp/actual" | head -20
+    failures=$((failures + 1))
+}
+
+for script in "$dir"/corpus/*.kav "$dir"/fold/*.kav; do
+    name=$(basename "$script" .kav)
+    observe "$kavya" -O0 --no-jit --no-loop-traces "$script" > "$tmp/reference"
+
+    for mode in "" "--no-jit" "--no-jit --no-loop-traces" "--registers" \
+        "--registers --no-jit" "-O0" "-O2" "-O2 --registers" "--stream"; do
+        observe "$kavya" $mode "$script" > "$tmp/actual"
+        cmp -s "$tmp/reference" "$tmp/actual" || fail "$name ${mode:-default}"
+    done
+
+    if [ -n "$runtime" ]; then
+        observeEmitted "$script" > "$tmp/actual"
+        cmp -s "$tmp/reference" "$tmp/actual" || fail "$name --emit-c"
+    fi
+done
+
+for script in "$dir"/fuel/*.kav; do
+    name=$(basename "$script" .kav)
+    for fuel in 700 70001 400000; do
+        for code in "" "-O0" "-O2" "--registers"; do
+            observe "$kavya" $code --no-jit --no-loop-traces --fuel $fuel \
+                "$script" > "$tmp/reference"
+            for mode in "" "--no-jit" "--stream"; do
+                observe "$kavya" $code $mode --fuel $fuel "$script" > "$tmp/actual"
+                cmp -s "$tmp/reference" "$tmp/actual" ||
+                    fail "$name --fuel $fuel $code $mode"
+            done
+        done
+    done
+done
+
+if [ $failures -ne 0 ]; then
+    echo "$failures run(s) differed"
+    exit 1
+fi
+echo "all modes agree"